@@ -5,10 +5,18 @@
 #define TOY_RISCV_KERNEL_TEST_MEM_MANAGE 1
 #define TOY_RISCV_KERNEL_TEST_SCHEDULER 1
 #define TOY_RISCV_KERNEL_PRINT_TASK 1
+#define TOY_RISCV_KERNEL_LOCK_STATS 1
 #endif // TOY_RISCV_KERNEL_TEST_ALL
 
 #ifdef TOY_RISCV_KERNEL_TEST_MEM_MANAGE
 #define PRINT_BUDDY_DETAIL 1
 #endif // TOY_RISCV_KERNEL_TEST_MEM_MANAGE
 
+// The scheduler: define TOY_RISCV_KERNEL_SCHED_RR for plain round-robin, or
+// TOY_RISCV_KERNEL_SCHED_CFS for the completely fair scheduler; otherwise the
+// multi-level feedback queue is used.
+#if !defined(TOY_RISCV_KERNEL_SCHED_RR) && !defined(TOY_RISCV_KERNEL_SCHED_CFS)
+#define TOY_RISCV_KERNEL_SCHED_MLFQ 1
+#endif
+
 #endif //TOY_RISCV_KERNEL_KERNEL_DEF_H
@@ -0,0 +1,305 @@
+/**
+ * @file device_tree.c
+ * @brief Read the memory and hart layout from the flattened device tree
+ * @details
+ * See the devicetree specification, chapter 5 (Flattened Devicetree Format).
+ * All the fields in the blob are big-endian.
+ */
+
+#include "device_tree.h"
+
+#include "memlayout.h"
+#include "types.h"
+#include "utility.h"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 0x1
+#define FDT_END_NODE   0x2
+#define FDT_PROP       0x3
+#define FDT_NOP        0x4
+#define FDT_END        0x9
+
+#define FDT_MAX_DEPTH  16
+
+struct machine_info machine_info;
+
+struct fdt_header {
+    uint32 magic;
+    uint32 total_size;
+    uint32 off_dt_struct;
+    uint32 off_dt_strings;
+    uint32 off_mem_rsvmap;
+    uint32 version;
+    uint32 last_comp_version;
+    uint32 boot_cpuid_phys;
+    uint32 size_dt_strings;
+    uint32 size_dt_struct;
+};
+
+// What we have learnt about a node so far. Properties of a node always come
+// before its children, but "reg" may come before "device_type", so the
+// decision is made when the node ends.
+struct fdt_node {
+    int address_cells; // #address-cells for the children
+    int size_cells;    // #size-cells for the children
+    int is_memory;
+    int is_cpu;
+    int disabled;
+    int numa_node;
+    int has_sstc;
+    const uint8 *reg;
+    uint32 reg_length;
+};
+
+static inline uint32 fdt32(const void *addr) {
+    const uint8 *bytes = addr;
+    return ((uint32)bytes[0] << 24) | ((uint32)bytes[1] << 16) |
+           ((uint32)bytes[2] << 8) | (uint32)bytes[3];
+}
+
+static inline uint64 fdt_cells(const uint8 *addr, int cells) {
+    uint64 value = 0;
+    for (int i = 0; i < cells; i++) {
+        value = (value << 32) | fdt32(addr + 4 * i);
+    }
+    return value;
+}
+
+static inline uint32 fdt_align(uint32 offset) {
+    return (offset + 3) & ~3;
+}
+
+static int starts_with(const char *str, const char *prefix) {
+    while (*prefix != '\0') {
+        if (*str != *prefix) return 0;
+        str++;
+        prefix++;
+    }
+    return 1;
+}
+
+// Out-of-range node ids are folded into node 0.
+static int checked_numa_node(uint32 node) {
+    return node < MAX_NUMA_NODES ? (int)node : 0;
+}
+
+static void add_memory_region(uint64 start, uint64 size, int numa_node) {
+    if (size == 0) return;
+    if (machine_info.memory_region_count >= MAX_MEMORY_REGIONS) return;
+    // insertion sort by start address
+    int i = machine_info.memory_region_count;
+    while (i > 0 && machine_info.memory_regions[i - 1].start > start) {
+        machine_info.memory_regions[i] = machine_info.memory_regions[i - 1];
+        i--;
+    }
+    machine_info.memory_regions[i].start = start;
+    machine_info.memory_regions[i].size = size;
+    machine_info.memory_regions[i].numa_node = numa_node;
+    machine_info.memory_region_count++;
+}
+
+// "riscv,isa" is like "rv64imafdch_zicsr_sstc": the extensions with long
+// names come after underscores.
+static int isa_has_extension(const char *isa, const char *extension) {
+    size_t length = strlen(extension);
+    for (; *isa != '\0'; isa++) {
+        if (*isa != '_' || !starts_with(isa + 1, extension)) continue;
+        char next = isa[1 + length];
+        if (next == '_' || next == '\0') return 1;
+    }
+    return 0;
+}
+
+// A string list is a series of NUL-terminated strings.
+static int string_list_contains(const char *list,
+                                uint32 length,
+                                const char *string) {
+    uint32 offset = 0;
+    while (offset < length) {
+        if (strcmp(list + offset, string) == 0) return 1;
+        offset += strlen(list + offset) + 1;
+    }
+    return 0;
+}
+
+static void add_hart(uint64 hart_id, int numa_node, int has_sstc) {
+    if (machine_info.hart_count >= MAX_HARTS) return;
+    // Sstc is only used if every hart has it.
+    if (!has_sstc) machine_info.sstc = 0;
+    machine_info.hart_ids[machine_info.hart_count] = hart_id;
+    machine_info.hart_numa_nodes[machine_info.hart_count] = numa_node;
+    machine_info.hart_count++;
+}
+
+// distance-matrix is a list of (from, to, distance) triples.
+static void set_numa_distances(const uint8 *matrix, uint32 length) {
+    for (uint32 offset = 0; offset + 12 <= length; offset += 12) {
+        uint32 from = fdt32(matrix + offset);
+        uint32 to = fdt32(matrix + offset + 4);
+        if (from >= MAX_NUMA_NODES || to >= MAX_NUMA_NODES) continue;
+        machine_info.numa_distance[from][to] = fdt32(matrix + offset + 8);
+    }
+}
+
+static void end_node(struct fdt_node *node, struct fdt_node *parent) {
+    if (node->disabled || node->reg == NULL) return;
+    int address_cells = parent->address_cells;
+    int size_cells = parent->size_cells;
+    if (node->is_memory) {
+        uint32 entry_size = 4 * (address_cells + size_cells);
+        if (entry_size == 0) return;
+        for (uint32 offset = 0;
+             offset + entry_size <= node->reg_length;
+             offset += entry_size) {
+            uint64 start = fdt_cells(node->reg + offset, address_cells);
+            uint64 size = fdt_cells(node->reg + offset + 4 * address_cells,
+                                    size_cells);
+            add_memory_region(start, size, node->numa_node);
+        }
+    } else if (node->is_cpu) {
+        if (node->reg_length < 4 * address_cells) return;
+        add_hart(fdt_cells(node->reg, address_cells), node->numa_node,
+                 node->has_sstc);
+    }
+}
+
+static int walk_device_tree(const uint8 *dtb) {
+    const struct fdt_header *header = (const struct fdt_header *)dtb;
+    if (fdt32(&header->magic) != FDT_MAGIC) return -1;
+    const uint8 *structure = dtb + fdt32(&header->off_dt_struct);
+    const char *strings = (const char *)dtb + fdt32(&header->off_dt_strings);
+    uint32 structure_size = fdt32(&header->size_dt_struct);
+
+    struct fdt_node nodes[FDT_MAX_DEPTH];
+    int depth = 0;
+    // The virtual parent of the root node, using the default cell sizes.
+    nodes[0].address_cells = 2;
+    nodes[0].size_cells = 1;
+
+    uint32 offset = 0;
+    while (offset + 4 <= structure_size) {
+        uint32 token = fdt32(structure + offset);
+        offset += 4;
+        switch (token) {
+            case FDT_BEGIN_NODE: {
+                const char *name = (const char *)(structure + offset);
+                offset = fdt_align(offset + strlen(name) + 1);
+                if (++depth >= FDT_MAX_DEPTH) return -1;
+                struct fdt_node *node = &nodes[depth];
+                memset(node, 0, sizeof(struct fdt_node));
+                node->address_cells = 2;
+                node->size_cells = 1;
+                // device_type is deprecated for memory nodes, and some
+                // device trees rely on the name alone.
+                node->is_memory = depth == 2 && starts_with(name, "memory");
+                break;
+            }
+            case FDT_END_NODE: {
+                if (depth <= 0) return -1;
+                end_node(&nodes[depth], &nodes[depth - 1]);
+                depth--;
+                break;
+            }
+            case FDT_PROP: {
+                uint32 length = fdt32(structure + offset);
+                const char *name = strings + fdt32(structure + offset + 4);
+                const uint8 *value = structure + offset + 8;
+                offset = fdt_align(offset + 8 + length);
+                if (depth <= 0) return -1;
+                struct fdt_node *node = &nodes[depth];
+                if (strcmp(name, "#address-cells") == 0 && length == 4) {
+                    node->address_cells = fdt32(value);
+                } else if (strcmp(name, "#size-cells") == 0 && length == 4) {
+                    node->size_cells = fdt32(value);
+                } else if (strcmp(name, "reg") == 0) {
+                    node->reg = value;
+                    node->reg_length = length;
+                } else if (strcmp(name, "device_type") == 0) {
+                    node->is_memory = strcmp((const char *)value, "memory") == 0;
+                    node->is_cpu = strcmp((const char *)value, "cpu") == 0;
+                } else if (strcmp(name, "status") == 0) {
+                    node->disabled = !starts_with((const char *)value, "okay");
+                } else if (strcmp(name, "numa-node-id") == 0 && length == 4) {
+                    node->numa_node = checked_numa_node(fdt32(value));
+                } else if (strcmp(name, "riscv,isa") == 0) {
+                    node->has_sstc |=
+                        isa_has_extension((const char *)value, "sstc");
+                } else if (strcmp(name, "riscv,isa-extensions") == 0) {
+                    node->has_sstc |= string_list_contains(
+                        (const char *)value, length, "sstc");
+                } else if (strcmp(name, "distance-matrix") == 0) {
+                    set_numa_distances(value, length);
+                }
+                break;
+            }
+            case FDT_NOP: {
+                break;
+            }
+            case FDT_END: {
+                return depth == 0 ? 0 : -1;
+            }
+            default: {
+                return -1;
+            }
+        }
+    }
+    return -1;
+}
+
+static void count_numa_nodes() {
+    int max_node = 0;
+    for (int i = 0; i < machine_info.memory_region_count; i++) {
+        max_node = max(max_node, machine_info.memory_regions[i].numa_node);
+    }
+    for (int i = 0; i < machine_info.hart_count; i++) {
+        max_node = max(max_node, machine_info.hart_numa_nodes[i]);
+    }
+    machine_info.numa_node_count = max_node + 1;
+}
+
+int parse_device_tree(void *dtb) {
+    memset(&machine_info, 0, sizeof(struct machine_info));
+    for (int from = 0; from < MAX_NUMA_NODES; from++) {
+        for (int to = 0; to < MAX_NUMA_NODES; to++) {
+            machine_info.numa_distance[from][to] =
+                from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+    machine_info.sstc = 1;
+    int result = dtb == NULL ? -1 : walk_device_tree(dtb);
+    if (result != 0 || machine_info.memory_region_count == 0) {
+        machine_info.memory_region_count = 0;
+        add_memory_region(KERNBASE, DEFAULT_MEMORY_SIZE, 0);
+        result = -1;
+    }
+    if (machine_info.hart_count == 0) {
+        add_hart(0, 0, 0);
+    }
+    count_numa_nodes();
+    return result;
+}
+
+uint64 memory_end() {
+    int last = machine_info.memory_region_count - 1;
+    return machine_info.memory_regions[last].start +
+           machine_info.memory_regions[last].size;
+}
+
+int numa_node_of_address(uint64 pa) {
+    for (int i = 0; i < machine_info.memory_region_count; i++) {
+        struct memory_region *region = &machine_info.memory_regions[i];
+        if (pa >= region->start && pa < region->start + region->size) {
+            return region->numa_node;
+        }
+    }
+    return 0;
+}
+
+int numa_node_of_hart(uint64 hart_id) {
+    for (int i = 0; i < machine_info.hart_count; i++) {
+        if (machine_info.hart_ids[i] == hart_id) {
+            return machine_info.hart_numa_nodes[i];
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file device_tree.h
+ * @brief Minimal parser for the flattened device tree (FDT).
+ * @details
+ * qemu passes the address of a device tree blob in a1 when it jumps to
+ * _entry. The kernel only needs a few things from it: where RAM is, how many
+ * harts there are, and which NUMA node each of them belongs to
+ * ("numa-node-id" and the "distance-map" node), and whether the harts can
+ * set the timer from supervisor mode (Sstc). Everything is copied into
+ * machine_info while still in machine mode, so the blob itself may be
+ * overwritten afterwards.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_DEVICE_TREE_H
+#define TOY_RISCV_KERNEL_KERNEL_DEVICE_TREE_H
+
+#include "memlayout.h"
+#include "types.h"
+
+#define MAX_MEMORY_REGIONS 8
+#define MAX_NUMA_NODES 4
+
+// The distances in the device tree are relative to 10 for a local access.
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+// The memory used when the device tree is not available (qemu -m 128M).
+#define DEFAULT_MEMORY_SIZE (128ull * 1024 * 1024)
+
+struct memory_region {
+    uint64 start;
+    uint64 size;
+    int numa_node;
+};
+
+struct machine_info {
+    int memory_region_count;
+    struct memory_region memory_regions[MAX_MEMORY_REGIONS]; // sorted
+    int hart_count;
+    uint64 hart_ids[MAX_HARTS];
+    int hart_numa_nodes[MAX_HARTS];
+    int sstc; // all the harts have the Sstc extension (stimecmp)
+    int numa_node_count;
+    uint32 numa_distance[MAX_NUMA_NODES][MAX_NUMA_NODES];
+};
+
+extern struct machine_info machine_info;
+
+/**
+ * Parse the device tree blob and fill in machine_info. If the blob is missing
+ * or malformed, machine_info describes a single hart with DEFAULT_MEMORY_SIZE
+ * of RAM starting at KERNBASE.
+ * @param dtb the physical address of the device tree blob
+ * @return 0 if the device tree is parsed, -1 if the default is used
+ */
+int parse_device_tree(void *dtb);
+
+/**
+ * The end of the highest memory region (exclusive).
+ */
+uint64 memory_end();
+
+/**
+ * The NUMA node of the memory region holding the physical address, 0 if the
+ * address is not in any memory region.
+ */
+int numa_node_of_address(uint64 pa);
+
+/**
+ * The NUMA node of the hart, 0 if the hart is unknown.
+ */
+int numa_node_of_hart(uint64 hart_id);
+
+#endif // TOY_RISCV_KERNEL_KERNEL_DEVICE_TREE_H
@@ -43,13 +43,19 @@ int load_elf(void *elf, struct task_struct *task) {
         if (phdr[i].p_flags & PF_W) permission |= PTE_W;
         if (phdr[i].p_flags & PF_X) permission |= PTE_X;
         
-        if (map_section_for_user(task->pagetable, va,
+        size_t pages = section_size / PGSIZE;
+        if (charge_memory(task, MEMORY_RESIDENT_PAGES, pages) != 0) {
+            return -1;
+        }
+        if (map_section_for_user(task, va,
                                  src_addr, src_size, size,
                                  permission) != 0) {
+            uncharge_memory(task, MEMORY_RESIDENT_PAGES, pages);
             return -1;
         }
         if (register_memory_section(task, section_start, section_size)) {
             free_memory(task->pagetable, va, section_size);
+            uncharge_memory(task, MEMORY_RESIDENT_PAGES, pages);
             return -1;
         }
     }
@@ -0,0 +1,126 @@
+#include "epoch.h"
+
+#include "mem_manage.h"
+#include "process.h"
+#include "spinlock.h"
+#include "types.h"
+
+struct epoch_hart {
+    // The global epoch at the last quiescent point
+    volatile uint64 epoch;
+    // Idle or in user space, so the epoch is not waiting for it
+    volatile int quiescent;
+    // Retired by this hart and not freed yet, the newest first
+    struct epoch_entry *retired;
+    // The same for blocks of pages, linked through their page_info
+    void *retired_pages;
+};
+
+static volatile uint64 global_epoch = 0;
+static struct epoch_hart epoch_harts[NCPU];
+
+// Record the global epoch as seen by this hart. Everything it read before is
+// done with.
+static void announce(struct epoch_hart *hart) {
+    __sync_synchronize();
+    hart->epoch = global_epoch;
+    __sync_synchronize();
+}
+
+// Move the global epoch on from epoch if every hart that is online and not
+// quiescent has seen it.
+static int try_advance(uint64 epoch) {
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct epoch_hart *hart = &epoch_harts[cpu];
+        if (!cpus[cpu].online || hart->quiescent) continue;
+        if (hart->epoch != epoch) return 0;
+    }
+    return __sync_bool_compare_and_swap(&global_epoch, epoch, epoch + 1);
+}
+
+// Free what this hart retired two epochs ago or earlier.
+static void reclaim(struct epoch_hart *hart) {
+    uint64 epoch = global_epoch;
+    if (epoch < 2) return;
+    uint64 safe = epoch - 2;
+
+    // The lists are sorted by epoch, so cut them after the last entry that
+    // has to wait.
+    struct epoch_entry **link = &(hart->retired);
+    while (*link != NULL && (*link)->epoch > safe) link = &((*link)->next);
+    struct epoch_entry *entry = *link;
+    *link = NULL;
+    while (entry != NULL) {
+        struct epoch_entry *next = entry->next;
+        entry->free(entry);
+        entry = next;
+    }
+
+    void **page_link = &(hart->retired_pages);
+    while (*page_link != NULL) {
+        struct page_info *info = page_info_of((uint64)*page_link);
+        if (info->retire_epoch <= safe) break;
+        page_link = &(info->retire_next);
+    }
+    void *addr = *page_link;
+    *page_link = NULL;
+    while (addr != NULL) {
+        struct page_info *info = page_info_of((uint64)addr);
+        void *next = info->retire_next;
+        size_t power = info->order;
+        info->flags &= ~PAGE_RETIRED;
+        deallocate(addr, power);
+        addr = next;
+    }
+}
+
+void retire(struct epoch_entry *entry, void (*free)(struct epoch_entry *)) {
+    // The object must be unlinked before the epoch is read.
+    __sync_synchronize();
+    push_off();
+    struct epoch_hart *hart = &epoch_harts[cpuid()];
+    entry->epoch = global_epoch;
+    entry->free = free;
+    entry->next = hart->retired;
+    hart->retired = entry;
+    pop_off();
+}
+
+void retire_pages(void *addr, size_t power) {
+    if (addr == NULL) return;
+    struct page_info *info = page_info_of((uint64)addr);
+    __sync_synchronize();
+    push_off();
+    struct epoch_hart *hart = &epoch_harts[cpuid()];
+    info->flags |= PAGE_RETIRED;
+    info->order = power;
+    info->retire_epoch = global_epoch;
+    info->retire_next = hart->retired_pages;
+    hart->retired_pages = addr;
+    pop_off();
+}
+
+void epoch_quiescent() {
+    push_off();
+    struct epoch_hart *hart = &epoch_harts[cpuid()];
+    announce(hart);
+    // The other harts may all be quiescent already, so the epoch can move
+    // on twice, far enough for what was retired in this one.
+    for (int i = 0; i < 2 && try_advance(hart->epoch); i++) announce(hart);
+    if (hart->retired != NULL || hart->retired_pages != NULL) reclaim(hart);
+    pop_off();
+}
+
+void epoch_enter_quiescent() {
+    struct epoch_hart *hart = &epoch_harts[cpuid()];
+    __sync_synchronize();
+    hart->quiescent = 1;
+}
+
+void epoch_exit_quiescent() {
+    struct epoch_hart *hart = &epoch_harts[cpuid()];
+    hart->quiescent = 0;
+    // A hart moving the epoch on may have skipped this one, so it only
+    // counts with the epoch it reads from here on.
+    announce(hart);
+}
@@ -0,0 +1,95 @@
+/**
+ * @file epoch.h
+ * @brief Epoch-based deferred reclamation.
+ * @details
+ * Readers may walk a shared structure without its lock, as long as they do
+ * it between epoch_read_lock() and epoch_read_unlock(), which keep the
+ * interrupts off and so can neither sleep nor be preempted. A writer unlinks
+ * an object under the lock as usual, then retire()s it instead of freeing
+ * it. The object is freed once every hart has passed a quiescent point, when
+ * no reader can still see it.
+ *
+ * A hart passes a quiescent point at every context switch, and stays
+ * quiescent while it is idle or in user space. Each hart records the global
+ * epoch it saw at its last quiescent point. The global epoch moves on from E
+ * when every hart that is not quiescent has seen E, and an object retired in
+ * epoch E is freed once the global epoch reaches E + 2: by then every hart
+ * has passed a quiescent point after the object was unlinked.
+ *
+ * The retired objects are kept on the hart that retired them, and freed by
+ * it at its quiescent points, with the interrupts off.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_EPOCH_H
+#define TOY_RISCV_KERNEL_KERNEL_EPOCH_H
+
+#include "spinlock.h"
+#include "types.h"
+
+// Embedded in an object to retire it.
+struct epoch_entry {
+    struct epoch_entry *next;
+    uint64 epoch;                            // When it was retired
+    void (*free)(struct epoch_entry *entry); // Frees the object
+};
+
+#define epoch_entry_of(entry, type, member) \
+    ((type *)((char *)(entry) - __builtin_offsetof(type, member)))
+
+/**
+ * Start a section that reads without the lock. The objects found in it stay
+ * valid until epoch_read_unlock(). Sections nest.
+ */
+static inline void epoch_read_lock() {
+    push_off();
+}
+
+static inline void epoch_read_unlock() {
+    pop_off();
+}
+
+/**
+ * Publish a pointer to readers: everything written to the object before is
+ * visible to a reader that finds it through the pointer.
+ */
+#define rcu_assign_pointer(p, v) ({    \
+    __sync_synchronize();              \
+    *(typeof(p) volatile *)&(p) = (v); \
+})
+
+/**
+ * Read a pointer that may be changed by a writer meanwhile, in a read section.
+ */
+#define rcu_dereference(p) (*(typeof(p) volatile *)&(p))
+
+/**
+ * Free an object once no reader can see it. It must already be unreachable
+ * for new readers.
+ * @param free called with the entry to free the object, with the interrupts
+ *             off; it must not sleep
+ */
+void retire(struct epoch_entry *entry, void (*free)(struct epoch_entry *));
+
+/**
+ * Like retire(), but for a block of pages from allocate(). The block is given
+ * back with deallocate() once no reader can see it.
+ */
+void retire_pages(void *addr, size_t power);
+
+/**
+ * Mark a quiescent point of this hart: it holds no pointer found by a
+ * reader. Called at every context switch and on the way back to user space.
+ * The objects this hart retired that are safe by now are freed.
+ */
+void epoch_quiescent();
+
+/**
+ * Stay quiescent until epoch_exit_quiescent(), while the hart idles or runs
+ * user code, so that it does not hold back the epoch. The interrupts stay off
+ * from here until the hart waits in wfi or enters user space, and once it is
+ * back, it calls epoch_exit_quiescent() before it reads anything.
+ */
+void epoch_enter_quiescent();
+void epoch_exit_quiescent();
+
+#endif // TOY_RISCV_KERNEL_KERNEL_EPOCH_H
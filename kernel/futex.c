@@ -0,0 +1,55 @@
+#include "futex.h"
+
+#include "process.h"
+#include "types.h"
+#include "virtual_memory.h"
+#include "wait_queue.h"
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+// Futexes hashing to the same queue share it, and the key of a waiter tells
+// which one it sleeps on.
+static struct wait_queue futex_queues[FUTEX_HASH_SIZE];
+
+void init_futex() {
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        init_wait_queue(&futex_queues[i]);
+    }
+}
+
+static struct wait_queue *futex_queue(uint64 pa) {
+    // Fibonacci hashing of the index of the int
+    uint64 hash = (pa >> 2) * 0x9e3779b97f4a7c15ull;
+    return &futex_queues[hash >> (64 - FUTEX_HASH_BITS)];
+}
+
+int futex_wait(struct task_struct *task, uint64 addr, int value) {
+    uint64 pa = pin_user_page(task->pagetable, addr);
+    if (pa == 0) return -1;
+    struct wait_queue *queue = futex_queue(pa);
+    // Every waiter is exclusive, so that futex_wake() wakes as many as it is
+    // asked to. Unlike wait_event(), a wakeup ends the wait even if the value
+    // is the same: the caller checks its lock again anyway.
+    struct wait_entry entry;
+    init_wait_entry(&entry, (const void *)pa, 1);
+    prepare_to_wait(queue, &entry);
+    int result = -1;
+    if (*(volatile int *)pa == value && !wait_interrupted()) {
+        wait_yield();
+        result = 0;
+    }
+    finish_wait(queue, &entry);
+    unpin_user_page(pa);
+    return result;
+}
+
+int futex_wake(struct task_struct *task, uint64 addr, int count) {
+    // Pinned only for the lookup: while anyone sleeps on the int, the page
+    // stays where it is anyway.
+    uint64 pa = pin_user_page(task->pagetable, addr);
+    if (pa == 0) return -1;
+    int woken = wake_up_key_many(futex_queue(pa), (const void *)pa, count);
+    unpin_user_page(pa);
+    return woken;
+}
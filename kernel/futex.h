@@ -0,0 +1,47 @@
+/**
+ * @file futex.h
+ * @brief Fast user-space locks.
+ * @details
+ * A user lock is an int that threads change with atomic instructions, and
+ * the kernel is only entered when a thread has to sleep or wake a sleeper
+ * up. futex_wait() sleeps as long as the int holds the value the caller
+ * expects, and futex_wake() wakes up the threads sleeping on it.
+ *
+ * A futex is keyed by the physical address of the int, so it is the same
+ * futex through any page table mapping the page. The waiters are kept in a
+ * table of wait queues hashed by that key, and the page is pinned while they
+ * sleep, so that compaction does not move it under them.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_FUTEX_H
+#define TOY_RISCV_KERNEL_KERNEL_FUTEX_H
+
+#include "types.h"
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+struct task_struct;
+
+void init_futex();
+
+/**
+ * Sleep until woken up by futex_wake() on the int, if it holds the value.
+ * The value is checked after the task is queued, so a wakeup after the int
+ * has changed is never missed.
+ * @param addr the user address of the int, aligned
+ * @param value the value the caller saw
+ * @return 0 if woken up, -1 if the int does not hold the value, the address
+ *         is bad, or the task has been killed
+ */
+int futex_wait(struct task_struct *task, uint64 addr, int value);
+
+/**
+ * Wake up the tasks sleeping on the int.
+ * @param addr the user address of the int, aligned
+ * @param count the most tasks to wake up
+ * @return the number of tasks woken up, -1 if the address is bad
+ */
+int futex_wake(struct task_struct *task, uint64 addr, int count);
+
+#endif // TOY_RISCV_KERNEL_KERNEL_FUTEX_H
@@ -0,0 +1,23 @@
+#include "ipi.h"
+
+#include "memlayout.h"
+#include "process.h"
+#include "tlb.h"
+#include "types.h"
+
+// A bit for each ipi_type sent to the hart and not handled yet
+static uint32 ipi_pending[NCPU];
+
+void send_ipi(int cpu, enum ipi_type type) {
+    // A full barrier, so the bit (and whatever the request is about) is
+    // visible before the interrupt is.
+    __sync_fetch_and_or(&ipi_pending[cpu], 1U << type);
+    *(volatile uint32 *)CLINT_MSIP(cpu) = 1;
+}
+
+void handle_ipi() {
+    // An IPI sent from now on raises the interrupt again.
+    uint32 pending = __sync_lock_test_and_set(&ipi_pending[cpuid()], 0);
+    __sync_synchronize();
+    if (pending & (1U << IPI_TLB_FLUSH)) tlb_flush_pending();
+}
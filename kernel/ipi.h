@@ -0,0 +1,38 @@
+/**
+ * @file ipi.h
+ * @brief Inter-processor interrupts.
+ * @details
+ * A hart interrupts another by writing the MSIP register of the target in the
+ * CLINT. That raises a machine software interrupt there, which timer_vector
+ * in kernel_vectors.S turns into a supervisor software interrupt, just like a
+ * timer interrupt. What the interrupt is for is kept in a word of pending
+ * bits per hart, so that requests sent close together share one interrupt.
+ *
+ * The software interrupt always goes on to scheduler_tick(), so a reschedule
+ * IPI needs no handler of its own: the target picks up a task queued on it,
+ * arms its tick for it, or steals one if it is idle.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_IPI_H
+#define TOY_RISCV_KERNEL_KERNEL_IPI_H
+
+#include "types.h"
+
+enum ipi_type {
+    IPI_RESCHEDULE, // Look at the run queue again
+    IPI_TLB_FLUSH,  // Flush the user translations, see tlb_batch_flush()
+};
+
+/**
+ * Interrupt a hart. Nothing is waited for.
+ * @param cpu the hart, which may be this one
+ */
+void send_ipi(int cpu, enum ipi_type type);
+
+/**
+ * Handle the IPIs pending on this hart. Called on every supervisor software
+ * interrupt, with interrupts off.
+ */
+void handle_ipi();
+
+#endif // TOY_RISCV_KERNEL_KERNEL_IPI_H
@@ -4,7 +4,7 @@
 /* The vector for supervisor interrupt and exceptions. */
 void kernel_vector();
 
-/* The vector for timer interrupt. */
+/* The vector for machine-mode timer and software interrupts. */
 void timer_vector();
 
 #endif //TOY_RISCV_KERNEL_KERNEL_KERNEL_VECTORS_H
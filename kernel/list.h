@@ -0,0 +1,117 @@
+/**
+ * @file list.h
+ * @brief Intrusive circular doubly linked list.
+ * @details
+ * The node is embedded in the structure on the list, so adding and removing
+ * never allocate, and removing is O(1). A list is a head node linked to
+ * itself when empty. Use list_entry() to get the structure from a node.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_LIST_H
+#define TOY_RISCV_KERNEL_KERNEL_LIST_H
+
+#include "types.h"
+
+struct list_node {
+    struct list_node *next;
+    struct list_node *prev;
+};
+
+#define list_entry(node, type, member) \
+    ((type *)((char *)(node) - __builtin_offsetof(type, member)))
+
+#define list_for_each(node, head) \
+    for (struct list_node *node = (head)->next; node != (head); node = node->next)
+
+static inline void init_list(struct list_node *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static inline int list_empty(const struct list_node *head) {
+    return head->next == head;
+}
+
+static inline void list_insert_between(struct list_node *node,
+                                       struct list_node *prev,
+                                       struct list_node *next) {
+    node->next = next;
+    node->prev = prev;
+    prev->next = node;
+    next->prev = node;
+}
+
+static inline void list_insert_head(struct list_node *head,
+                                    struct list_node *node) {
+    list_insert_between(node, head, head->next);
+}
+
+static inline void list_insert_tail(struct list_node *head,
+                                    struct list_node *node) {
+    list_insert_between(node, head->prev, head);
+}
+
+/**
+ * Remove the node from its list. The node is left linked to itself, so
+ * removing it again does nothing.
+ */
+static inline void list_remove(struct list_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    init_list(node);
+}
+
+/**
+ * The first node of the list, NULL if the list is empty.
+ */
+static inline struct list_node *list_first(struct list_node *head) {
+    return list_empty(head) ? NULL : head->next;
+}
+
+/**
+ * Move all the nodes of one list to the tail of another.
+ */
+static inline void list_splice_tail(struct list_node *from,
+                                    struct list_node *to) {
+    if (list_empty(from)) return;
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    init_list(from);
+}
+
+/**
+ * Like list_insert_tail(), for a list that is walked without its lock (see
+ * epoch.h). The node is filled in before it is linked, so a reader never sees
+ * it half-linked.
+ */
+static inline void list_insert_tail_rcu(struct list_node *head,
+                                        struct list_node *node) {
+    struct list_node *prev = head->prev;
+    node->next = head;
+    node->prev = prev;
+    __sync_synchronize();
+    *(struct list_node *volatile *)&(prev->next) = node;
+    head->prev = node;
+}
+
+/**
+ * Like list_remove(), for a list that is walked without its lock. The node
+ * keeps pointing into the list, so a reader standing on it can go on. It must
+ * not be reused until no reader can see it.
+ */
+static inline void list_remove_rcu(struct list_node *node) {
+    *(struct list_node *volatile *)&(node->prev->next) = node->next;
+    node->next->prev = node->prev;
+}
+
+/**
+ * Walk a list without its lock, in an epoch read section.
+ */
+#define list_for_each_rcu(node, head) \
+    for (struct list_node *node = *(struct list_node *volatile *)&(head)->next; \
+         node != (head); \
+         node = *(struct list_node *volatile *)&node->next)
+
+#endif // TOY_RISCV_KERNEL_KERNEL_LIST_H
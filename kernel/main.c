@@ -1,24 +1,46 @@
+#include "futex.h"
 #include "mem_manage.h"
 #include "plic.h"
 #include "print.h"
 #include "process.h"
 #include "riscv.h"
 #include "test.h"
+#include "tlb.h"
+#include "trap.h"
 #include "types.h"
 #include "uart.h"
 #include "virtual_memory.h"
 
+// set by hart 0 once the kernel is initialized.
+static volatile int started = 0;
+
 int main() {
+    if (cpuid() != 0) {
+        // the other harts wait for hart 0, and only set up what is their own.
+        while (started == 0) {}
+        __sync_synchronize();
+        init_kernel_pagetable_hart();
+        init_trap_hart();
+        plicinithart();  // ask PLIC for device interrupts
+        scheduler();
+    }
+
     print_string("Switch to supervisor mode.\n");
     print_string("Initialize memory buddy system... ");
     init_mem_manage();
     print_string("Done.\n");
+    print_numa_statistics();
     print_string("Changing page table... ");
     init_kernel_pagetable();
     print_string("Done.\n");
+    init_tlb();
+    init_futex();
+    init_trap_hart();
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     init_scheduler();
+    __sync_synchronize();
+    started = 1;
     scheduler();
     test();
     return 0;
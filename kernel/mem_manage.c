@@ -1,23 +1,59 @@
 /**
  * @file mem_manage.c
  * @brief Memory management with buddy algorithm
+ * @details
+ * Every NUMA node has its own buddy pool. Allocations prefer the node of the
+ * current hart and fall back to the other nodes in the order of distance.
+ *
+ * Each page has a descriptor (struct page_info). Pages are grouped into
+ * pageblocks of PAGEBLOCK_ORDER, each of which belongs to one migrate type, so
+ * that the user pages (movable) and the kernel pages (unmovable) do not mix.
+ * When no block of the requested order is free, compaction migrates the user
+ * pages out of an aligned block, fixing up their PTEs, to rebuild one.
+ *
+ * Each pool has a lock, which protects its free lists, its counters and the
+ * descriptors of its pages. The OOM killer is called without it.
  */
 
 #include "mem_manage.h"
 
+#include "device_tree.h"
+#include "list.h"
+#include "memlayout.h"
 #include "print.h"
+#include "process.h"
 #include "riscv.h"
+#include "tlb.h"
+#include "spinlock.h"
 #include "types.h"
+#include "utility.h"
+#include "virtual_memory.h"
 #include "defs.h"
 
 // In entry.S
 uint64 get_kernel_end();
 
+static void init_kmalloc_caches();
+
+// Blocks of the maximum order are never merged, so any amount of RAM is
+// managed as a number of zones, each of which is one max-order block (or
+// smaller blocks at the edges of a memory region).
 #define BUDDY_MAX_ORDER (15)
-#define KERNEL_START (0x80000000ull)
-#define KERNEL_MEM_SIZE (128ull * 1024 * 1024)
 #define PAGE_SIZE (4096ull)
 
+// Each pool keeps total / WATERMARK_RATIO pages (at least WATERMARK_MIN_PAGES)
+// for the kernel, and allocations spread to other nodes before a node goes
+// below the low watermark, which is a quarter above that.
+#define WATERMARK_RATIO (128)
+#define WATERMARK_MIN_PAGES (16)
+
+// Migrate types are tracked per pageblock (the size of a megapage).
+#define PAGEBLOCK_ORDER (9)
+#define PAGEBLOCK_SIZE (PAGE_SIZE << PAGEBLOCK_ORDER)
+
+// Set in the pins of a page deallocated while it is pinned.
+#define PINS_FREED (1u << 31)
+
 #ifdef PRINT_BUDDY_DETAIL
 const char *capacity[BUDDY_MAX_ORDER + 1] = {
     "4KiB",   "8KiB",   "16KiB",  "32KiB",
@@ -28,85 +64,502 @@ const char *capacity[BUDDY_MAX_ORDER + 1] = {
 #endif // PRINT_BUDDY_DETAIL
 
 /** Buddy pool */
-typedef struct node {
-    struct node *next;
-} node;
 
+// One buddy pool per NUMA node. A block never leaves the pool of the node
+// its memory belongs to, so buddies on different nodes are never merged.
+// Inside a pool, the free lists are split by migrate type.
 struct buddy_pool {
-    node space[BUDDY_MAX_ORDER + 1];
-} buddy_pool;
+    struct spinlock lock;
+    // A free block keeps its list node in its own first page.
+    struct list_node space[MIGRATE_TYPES][BUDDY_MAX_ORDER + 1];
+    size_t total_pages;
+    size_t free_pages;
+    size_t min_pages;            // only the kernel allocates below it
+    size_t low_pages;            // prefer the other nodes below it
+    size_t local_allocations;    // served for an allocation preferring it
+    size_t fallback_allocations; // served for another node's allocation
+    size_t compactions;          // high-order blocks rebuilt by compaction
+    size_t migrated_pages;       // user pages moved by compaction
+    int compacting;              // compact_node() is running on the pool
+} buddy_pools[MAX_NUMA_NODES];
+
+// The nodes to try for an allocation preferring node i, nearest first.
+static int fallback_order[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+// The page descriptors of a memory region, stored at the start of it.
+struct page_map {
+    uint64 start;
+    uint64 end;
+    struct buddy_pool *pool;
+    struct page_info *pages;
+};
 
+static struct page_map page_maps[MAX_MEMORY_REGIONS];
+static int page_map_count = 0;
 
 #ifdef PRINT_BUDDY_DETAIL
 void print_buddy_pool();
 #endif // PRINT_BUDDY_DETAIL
 
-void init_mem_manage() {
-    size_t start_addr = get_kernel_end();
-    size_t kernel_size = start_addr - KERNEL_START;
-    size_t buddy_size = KERNEL_MEM_SIZE / 2;
-    int index = BUDDY_MAX_ORDER - 1;
-    buddy_pool.space[BUDDY_MAX_ORDER].next = NULL;
-    while (buddy_size >= kernel_size && index >= 0) {
-        buddy_pool.space[index].next = (node *)(KERNEL_START + buddy_size);
-        // Set the next pointer to NULL
-        buddy_pool.space[index].next->next = NULL;
-        buddy_size >>= 1;
-        index--;
-    }
-
-    void *tmp = (void *)(KERNEL_START + buddy_size);
-    while (index >= 0) {
-        if ((size_t)tmp >= start_addr) { // available
-            buddy_pool.space[index].next = tmp;
-            buddy_pool.space[index].next->next = NULL;
-            index--;
-            tmp = (void *)((size_t)tmp - (PAGE_SIZE << index));
-        } else {
-            buddy_pool.space[index].next = NULL;
-            index--;
-            tmp = (void *)((size_t)tmp + (PAGE_SIZE << index));
+static inline struct page_map *page_map_of(uint64 pa) {
+    for (int i = 0; i < page_map_count; i++) {
+        if (pa >= page_maps[i].start && pa < page_maps[i].end) {
+            return &page_maps[i];
         }
     }
-#ifdef PRINT_BUDDY_DETAIL
-    print_string("\n");
-    print_buddy_pool();
-#endif // PRINT_BUDDY_DETAIL
+    return NULL;
 }
 
-void *allocate(size_t power) {
-    int old_interrupt_status = set_interrupt_status(0);
-    void *addr = NULL;
-    size_t level = power;
-
-    // Find the smallest available block
-    while (level <= BUDDY_MAX_ORDER) {
-        if (buddy_pool.space[level].next != NULL) {
-            addr = buddy_pool.space[level].next;
-            buddy_pool.space[level].next = buddy_pool.space[level].next->next;
+static inline struct page_info *page_info_in(struct page_map *map, uint64 pa) {
+    if (pa < map->start || pa >= map->end) return NULL;
+    return &map->pages[(pa - map->start) >> PGSHIFT];
+}
+
+struct page_info *page_info_of(uint64 pa) {
+    struct page_map *map = page_map_of(pa);
+    return map == NULL ? NULL : page_info_in(map, pa);
+}
+
+// The migrate type of a pageblock is kept in its first page descriptor.
+static inline struct page_info *pageblock_head(struct page_map *map, uint64 pa) {
+    uint64 block = pa & ~(PAGEBLOCK_SIZE - 1);
+    return page_info_in(map, block < map->start ? map->start : block);
+}
+
+static void init_fallback_order() {
+    int count = machine_info.numa_node_count;
+    for (int from = 0; from < count; from++) {
+        int *order = fallback_order[from];
+        // insertion sort by distance, the lower id first if equal
+        for (int to = 0; to < count; to++) {
+            int i = to;
+            while (i > 0 && machine_info.numa_distance[from][order[i - 1]] >
+                            machine_info.numa_distance[from][to]) {
+                order[i] = order[i - 1];
+                i--;
+            }
+            order[i] = to;
+        }
+    }
+}
+
+static void insert_free_block(struct page_map *map, uint64 addr, size_t power) {
+    struct page_info *info = page_info_in(map, addr);
+    int type = pageblock_head(map, addr)->migrate_type;
+    info->flags |= PAGE_BUDDY;
+    info->order = power;
+    list_insert_head(&map->pool->space[type][power], (struct list_node *)addr);
+    map->pool->free_pages += 1ull << power;
+}
+
+static void remove_free_block(struct page_map *map, uint64 addr, size_t power) {
+    list_remove((struct list_node *)addr);
+    page_info_in(map, addr)->flags &= ~PAGE_BUDDY;
+    map->pool->free_pages -= 1ull << power;
+}
+
+// Merge with the buddy as long as it is free. Max-order blocks are the
+// zones and stay apart.
+static void free_to_pool(struct page_map *map, uint64 addr, size_t power) {
+    while (power < BUDDY_MAX_ORDER) {
+        uint64 buddy = addr ^ (PAGE_SIZE << power);
+        struct page_info *info = page_info_in(map, buddy);
+        if (info == NULL || !(info->flags & PAGE_BUDDY) ||
+            info->order != power) {
             break;
         }
-        level++;
+        remove_free_block(map, buddy, power);
+        addr &= ~(PAGE_SIZE << power);
+        power++;
     }
-    set_interrupt_status(old_interrupt_status);
+    insert_free_block(map, addr, power);
+}
 
-    // No available block
-    if (addr == NULL || level > BUDDY_MAX_ORDER) {
-        return NULL;
+// Give the pageblock(s) covering [addr, addr + 2^power pages) to the migrate
+// type, together with the free blocks already in them, so that later
+// allocations of the type are grouped there.
+static void claim_pageblocks(struct page_map *map, uint64 addr, size_t power,
+                             int type) {
+    uint64 start = addr & ~(PAGEBLOCK_SIZE - 1);
+    uint64 end = addr + (PAGE_SIZE << power);
+    for (uint64 block = start; block < end; block += PAGEBLOCK_SIZE) {
+        struct page_info *head = pageblock_head(map, block);
+        if (head->migrate_type == type) continue;
+        head->migrate_type = type;
+        uint64 page = block < map->start ? map->start : block;
+        uint64 block_end = min((uint64)(block + PAGEBLOCK_SIZE), map->end);
+        while (page < block_end) {
+            struct page_info *info = page_info_in(map, page);
+            if ((info->flags & PAGE_BUDDY) && info->order <= PAGEBLOCK_ORDER) {
+                list_remove((struct list_node *)page);
+                list_insert_head(&map->pool->space[type][info->order],
+                                 (struct list_node *)page);
+                page += PAGE_SIZE << info->order;
+            } else {
+                page += PAGE_SIZE;
+            }
+        }
+    }
+}
+
+static struct page_map *take_block(struct buddy_pool *pool, int type,
+                                   size_t level, uint64 *addr) {
+    *addr = (uint64)pool->space[type][level].next;
+    struct page_map *map = page_map_of(*addr);
+    remove_free_block(map, *addr, level);
+    return map;
+}
+
+static void *allocate_from_pool(struct buddy_pool *pool, size_t power,
+                                enum migrate_type type) {
+    struct page_map *map = NULL;
+    uint64 addr = 0;
+    int level = power;
+
+    // Find the smallest available block of the same type
+    while (level <= BUDDY_MAX_ORDER && list_empty(&pool->space[type][level])) {
+        level++;
+    }
+    if (level <= BUDDY_MAX_ORDER) {
+        map = take_block(pool, type, level, &addr);
+    } else {
+        // Steal the largest block of another type, so that the types mix as
+        // little as possible.
+        for (level = BUDDY_MAX_ORDER; level >= (int)power && map == NULL; level--) {
+            for (int other = 0; other < MIGRATE_TYPES; other++) {
+                if (other == type || list_empty(&pool->space[other][level])) {
+                    continue;
+                }
+                map = take_block(pool, other, level, &addr);
+                break;
+            }
+        }
+        if (map == NULL) return NULL; // No available block
+        level++;
+        // Only claim one pageblock of a large block; the rest keeps its type.
+        while (level > PAGEBLOCK_ORDER && level > (int)power) {
+            level--;
+            free_to_pool(map, addr + (PAGE_SIZE << level), level);
+        }
+        if (level >= PAGEBLOCK_ORDER - 1) {
+            claim_pageblocks(map, addr, level, type);
+        }
     }
 
     // Split the block
-    while (level > power) {
+    while (level > (int)power) {
         level--;
-        void *rest = (void *)((size_t)addr + (PAGE_SIZE << level));
-        deallocate(rest, level);
+        insert_free_block(map, addr + (PAGE_SIZE << level), level);
+    }
+    if (type == MIGRATE_MOVABLE) {
+        for (size_t i = 0; i < (1ull << power); i++) {
+            struct page_info *info = page_info_in(map, addr + PAGE_SIZE * i);
+            info->flags |= PAGE_MOVABLE;
+            info->pagetable = NULL;
+        }
     }
+    return (void *)addr;
+}
+
+/** Compaction */
+
+// Whether the aligned block can be emptied: every page in it must be free or
+// a movable page mapped exactly once and not pinned.
+static int can_compact(struct page_map *map, uint64 start, size_t power) {
+    uint64 end = start + (PAGE_SIZE << power);
+    int movable = 0;
+    uint64 page = start;
+    while (page < end) {
+        struct page_info *info = page_info_in(map, page);
+        if (info->flags & PAGE_BUDDY) {
+            page += PAGE_SIZE << info->order;
+        } else if ((info->flags & PAGE_MOVABLE) && info->pagetable != NULL &&
+                   info->pins == 0) {
+            movable++;
+            page += PAGE_SIZE;
+        } else {
+            return 0;
+        }
+    }
+    return movable > 0 && movable <= map->pool->free_pages;
+}
+
+// Move one user page out of the block. The new page must not be in the block,
+// which holds as the free blocks inside it have been taken out already. The
+// page is write-protected, and the flush of the new translation is queued to
+// the batch.
+static int migrate_page(struct page_map *map, uint64 page,
+                        struct tlb_batch *batch) {
+    struct page_info *info = page_info_in(map, page);
+    // Pinned since the block was checked. Once the page is write-protected
+    // and flushed, pin_user_page() waits for it instead.
+    if (info->pins != 0) return -1;
+    void *target = allocate_from_pool(map->pool, 0, MIGRATE_MOVABLE);
+    if (target == NULL) return -1;
+    memcpy(target, (void *)page, PAGE_SIZE);
+    if (remap_page(info->pagetable, info->va, (uint64)target) != 0) {
+        free_to_pool(page_map_of((uint64)target), (uint64)target, 0);
+        return -1;
+    }
+    tlb_batch_add(batch, info->pagetable, info->va);
+    struct page_info *target_info = page_info_of((uint64)target);
+    target_info->pagetable = info->pagetable;
+    target_info->va = info->va;
+    info->flags &= ~PAGE_MOVABLE;
+    info->pagetable = NULL;
+    map->pool->migrated_pages++;
+    return 0;
+}
+
+// Empty an aligned block of 2^power pages by migrating the user pages in it,
+// and return it allocated. The block is isolated first: every free block in it
+// leaves the free lists, so nothing migrates into it.
+//
+// The pool lock is held on entry and on return, but not across the TLB
+// shootdowns: a hart in pin_user_page() may be spinning on it with its
+// interrupts off. The block stays isolated meanwhile, and its user pages are
+// not freed either, as free_memory() pins them first and so waits for them
+// to move.
+static void *compact_block(struct page_map *map, uint64 start, size_t power,
+                           enum migrate_type type) {
+    uint64 end = start + (PAGE_SIZE << power);
+    for (uint64 page = start; page < end;) {
+        struct page_info *info = page_info_in(map, page);
+        if (info->flags & PAGE_BUDDY) {
+            size_t order = info->order;
+            remove_free_block(map, page, order);
+            page += PAGE_SIZE << order;
+        } else {
+            page += PAGE_SIZE;
+        }
+    }
+    // The tasks owning the pages may be running on other harts. Write-protect
+    // the pages, and wait until no hart can write them through its TLB, so
+    // that no store is lost while they are copied.
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    for (uint64 page = start; page < end; page += PAGE_SIZE) {
+        struct page_info *info = page_info_in(map, page);
+        if (info->flags & PAGE_MOVABLE) {
+            protect_page_for_migration(info->pagetable, info->va);
+            tlb_batch_add(&batch, info->pagetable, info->va);
+        }
+    }
+    release(&map->pool->lock);
+    tlb_batch_flush(&batch);
+    acquire(&map->pool->lock);
+    int failed = 0;
+    for (uint64 page = start; page < end && !failed; page += PAGE_SIZE) {
+        struct page_info *info = page_info_in(map, page);
+        if (info->flags & PAGE_MOVABLE) {
+            failed = migrate_page(map, page, &batch) != 0;
+        }
+    }
+    // The pages that stay get their permission back.
+    for (uint64 page = start; page < end && failed; page += PAGE_SIZE) {
+        struct page_info *info = page_info_in(map, page);
+        if (info->flags & PAGE_MOVABLE) {
+            remap_page(info->pagetable, info->va, page);
+        }
+    }
+    // The user page tables point to the new pages now. The old translations
+    // go before the old pages are reused.
+    release(&map->pool->lock);
+    tlb_batch_flush(&batch);
+    sfence_vma();
+    acquire(&map->pool->lock);
+    if (failed) {
+        // Give back what has been emptied so far.
+        for (uint64 page = start; page < end; page += PAGE_SIZE) {
+            if (!(page_info_in(map, page)->flags & PAGE_MOVABLE)) {
+                free_to_pool(map, page, 0);
+            }
+        }
+        return NULL;
+    }
+    if (power >= PAGEBLOCK_ORDER - 1) {
+        claim_pageblocks(map, start, power, type);
+    }
+    if (type == MIGRATE_MOVABLE) {
+        for (uint64 page = start; page < end; page += PAGE_SIZE) {
+            page_info_in(map, page)->flags |= PAGE_MOVABLE;
+        }
+    }
+    map->pool->compactions++;
+    return (void *)start;
+}
+
+// Rebuild a free block of 2^power pages on the node, scanning from the top of
+// each memory region, where the user pages are less likely to be. Only one
+// compaction runs on a pool at a time, as compact_block() lets the lock go;
+// the others give up.
+static void *compact_node(int numa_node, size_t power, enum migrate_type type) {
+    struct buddy_pool *pool = &buddy_pools[numa_node];
+    void *block = NULL;
+    acquire(&pool->lock);
+    if (pool->compacting) {
+        release(&pool->lock);
+        return NULL;
+    }
+    pool->compacting = 1;
+    for (int i = page_map_count - 1; i >= 0 && block == NULL; i--) {
+        struct page_map *map = &page_maps[i];
+        if (map->pool != pool) continue;
+        uint64 block_size = PAGE_SIZE << power;
+        uint64 first = (map->start + block_size - 1) & ~(block_size - 1);
+        if (map->end < first + block_size) continue;
+        for (uint64 start = (map->end - block_size) & ~(block_size - 1);
+             start >= first;
+             start -= block_size) {
+            if (can_compact(map, start, power)) {
+                block = compact_block(map, start, power, type);
+                if (block != NULL) break;
+            }
+            if (start < block_size) break;
+        }
+    }
+    pool->compacting = 0;
+    release(&pool->lock);
+    return block;
+}
+
+// Put the page descriptors at the start of the usable part of the region, and
+// give the rest to the buddy pool as the largest aligned blocks possible.
+static void add_memory(struct memory_region *region, size_t start, size_t end) {
+    if (page_map_count >= MAX_MEMORY_REGIONS) return;
+    size_t pages = (end - region->start) >> PGSHIFT;
+    size_t map_size = PGROUNDUP(pages * sizeof(struct page_info));
+    start = PGROUNDUP(start);
+    end = PGROUNDDOWN(end);
+    if (start + map_size >= end) return; // too small to be worth it
 
+    struct page_map *map = &page_maps[page_map_count++];
+    map->start = region->start;
+    map->end = end;
+    map->pool = &buddy_pools[region->numa_node];
+    map->pages = (struct page_info *)start;
+    memset(map->pages, 0, map_size);
+    // Everything starts as movable; the kernel claims pageblocks on demand.
+    for (uint64 block = map->start; block < map->end; block += PAGEBLOCK_SIZE) {
+        pageblock_head(map, block)->migrate_type = MIGRATE_MOVABLE;
+    }
+
+    start += map_size;
+    while (start < end) {
+        size_t power = BUDDY_MAX_ORDER;
+        while (power > 0 &&
+               ((start & ((PAGE_SIZE << power) - 1)) != 0 ||
+                start + (PAGE_SIZE << power) > end)) {
+            power--;
+        }
+        map->pool->total_pages += 1ull << power;
+        free_to_pool(map, start, power);
+        start += PAGE_SIZE << power;
+    }
+}
+
+void init_mem_manage() {
+    size_t kernel_end = get_kernel_end();
+    memset(buddy_pools, 0, sizeof(buddy_pools));
+    for (int n = 0; n < MAX_NUMA_NODES; n++) {
+        init_mcs_lock(&buddy_pools[n].lock, "buddy_pool");
+        for (int type = 0; type < MIGRATE_TYPES; type++) {
+            for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+                init_list(&buddy_pools[n].space[type][i]);
+            }
+        }
+    }
+    init_fallback_order();
+    for (int i = 0; i < machine_info.memory_region_count; i++) {
+        struct memory_region *region = &machine_info.memory_regions[i];
+        size_t start = region->start;
+        size_t end = region->start + region->size;
+        if (start < kernel_end && end > KERNBASE) {
+            start = kernel_end; // the kernel image is not available
+        }
+        add_memory(region, start, end);
+    }
+    for (int n = 0; n < machine_info.numa_node_count; n++) {
+        struct buddy_pool *pool = &buddy_pools[n];
+        pool->min_pages = max(pool->total_pages / WATERMARK_RATIO,
+                              (size_t)WATERMARK_MIN_PAGES);
+        pool->low_pages = pool->min_pages + pool->min_pages / 4;
+    }
+    init_kmalloc_caches();
+#ifdef PRINT_BUDDY_DETAIL
+    print_string("\n");
+    print_buddy_pool();
+#endif // PRINT_BUDDY_DETAIL
+}
+
+// How deep an allocation may dig into the free pages of a pool.
+enum watermark {
+    WATERMARK_LOW,
+    WATERMARK_MIN,
+    WATERMARK_NONE
+};
+
+static int above_watermark(struct buddy_pool *pool, size_t power,
+                           enum watermark watermark) {
+    size_t reserved = 0;
+    if (watermark == WATERMARK_LOW) reserved = pool->low_pages;
+    if (watermark == WATERMARK_MIN) reserved = pool->min_pages;
+    return pool->free_pages >= reserved + (1ull << power);
+}
+
+static void *allocate_with_watermark(size_t power, int numa_node,
+                                     enum migrate_type type,
+                                     enum watermark watermark) {
+    for (int i = 0; i < machine_info.numa_node_count; i++) {
+        int candidate = fallback_order[numa_node][i];
+        struct buddy_pool *pool = &buddy_pools[candidate];
+        acquire(&pool->lock);
+        void *addr = NULL;
+        if (above_watermark(pool, power, watermark)) {
+            addr = allocate_from_pool(pool, power, type);
+        }
+        if (addr != NULL) {
+            if (candidate == numa_node) {
+                pool->local_allocations++;
+            } else {
+                pool->fallback_allocations++;
+            }
+        }
+        release(&pool->lock);
+        if (addr != NULL) return addr;
+    }
+    return NULL;
+}
+
+void *allocate_on_node(size_t power, int numa_node, enum migrate_type type) {
+    if (power > BUDDY_MAX_ORDER) return NULL;
+    if (numa_node < 0 || numa_node >= machine_info.numa_node_count) {
+        numa_node = 0;
+    }
+    // Try to keep every node above its low watermark first, then let the
+    // user pages go down to the min watermark and the kernel to the end.
+    enum watermark last_resort =
+        type == MIGRATE_MOVABLE ? WATERMARK_MIN : WATERMARK_NONE;
+    void *addr = allocate_with_watermark(power, numa_node, type, WATERMARK_LOW);
+    // One OOM kill per allocation at most: if the memory the victim gave
+    // back is gone again, the allocation fails.
+    int killed = 0;
+    for (;;) {
+        if (addr == NULL) {
+            addr = allocate_with_watermark(power, numa_node, type, last_resort);
+        }
+        // There may be enough free pages, just not together.
+        for (int i = 0; i < machine_info.numa_node_count && addr == NULL && power > 0; i++) {
+            addr = compact_node(fallback_order[numa_node][i], power, type);
+        }
+        if (addr != NULL || killed || out_of_memory() == 0) break;
+        killed = 1;
+    }
     return addr;
 }
 
-inline void *remove_tag(void *addr, size_t power) {
-    return (void *)((size_t)addr & ~(size_t)(PAGE_SIZE << power));
+void *allocate(size_t power) {
+    return allocate_on_node(power, local_numa_node(), MIGRATE_UNMOVABLE);
 }
 
 void deallocate(void *addr, size_t power) {
@@ -115,76 +568,128 @@ void deallocate(void *addr, size_t power) {
         return;
     }
 
-    int old_interrupt_status = set_interrupt_status(0);
-    // Find the place
-    if (!buddy_pool.space[power].next) { // null, no block
-        buddy_pool.space[power].next = addr;
-        *(size_t *)addr = NULL;
-        set_interrupt_status(old_interrupt_status);
+    struct page_map *map = page_map_of((uint64)addr);
+    acquire(&map->pool->lock);
+    struct page_info *info = page_info_in(map, (uint64)addr);
+    if (info->flags & PAGE_MOVABLE) {
+        for (size_t i = 0; i < (1ull << power); i++) {
+            info[i].flags &= ~PAGE_MOVABLE;
+            info[i].pagetable = NULL;
+        }
+    }
+    // User pages are freed one at a time. A pinned one is left to its last
+    // unpin_page(); it is no longer movable, so compaction leaves it alone.
+    if (power == 0 && info->pins != 0) {
+        info->pins |= PINS_FREED;
+        release(&map->pool->lock);
         return;
     }
-    size_t odd = (size_t)addr & (PAGE_SIZE << power);
-
-    if (odd) { // odd
-        /* prev_prev -> prev -> addr -> next
-         * if can merge,
-         * prev_prev -> next
-         */
-        node *prev_prev = &buddy_pool.space[power];
-        node *prev = prev_prev->next;
-        node *next = prev->next; // prev != NULL has already been checked
-        if ((size_t)addr < (size_t)prev) { // head -> addr -> prev
-            ((node *)addr)->next = prev;
-            prev_prev->next = addr;
-            return;
-        }
-        while (next && (size_t)addr > (size_t)next) {
-            prev_prev = prev;
-            prev = next;
-            next = next->next;
-        }
-        if ((size_t)remove_tag(addr, power) == (size_t)prev) {
-            prev_prev->next = next;
-            deallocate(prev, power + 1);
-        } else {
-            ((node *)addr)->next = next;
-            prev->next = addr;
-        }
-    } else { // even
-        /* prev -> addr -> next -> next_next
-         * if can merge,
-         * prev -> next_next
-         */
-        node *prev = &buddy_pool.space[power];
-        node *next = prev->next;
-        while (next && (size_t)next < (size_t)addr) {
-            prev = next;
-            next = next->next;
-        }
-        if (next && (size_t)addr == (size_t)remove_tag(next, power)) {
-            prev->next = next->next;
-            deallocate(addr, power + 1);
-        } else {
-            ((node *)addr)->next = next;
-            prev->next = addr;
-        }
+    free_to_pool(map, (uint64)addr, power);
+    release(&map->pool->lock);
+}
+
+void set_page_mapping(uint64 pa, pagetable_t pagetable, uint64 va) {
+    struct page_map *map = page_map_of(pa);
+    if (map == NULL) return;
+    acquire(&map->pool->lock);
+    struct page_info *info = page_info_in(map, pa);
+    if (info->flags & PAGE_MOVABLE) {
+        info->pagetable = pagetable;
+        info->va = va;
+    }
+    release(&map->pool->lock);
+}
+
+// The pins are only touched under the pool lock, like the flags that
+// compaction checks along with them.
+int pin_page(uint64 pa) {
+    struct page_map *map = page_map_of(pa);
+    if (map == NULL) return -1;
+    acquire(&map->pool->lock);
+    struct page_info *info = page_info_in(map, pa);
+    if ((info->flags & PAGE_BUDDY) || (info->pins & PINS_FREED)) {
+        release(&map->pool->lock);
+        return -1;
+    }
+    info->pins++;
+    release(&map->pool->lock);
+    return 0;
+}
+
+void unpin_page(uint64 pa) {
+    pa = PGROUNDDOWN(pa);
+    struct page_map *map = page_map_of(pa);
+    if (map == NULL) return;
+    acquire(&map->pool->lock);
+    struct page_info *info = page_info_in(map, pa);
+    // The page has been deallocated while pinned, and this was the last pin.
+    if (--info->pins == PINS_FREED) {
+        info->pins = 0;
+        free_to_pool(map, pa, 0);
+    }
+    release(&map->pool->lock);
+}
+
+int local_numa_node() {
+    return numa_node_of_hart(cpuid());
+}
+
+int get_numa_statistics(int numa_node, struct numa_statistics *statistics) {
+    if (numa_node < 0 || numa_node >= machine_info.numa_node_count) return -1;
+    struct buddy_pool *pool = &buddy_pools[numa_node];
+    acquire(&pool->lock);
+    statistics->total_pages = pool->total_pages;
+    statistics->free_pages = pool->free_pages;
+    statistics->used_pages = pool->total_pages - pool->free_pages;
+    statistics->min_pages = pool->min_pages;
+    statistics->low_pages = pool->low_pages;
+    statistics->local_allocations = pool->local_allocations;
+    statistics->fallback_allocations = pool->fallback_allocations;
+    statistics->compactions = pool->compactions;
+    statistics->migrated_pages = pool->migrated_pages;
+    release(&pool->lock);
+    return 0;
+}
+
+void print_numa_statistics() {
+    struct numa_statistics statistics;
+    for (int i = 0; i < machine_info.numa_node_count; i++) {
+        if (get_numa_statistics(i, &statistics) != 0) continue;
+        print_string("node ");
+        print_int(i, 10);
+        print_string(": ");
+        print_int(statistics.free_pages, 10);
+        print_string(" free, ");
+        print_int(statistics.used_pages, 10);
+        print_string(" used pages\n");
     }
-    set_interrupt_status(old_interrupt_status);
 }
 
 #ifdef PRINT_BUDDY_DETAIL
+const char *migrate_type_names[MIGRATE_TYPES] = {
+    [MIGRATE_UNMOVABLE] = "unmovable",
+    [MIGRATE_MOVABLE] = "movable",
+};
+
 void print_buddy_pool() {
-    print_string("BUDDY POOL:\n");
-    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
-        node *p = buddy_pool.space[i].next;
-        print_string(capacity[i]);
-        print_string(": ");
-        while (p) {
-            print_int((size_t)p, 16);
-            print_string(" ");
-            p = p->next;
+    for (int n = 0; n < machine_info.numa_node_count; n++) {
+        for (int type = 0; type < MIGRATE_TYPES; type++) {
+            print_string("BUDDY POOL (node ");
+            print_int(n, 10);
+            print_string(", ");
+            print_string(migrate_type_names[type]);
+            print_string("):\n");
+            for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+                struct list_node *head = &buddy_pools[n].space[type][i];
+                print_string(capacity[i]);
+                print_string(": ");
+                list_for_each(p, head) {
+                    print_int((size_t)p, 16);
+                    print_string(" ");
+                }
+                print_string("\n");
+            }
         }
-        print_string("\n");
     }
 }
 #endif // PRINT_BUDDY_DETAIL
@@ -223,6 +728,17 @@ void test_mem_manage() {
 /** 
  * Useful tools for kernel memory management, especially for small blocks of
  * data.
+ *
+ * Objects of up to KMALLOC_MAX_SMALL bytes come from a cache per size class.
+ * Every hart keeps a magazine of free objects of each class, so that most
+ * kmalloc()s and kfree()s only touch the magazine of the hart, with the
+ * interrupts off. An empty magazine is refilled with a batch of objects from
+ * the depot of the class, and a full one gives half of them back, both under
+ * the lock of the depot. The depot keeps the objects in slabs, blocks of
+ * pages cut into objects of one size, and gives a slab back to the buddy pool
+ * once all its objects are free again.
+ *
+ * Larger objects are put one after another in blocks of their own.
  */
 
 struct block_meta {
@@ -235,14 +751,61 @@ struct block_meta {
 
 struct block_meta *block_list_head = NULL;
 struct block_meta *block_list_tail = NULL;
+// Protects the block list and the blocks in it. allocate() is never called
+// with it held, since the OOM killer frees kernel objects.
+struct spinlock kmalloc_lock = {.name = "kmalloc", .cpu = -1};
+
+// The size classes are 16, 32, ..., KMALLOC_MAX_SMALL bytes.
+#define KMALLOC_MIN_SIZE (16)
+#define KMALLOC_CLASSES (8)
+#define KMALLOC_MAX_SMALL (KMALLOC_MIN_SIZE << (KMALLOC_CLASSES - 1))
+
+#define MAGAZINE_SIZE (16)
+// The number of objects moved between a magazine and the depot at a time
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)
+// A slab has room for at least this many objects.
+#define SLAB_MIN_OBJECTS (8)
+
+struct kmalloc_cache;
+
+// At the start of the pages of a slab
+struct slab {
+    struct list_node link;          // In the partial list of the cache
+    struct kmalloc_cache *cache;
+    size_t power;
+    size_t objects;                 // The number of objects in the slab
+    size_t in_use;                  // Objects out of it, even in magazines
+    void *free;                     // Free objects, linked by the first word
+};
+
+// The depot of a size class
+struct kmalloc_cache {
+    struct spinlock lock;           // Protects the slabs of the cache
+    size_t size;                    // The size of the objects
+    size_t power;                   // The size of the slabs
+    struct list_node partial;       // Slabs with free objects
+    size_t free_objects;            // In the partial slabs
+};
+
+// Only used by its hart, with the interrupts off
+struct magazine {
+    int count;
+    void *objects[MAGAZINE_SIZE];   // The last one is the most recently freed
+};
+
+static struct kmalloc_cache kmalloc_caches[KMALLOC_CLASSES];
+static struct magazine magazines[NCPU][KMALLOC_CLASSES];
 
 inline size_t remained_size(struct block_meta *block) {
-    return (PAGE_SIZE << block->power) - (size_t)(block->free);
+    return (size_t)block + (PAGE_SIZE << block->power) - (size_t)(block->free);
 }
  
 struct header {
     size_t size;
-    struct block_meta *block;
+    union {
+        struct block_meta *block;   // If larger than KMALLOC_MAX_SMALL
+        struct slab *slab;          // Otherwise
+    };
 };
 
 inline size_t align(size_t size) {
@@ -253,6 +816,111 @@ inline size_t gross_size(size_t size) {
     return align(size) + sizeof(struct header);
 }
 
+static inline size_t slab_header_size() {
+    return (sizeof(struct slab) + 15) & ~15;
+}
+
+static void init_kmalloc_caches() {
+    for (int i = 0; i < KMALLOC_CLASSES; i++) {
+        struct kmalloc_cache *cache = &kmalloc_caches[i];
+        initlock(&cache->lock, "kmalloc_depot");
+        cache->size = KMALLOC_MIN_SIZE << i;
+        cache->power = 0;
+        while ((PAGE_SIZE << cache->power) - slab_header_size() <
+               SLAB_MIN_OBJECTS * gross_size(cache->size)) {
+            cache->power++;
+        }
+        init_list(&cache->partial);
+        cache->free_objects = 0;
+    }
+}
+
+static int kmalloc_class(size_t size) {
+    int class = 0;
+    while ((KMALLOC_MIN_SIZE << class) < size) class++;
+    return class;
+}
+
+// Add a new slab to the cache. The caller must not hold any lock, as the
+// allocation may call the OOM killer.
+static int grow_cache(struct kmalloc_cache *cache) {
+    struct slab *slab = allocate(cache->power);
+    if (slab == NULL) return -1;
+    size_t stride = gross_size(cache->size);
+    size_t start = (size_t)slab + slab_header_size();
+    slab->cache = cache;
+    slab->power = cache->power;
+    slab->objects = ((PAGE_SIZE << slab->power) - slab_header_size()) / stride;
+    slab->in_use = 0;
+    slab->free = NULL;
+    for (size_t i = slab->objects; i > 0; i--) {
+        struct header *header = (struct header *)(start + (i - 1) * stride);
+        header->size = cache->size;
+        header->slab = slab;
+        void **object = (void **)(header + 1);
+        *object = slab->free;
+        slab->free = object;
+    }
+    acquire(&cache->lock);
+    list_insert_tail(&cache->partial, &slab->link);
+    cache->free_objects += slab->objects;
+    release(&cache->lock);
+    return 0;
+}
+
+// Move a batch of objects from the depot to the empty magazine.
+// @return the number of objects moved, 0 if the depot is empty
+static int refill_magazine(struct kmalloc_cache *cache,
+                           struct magazine *magazine) {
+    acquire(&cache->lock);
+    while (magazine->count < MAGAZINE_BATCH && !list_empty(&cache->partial)) {
+        struct slab *slab =
+            list_entry(list_first(&cache->partial), struct slab, link);
+        void **object = slab->free;
+        slab->free = *object;
+        slab->in_use++;
+        cache->free_objects--;
+        if (slab->free == NULL) list_remove(&slab->link);
+        magazine->objects[magazine->count++] = object;
+    }
+    release(&cache->lock);
+    return magazine->count;
+}
+
+// Give the older half of the full magazine back to the depot.
+static void drain_magazine(struct kmalloc_cache *cache,
+                           struct magazine *magazine) {
+    struct list_node empty;
+    init_list(&empty);
+    acquire(&cache->lock);
+    for (int i = 0; i < MAGAZINE_BATCH; i++) {
+        void **object = magazine->objects[i];
+        struct slab *slab = ((struct header *)object - 1)->slab;
+        if (slab->free == NULL) list_insert_tail(&cache->partial, &slab->link);
+        *object = slab->free;
+        slab->free = object;
+        slab->in_use--;
+        cache->free_objects++;
+        // Keep enough free objects for a refill without a new slab.
+        if (slab->in_use == 0 &&
+            cache->free_objects - slab->objects >= MAGAZINE_BATCH) {
+            list_remove(&slab->link);
+            cache->free_objects -= slab->objects;
+            list_insert_tail(&empty, &slab->link);
+        }
+    }
+    release(&cache->lock);
+    for (int i = MAGAZINE_BATCH; i < magazine->count; i++) {
+        magazine->objects[i - MAGAZINE_BATCH] = magazine->objects[i];
+    }
+    magazine->count -= MAGAZINE_BATCH;
+    while (!list_empty(&empty)) {
+        struct slab *slab = list_entry(list_first(&empty), struct slab, link);
+        list_remove(&slab->link);
+        deallocate(slab, slab->power);
+    }
+}
+
 inline int tail_not_enough(size_t size) {
     if (block_list_tail == NULL) return 1;
     else return remained_size(block_list_tail) < gross_size(size);
@@ -270,16 +938,20 @@ static void *init_block(void *block, size_t power) {
     return block_meta;
 }
 
-void *kmalloc(size_t size) {
-    int old_interrupt_status = set_interrupt_status(0);
+static void *kmalloc_large(size_t size) {
+    acquire(&kmalloc_lock);
+    struct block_meta *block = block_list_tail;
     if (tail_not_enough(size)) {
         // We need to allocate block space
         size_t need_size = sizeof(struct block_meta) + gross_size(size);
         size_t power = 0;
         while ((PAGE_SIZE << power) < need_size) power++;
-        struct block_meta *block = init_block(allocate(power), power);
+        release(&kmalloc_lock);
+        block = init_block(allocate(power), power);
         if (block == NULL) return NULL;
-        block->prev = block_list_tail;
+        acquire(&kmalloc_lock);
+        // Another hart may have added a block meanwhile, but the object
+        // still goes to this one, so that no block is left empty.
         if (block_list_head == NULL) {
             block_list_head = block;
             block_list_tail = block;
@@ -288,24 +960,19 @@ void *kmalloc(size_t size) {
             block->prev = block_list_tail;
             block_list_tail = block;
         }
-        set_interrupt_status(old_interrupt_status);
-        return kmalloc(size);
-    } else {
-        struct block_meta *block = block_list_tail;
-        struct header *header = block->free;
-        void *ret = (void *)((size_t)header + sizeof(struct header));
-        block->free = (void *)((size_t)block->free + gross_size(size));
-        block->count++;
-        header->size = align(size);
-        header->block = block;
-        set_interrupt_status(old_interrupt_status);
-        return ret;
     }
+    struct header *header = block->free;
+    void *ret = (void *)((size_t)header + sizeof(struct header));
+    block->free = (void *)((size_t)block->free + gross_size(size));
+    block->count++;
+    header->size = align(size);
+    header->block = block;
+    release(&kmalloc_lock);
+    return ret;
 }
 
-void kfree(void *addr) {
-    if (addr == NULL) return;
-    int old_interrupt_status = set_interrupt_status(0);
+static void kfree_large(void *addr) {
+    acquire(&kmalloc_lock);
     struct header *header = (struct header *)((size_t)addr - sizeof(struct header));
     struct block_meta *block = header->block;
     block->count--;
@@ -323,10 +990,45 @@ void kfree(void *addr) {
         if (block->next) {
             block->next->prev = block->prev;
         }
+        release(&kmalloc_lock);
         deallocate(block, block->power);
+        return;
     } else if ((size_t)(block->free) == (size_t)addr + header->size) {
         // When the free space is at the end of the block
         block->free = addr - sizeof(struct header);
     }
-    set_interrupt_status(old_interrupt_status);
+    release(&kmalloc_lock);
+}
+
+void *kmalloc(size_t size) {
+    if (size > KMALLOC_MAX_SMALL) return kmalloc_large(size);
+    struct kmalloc_cache *cache = &kmalloc_caches[kmalloc_class(size)];
+    for (;;) {
+        push_off();
+        struct magazine *magazine = &magazines[cpuid()][cache - kmalloc_caches];
+        if (magazine->count > 0 || refill_magazine(cache, magazine) > 0) {
+            void *object = magazine->objects[--magazine->count];
+            pop_off();
+            return object;
+        }
+        pop_off();
+        // The depot is empty. Another hart may take the objects of the new
+        // slab before this one gets to them, so try again.
+        if (grow_cache(cache) != 0) return NULL;
+    }
+}
+
+void kfree(void *addr) {
+    if (addr == NULL) return;
+    struct header *header = (struct header *)((size_t)addr - sizeof(struct header));
+    if (header->size > KMALLOC_MAX_SMALL) {
+        kfree_large(addr);
+        return;
+    }
+    struct kmalloc_cache *cache = header->slab->cache;
+    push_off();
+    struct magazine *magazine = &magazines[cpuid()][cache - kmalloc_caches];
+    if (magazine->count == MAGAZINE_SIZE) drain_magazine(cache, magazine);
+    magazine->objects[magazine->count++] = addr;
+    pop_off();
 }
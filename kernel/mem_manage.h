@@ -1,6 +1,7 @@
 #ifndef TOY_RISCV_KERNEL_KERNEL_MEM_MANAGE_H
 #define TOY_RISCV_KERNEL_KERNEL_MEM_MANAGE_H
 
+#include "riscv.h"
 #include "types.h"
 #include "defs.h"
 
@@ -10,12 +11,76 @@
 void init_mem_manage();
 
 /**
- * Allocate a block of memory with size 2^power * 4KiB
+ * Pages are grouped by whether they can be moved. Kernel memory is accessed
+ * through its physical address and can never move, while a user page is only
+ * reached through one PTE, so compaction may copy it elsewhere and fix the PTE.
+ */
+enum migrate_type {
+    MIGRATE_UNMOVABLE,
+    MIGRATE_MOVABLE,
+    MIGRATE_TYPES
+};
+
+#define PAGE_BUDDY   (1 << 0) // the first page of a free block
+#define PAGE_MOVABLE (1 << 1) // an allocated page that can be migrated
+#define PAGE_RETIRED (1 << 2) // the first page of a block in retire_pages()
+
+// The descriptor of a physical page.
+struct page_info {
+    uint16 flags;
+    uint8 order;        // the order of the free block (PAGE_BUDDY) or of the
+                        // retired block (PAGE_RETIRED)
+    uint8 migrate_type; // for the whole pageblock, first page only
+    uint32 pins;        // pin_page() count of a user page, which keeps it in
+                        // place, and whether it has been freed meanwhile
+    union {
+        struct {        // PAGE_MOVABLE only
+            uint64 va;  // where the page is mapped
+            pagetable_t pagetable;
+        };
+        struct {        // PAGE_RETIRED only
+            uint64 retire_epoch;
+            void *retire_next; // the block retired before it on the hart
+        };
+    };
+};
+
+struct numa_statistics {
+    size_t total_pages;
+    size_t free_pages;
+    size_t used_pages;
+    size_t min_pages;            // the min watermark
+    size_t low_pages;            // the low watermark
+    size_t local_allocations;    // allocations that got their preferred node
+    size_t fallback_allocations; // allocations that fell back to this node
+    size_t compactions;          // blocks rebuilt by compaction
+    size_t migrated_pages;       // pages moved by compaction
+};
+
+/**
+ * Allocate an unmovable block of memory with size 2^power * 4KiB, preferring
+ * the NUMA node of the current hart.
  * @param power the power of 2
  * @return the address of the allocated memory (NULL for failure)
  */
 void *allocate(size_t power);
 
+/**
+ * Allocate a block of memory with size 2^power * 4KiB, preferring the given
+ * NUMA node. If the node has no such block, the other nodes are tried in the
+ * order of their distance to it. If none of them has one, a block is rebuilt
+ * by compaction, and after that the OOM killer is asked to free some memory.
+ * Movable (user) pages never take a node below its min watermark.
+ * Movable pages must be mapped with map_page() before they can be migrated,
+ * and they must not be used through their physical address across another
+ * allocation of more than one page.
+ * @param power the power of 2
+ * @param numa_node the preferred node
+ * @param type the migrate type of the block
+ * @return the address of the allocated memory (NULL for failure)
+ */
+void *allocate_on_node(size_t power, int numa_node, enum migrate_type type);
+
 /**
  * Deallocate a block of memory with size 2^power * 4KiB
  * @param addr the address of the memory to be deallocated
@@ -23,9 +88,42 @@ void *allocate(size_t power);
  */
 void deallocate(void *addr, size_t power);
 
+/**
+ * The descriptor of the physical page, NULL if the page is not managed.
+ */
+struct page_info *page_info_of(uint64 pa);
+
+/**
+ * Record where a movable page is mapped, so that compaction can fix the PTE
+ * when it moves the page. Pages that are not movable are ignored.
+ * @param pa the physical address of the page
+ * @param pagetable the page table, NULL if the page is unmapped
+ * @param va the virtual address
+ */
+void set_page_mapping(uint64 pa, pagetable_t pagetable, uint64 va);
+
+/**
+ * Keep compaction from moving the page, e.g., while a task sleeps on a futex
+ * keyed by its physical address. If the page is deallocated meanwhile, e.g.,
+ * as the OOM killer frees the process, it only goes back to the pool once
+ * it is unpinned.
+ * @param pa the physical address in the page
+ * @return 0 if success, -1 if the page is not managed, free or already
+ * deallocated
+ */
+int pin_page(uint64 pa);
+
+/**
+ * Drop a pin taken by pin_page(), and free the page if it was the last pin
+ * of a deallocated page.
+ * @param pa the physical address in the page
+ */
+void unpin_page(uint64 pa);
+
 /**
  * Allocate a block of memory with any size, especially for the requirement
- * of small size memory.
+ * of small size memory. Small objects usually come from a cache of this hart
+ * without taking a lock.
  * @param size the size of the memory to be allocated
  * @return the address of the allocated memory (NULL for failure)
  */
@@ -38,6 +136,22 @@ void *kmalloc(size_t size);
  */
 void kfree(void *addr);
 
+/**
+ * The NUMA node of the current hart.
+ */
+int local_numa_node();
+
+/**
+ * Get the page statistics of a NUMA node.
+ * @return 0 if success, -1 if there is no such node
+ */
+int get_numa_statistics(int numa_node, struct numa_statistics *statistics);
+
+/**
+ * Print the free and used pages of every NUMA node.
+ */
+void print_numa_statistics();
+
 #ifdef PRINT_BUDDY_DETAIL
 /**
  * print the buddy pool
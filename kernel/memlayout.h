@@ -15,7 +15,12 @@
 // the kernel uses physical memory thus:
 // 80000000 -- entry.S, then kernel text and data
 // end -- start of kernel page allocation area
-// PHYSTOP -- end RAM used by the kernel
+// the end of RAM is read from the device tree (see device_tree.c).
+
+// the harts the kernel supports; the others spin in entry.S.
+#define MAX_HARTS 8
+// each hart boots on a stack of its own, declared in entry.S.
+#define BOOT_STACK_SHIFT 16 // 64KiB
 
 // virt_test - for shutdown
 #define VIRT_TEST 0x100000L
@@ -28,10 +33,13 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
-// core local interruptor (CLINT), which contains the timer.
+// core local interruptor (CLINT), which contains the timer and the
+// software interrupt pending bits used for IPIs.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define TIMER_FREQUENCY 10000000 // cycles of mtime (and the time CSR) per second
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -46,9 +54,9 @@
 
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
-// from physical address 0x80000000 to PHYSTOP.
+// from physical address 0x80000000. the regions of RAM are
+// described by the device tree, see machine_info in device_tree.h.
 #define KERNBASE 0x80000000L
-#define PHYSTOP (KERNBASE + 128*1024*1024)
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
@@ -65,11 +73,21 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
-//   TRAPFRAME (p->trapframe, used by the trampoline)
-//   SHARED_MEMORY (p->shared_memory, used by syscall)
+//   the areas of the thread slots, the one of slot 0 at the top, each with
+//     the user stack, growing down
+//     SHARED_MEMORY (p->shared_memory, used by syscall)
+//     TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
-#define TRAPFRAME (TRAMPOLINE - PGSIZE)
-#define SHARED_MEMORY (TRAMPOLINE - PGSIZE * 2)
+// The threads of a process share the page table, and each of them has a slot.
+// A process starts with one thread, in slot 0 unless it is forked by a thread
+// in another slot.
+#define MAX_THREADS 16
+#define THREAD_AREA_SIZE (PGSIZE * 1024)
+
+// The top of the area of a slot.
+#define THREAD_AREA(slot) (TRAMPOLINE - (uint64)(slot) * THREAD_AREA_SIZE)
+#define TRAPFRAME(slot) (THREAD_AREA(slot) - PGSIZE)
+#define SHARED_MEMORY(slot) (THREAD_AREA(slot) - PGSIZE * 2)
 
-// The maximum size of stack is set to 4MiB.
-#define MIN_STACK_ADDR (SHARED_MEMORY - PGSIZE * 1024)
+// The stack may grow to the bottom of the area, almost 4MiB.
+#define MIN_STACK_ADDR(slot) (THREAD_AREA(slot) - THREAD_AREA_SIZE)
@@ -8,5 +8,7 @@ __attribute__((noreturn)) void panic(const char *msg) {
     print_string("panic: ");
     print_string(msg);
     print_string("\n");
+    // freeze the output of the other harts.
+    panicked = 1;
     for (;;) {}
 }
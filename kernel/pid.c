@@ -0,0 +1,74 @@
+/**
+ * @file pid.c
+ * @brief A bitmap PID allocator and a PID hash table
+ */
+
+#include "pid.h"
+
+#include "epoch.h"
+#include "process.h"
+#include "types.h"
+
+static uint64 pid_bitmap[PID_MAX / 64];
+static pid_t last_pid = 0;
+static struct task_struct *pid_hash[PID_HASH_SIZE];
+
+static inline int pid_used(pid_t pid) {
+    return (pid_bitmap[pid / 64] >> (pid % 64)) & 1;
+}
+
+static inline struct task_struct **pid_bucket(pid_t pid) {
+    return &pid_hash[pid & (PID_HASH_SIZE - 1)];
+}
+
+pid_t allocate_pid() {
+    pid_t pid = last_pid;
+    for (int i = 1; i < PID_MAX; i++) {
+        pid = pid + 1 < PID_MAX ? pid + 1 : 1; // 0 is never used
+        uint64 word = pid_bitmap[pid / 64];
+        if (word == ~0ull) {
+            // skip the rest of a full word
+            pid |= 63;
+            continue;
+        }
+        if (!pid_used(pid)) {
+            pid_bitmap[pid / 64] |= 1ull << (pid % 64);
+            last_pid = pid;
+            return pid;
+        }
+    }
+    return -1;
+}
+
+void free_pid(pid_t pid) {
+    if (pid <= 0 || pid >= PID_MAX) return;
+    pid_bitmap[pid / 64] &= ~(1ull << (pid % 64));
+}
+
+void attach_pid(struct task_struct *task) {
+    struct task_struct **bucket = pid_bucket(task->pid);
+    task->pid_hash_next = *bucket;
+    // The task is set up before a reader can find it.
+    rcu_assign_pointer(*bucket, task);
+}
+
+void detach_pid(struct task_struct *task) {
+    for (struct task_struct **p = pid_bucket(task->pid);
+         *p != NULL;
+         p = &(*p)->pid_hash_next) {
+        if (*p == task) {
+            rcu_assign_pointer(*p, task->pid_hash_next);
+            return;
+        }
+    }
+}
+
+struct task_struct *find_task(pid_t pid) {
+    if (pid <= 0 || pid >= PID_MAX) return NULL;
+    for (struct task_struct *task = rcu_dereference(*pid_bucket(pid));
+         task != NULL;
+         task = rcu_dereference(task->pid_hash_next)) {
+        if (task->pid == pid) return task;
+    }
+    return NULL;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file pid.h
+ * @brief Process ID allocation and lookup.
+ * @details
+ * PIDs come from a bitmap, so the IDs of reaped processes are reused. The
+ * search starts after the last allocated PID, so a freed PID is not handed
+ * out again right away. The live tasks are kept in a hash table indexed by
+ * PID, chained through task_struct::pid_hash_next.
+ *
+ * The table is changed with task_list_lock held (see process.h), and may be
+ * read without it: find_task() is safe in an epoch read section (see
+ * epoch.h), and the task it finds is not freed before the section ends. The
+ * task may have been reaped meanwhile, though, so its state is DEAD.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_PID_H
+#define TOY_RISCV_KERNEL_KERNEL_PID_H
+
+#include "types.h"
+
+#define PID_MAX 32768      // PIDs are in [1, PID_MAX)
+#define PID_HASH_SIZE 256  // must be a power of 2
+
+struct task_struct;
+
+/**
+ * Allocate an unused PID.
+ * @return the PID, -1 if all of them are in use
+ */
+pid_t allocate_pid();
+
+/**
+ * Give back a PID. The task holding it must have been detached.
+ */
+void free_pid(pid_t pid);
+
+/**
+ * Make the task reachable by find_task() through its PID.
+ */
+void attach_pid(struct task_struct *task);
+
+/**
+ * Remove the task from the PID table. The task keeps its link into the chain,
+ * so a reader standing on it can go on.
+ */
+void detach_pid(struct task_struct *task);
+
+/**
+ * Find the task with the PID. Call it in an epoch read section, or with
+ * task_list_lock held.
+ * @return the task, NULL if no task has the PID
+ */
+struct task_struct *find_task(pid_t pid);
+
+#endif // TOY_RISCV_KERNEL_KERNEL_PID_H
@@ -4,7 +4,7 @@
 #include "uart.h"
 
 // lock to avoid interleaving concurrent printf's.
-static spinlock lock;
+static spinlock lock = {.name = "print", .cpu = -1};
 
 void print_char(char c) {
     acquire(&lock);
@@ -59,10 +59,13 @@ void print_int(uint64 x, int base) {
             uart_putc_sync('x');
             print_int_hex_without_header(x);
             break;
-        default:
-            print_string("print_int: unsupported base: ");
-            print_int(base, 10);
+        default: {
+            // the lock is held, so print without print_string().
+            const char *msg = "print_int: unsupported base: ";
+            while (*msg != '\0') uart_putc_sync(*msg++);
+            print_int_dec(base);
             break;
+        }
     }
     release(&lock);
 }
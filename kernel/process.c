@@ -2,29 +2,38 @@
 
 #include "defs.h"
 #include "elf.h"
+#include "epoch.h"
+#include "futex.h"
+#include "ipi.h"
+#include "list.h"
 #include "mem_manage.h"
 #include "memlayout.h"
 #include "panic.h"
+#include "pid.h"
 #include "print.h"
+#include "rb_tree.h"
 #include "riscv.h"
 #include "riscv_defs.h"
 #include "signal_defs.h"
 #include "single_linked_list.h"
 #include "switch.h"
 #include "syscall.h"
+#include "timer.h"
+#include "tlb.h"
 #include "trap.h"
 #include "types.h"
 #include "uart.h"
 #include "virtual_memory.h"
 #include "utility.h"
+#include "wait_queue.h"
 
 extern char trampoline[]; // from kernel.ld
 extern pagetable_t kernel_pagetable;
 
-pid_t next_pid = 1;
+void task_entry();
+void finish_task_switch();
+void sleep_timer_expired(struct timer *timer);
 
-void *stack_to_remove = NULL;
-void *stack_to_remove_next = NULL;
 
 #ifdef TOY_RISCV_KERNEL_PRINT_TASK
 void print_task_meta(struct task_struct *task) {
@@ -58,64 +67,178 @@ void print_task_meta(struct task_struct *task) {
 }
 #endif
 
-void *allocate_for_user(size_t power) {
-    void *addr = allocate(power);
+void *allocate_for_user(size_t power, enum migrate_type type) {
+    struct task_struct *task = current_task();
+    int numa_node = task != NULL ? task->numa_node : local_numa_node();
+    void *addr = allocate_on_node(power, numa_node, type);
     if (addr == NULL) return NULL;
     memset(addr, 0, PGSIZE << power);
     return addr;
 }
 
-struct task_struct *new_task(const char *name, struct task_struct *parent) {
-    int map_result = 0;
+// Set up the task_struct and the kernel stack of a new task, with no user
+// memory yet. A thread is charged to its leader for the task_struct, its trap
+// frame and its shared memory.
+static struct task_struct *alloc_task(const char *name,
+                                      struct task_struct *parent,
+                                      struct task_struct *leader) {
     struct task_struct *task = kmalloc(sizeof(struct task_struct));
     if (task == NULL) return NULL;
-    task->kernel_stack = allocate(0); // 4KiB stack is enough
-    task->stack_permission = PTE_U | PTE_R | PTE_W;
-    init_single_linked_list(&(task->mem_sections));
-    task->pagetable = create_void_pagetable();
-    task->trap_frame = allocate_for_user(0);
-    void *shared_memory = allocate_for_user(0);
-    memset(&(task->context), 0, sizeof(struct context));
-    if (task->kernel_stack == NULL || task->pagetable == NULL ||
-        shared_memory == NULL || task->trap_frame == NULL) {
-        deallocate(task->kernel_stack, 0);
-        deallocate(task->pagetable, 0);
+    // A child lives where its parent does; new trees start on this hart.
+    task->numa_node = parent != NULL ? parent->numa_node : local_numa_node();
+    task->killed = 0;
+    task->cpu = 0;
+    task->queued = 0;
+    task->cpu_mask = parent != NULL ? parent->cpu_mask : CPU_MASK_ALL;
+    init_list(&(task->task_link));
+    init_list(&(task->exit_link));
+    init_list(&(task->run_link));
+    // Start at the top, within the limit of the inherited nice value.
+    task->nice = parent != NULL ? parent->nice : 0;
+    task->priority_level = 0;
+    task->ticks_used = 0;
+    task->vruntime = 0;
+    task->exec_start = 0;
+    task->slice_start = 0;
+    // The reservation of a deadline task is not inherited.
+    task->dl_runtime = 0;
+    task->dl_period = 0;
+    task->dl_deadline = 0;
+    task->dl_bandwidth = 0;
+    task->dl_misses = 0;
+    setup_timer(&(task->sleep_timer), sleep_timer_expired);
+    // The limits are inherited, while the usage starts from scratch.
+    for (int i = 0; i < MEMORY_RESOURCES; i++) {
+        task->memory_usage[i] = 0;
+        task->memory_limit[i] =
+            parent != NULL ? parent->memory_limit[i] : MEMORY_UNLIMITED;
+    }
+    task->group_leader = leader != NULL ? leader : task;
+    init_list(&(task->threads));
+    init_list(&(task->thread_link));
+    init_wait_queue(&(task->group_exit));
+    task->group_exiting = 0;
+    task->clear_tid = 0;
+    task->address_space = NULL;
+    task->pagetable = NULL;
+    task->trap_frame = NULL;
+    task->shared_memory = NULL;
+    // The task_struct, the trap frame and the shared memory
+    if (charge_memory(task, MEMORY_KERNEL_OBJECTS, 1) != 0) {
+        kfree(task);
+        return NULL;
+    }
+    if (charge_memory(task, MEMORY_RESIDENT_PAGES, 2) != 0) {
+        uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 1);
         kfree(task);
         return NULL;
     }
+    // 4KiB stack is enough
+    task->kernel_stack = allocate_on_node(0, task->numa_node, MIGRATE_UNMOVABLE);
+    if (task->kernel_stack == NULL) {
+        uncharge_memory(task, MEMORY_RESIDENT_PAGES, 2);
+        uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 1);
+        kfree(task);
+        return NULL;
+    }
+    task->stack_permission = PTE_U | PTE_R | PTE_W;
+    init_list(&(task->children));
+    init_list(&(task->zombies));
+    init_list(&(task->sibling));
+    init_wait_queue(&(task->child_exit));
+    task->stack.size = 0;
+    task->stack.start = 0;
+    memset(&(task->context), 0, sizeof(struct context));
+    task->context.sp = (uint64)task->kernel_stack + PGSIZE;
+    task->context.ra = (uint64)task_entry;
+    strcpy(task->name, name, min(31UL, strlen(name)));
+    return task;
+}
+
+// Give the task its slot in the address space, which is already taken for
+// it, and map its trap frame and shared memory there. On failure, the caller
+// frees them with free_user_memory().
+static int map_thread_pages(struct task_struct *task,
+                            struct address_space *space,
+                            int slot) {
+    task->address_space = space;
+    task->pagetable = space->pagetable;
+    task->thread_slot = slot;
+    // The kernel uses these two through their physical addresses.
+    task->trap_frame = allocate_for_user(0, MIGRATE_UNMOVABLE);
+    task->shared_memory = allocate_for_user(0, MIGRATE_UNMOVABLE);
+    if (task->trap_frame == NULL || task->shared_memory == NULL) return -1;
     task->trap_frame->kernel_satp = (uint64)kernel_pagetable;
     task->trap_frame->epc = 0;
-    map_result |= map_page(
-        task->pagetable,
-        (uint64)TRAPFRAME,
+    int map_result = 0;
+    map_result |= map_user_page(
+        task,
+        TRAPFRAME(slot),
         (uint64)task->trap_frame,
         PTE_R | PTE_W
     );
-    map_result |= map_page(
-        task->pagetable,
-        (uint64)TRAMPOLINE,
-        (uint64)trampoline,
-        PTE_R | PTE_X
-    );
-    map_result |= map_page(
-        task->pagetable,
-        (uint64)SHARED_MEMORY,
-        (uint64)shared_memory,
+    map_result |= map_user_page(
+        task,
+        SHARED_MEMORY(slot),
+        (uint64)task->shared_memory,
         PTE_R | PTE_W | PTE_U
     );
-    if (map_result != 0) {
+    return map_result != 0 ? -1 : 0;
+}
+
+// Create an address space with the task as its only thread, in the slot.
+static struct address_space *new_address_space(struct task_struct *task,
+                                               int slot) {
+    // The address space and its root table
+    if (charge_memory(task, MEMORY_KERNEL_OBJECTS, 1) != 0) return NULL;
+    if (charge_memory(task, MEMORY_PAGETABLE_PAGES, 1) != 0) {
+        uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 1);
+        return NULL;
+    }
+    struct address_space *space = kmalloc(sizeof(struct address_space));
+    pagetable_t pagetable = create_void_pagetable();
+    if (space == NULL || pagetable == NULL) {
+        kfree(space);
+        deallocate(pagetable, 0);
+        uncharge_memory(task, MEMORY_PAGETABLE_PAGES, 1);
+        uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 1);
+        return NULL;
+    }
+    initlock(&(space->lock), "address_space");
+    space->users = 1;
+    space->thread_slots = 1UL << slot;
+    space->pagetable = pagetable;
+    init_single_linked_list(&(space->mem_sections));
+    return space;
+}
+
+struct task_struct *new_task(const char *name,
+                             struct task_struct *parent,
+                             int slot) {
+    struct task_struct *task = alloc_task(name, parent, NULL);
+    if (task == NULL) return NULL;
+    struct address_space *space = new_address_space(task, slot);
+    if (space == NULL ||
+        map_thread_pages(task, space, slot) != 0 ||
+        map_user_page(task, (uint64)TRAMPOLINE, (uint64)trampoline,
+                      PTE_R | PTE_X) != 0) {
         free_user_memory(task);
-        kfree(task);
+        free_task(task);
+        return NULL;
+    }
+    acquire(&task_list_lock);
+    task->pid = allocate_pid();
+    if (task->pid < 0) {
+        release(&task_list_lock);
+        free_user_memory(task);
+        free_task(task);
         return NULL;
     }
+    attach_pid(task);
     task->state = RUNNABLE;
-    task->pid = next_pid++;
     task->parent = parent;
-    task->context.sp = (uint64)task->kernel_stack + PGSIZE;
-    task->context.ra = (uint64)user_trap_return;
-    task->stack.size = 0;
-    task->stack.start = 0;
-    strcpy(task->name, name, min(31UL, strlen(name)));
+    if (parent != NULL) list_insert_tail(&(parent->children), &(task->sibling));
+    release(&task_list_lock);
 #ifdef TOY_RISCV_KERNEL_PRINT_TASK
     print_string("new task: ");
     print_string(task->name);
@@ -125,65 +248,168 @@ struct task_struct *new_task(const char *name, struct task_struct *parent) {
     print_int((uint64)task, 16);
     print_string("\n");
 #endif
-    task->shared_memory = shared_memory;
     return task;
 }
 
+// The threads of a process may charge their leader on several harts at once.
+int charge_memory(struct task_struct *task,
+                  enum memory_resource resource,
+                  size_t amount) {
+    struct task_struct *leader = task->group_leader;
+    size_t limit = leader->memory_limit[resource];
+    size_t *usage = &(leader->memory_usage[resource]);
+    for (;;) {
+        size_t old = *(volatile size_t *)usage;
+        if (amount > limit || old > limit - amount) return -1;
+        if (__sync_bool_compare_and_swap(usage, old, old + amount)) return 0;
+    }
+}
+
+void uncharge_memory(struct task_struct *task,
+                     enum memory_resource resource,
+                     size_t amount) {
+    size_t *usage = &(task->group_leader->memory_usage[resource]);
+    for (;;) {
+        size_t old = *(volatile size_t *)usage;
+        if (__sync_bool_compare_and_swap(usage, old, old - min(amount, old))) {
+            return;
+        }
+    }
+}
+
+// The section must have been charged as resident pages.
 int register_memory_section(struct task_struct *task, uint64 va, size_t size) {
     typedef struct memory_section memory_section;
+    // the section and its list node
+    if (charge_memory(task, MEMORY_KERNEL_OBJECTS, 2) != 0) return -1;
     memory_section *tmp_data = kmalloc(sizeof(memory_section));
     struct single_linked_list_node *tmp = make_single_linked_list_node(tmp_data);
     if (tmp == NULL || tmp_data == NULL) {
         kfree(tmp_data);
         kfree(tmp);
+        uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 2);
         return -1;
     }
     tmp_data->start = va;
     tmp_data->size = size;
-    push_tail(&(task->mem_sections), tmp);
+    push_tail(&(task->address_space->mem_sections), tmp);
     return 0;
 }
 
 int set_stack(struct task_struct *task) {
-    void *stack = allocate_for_user(0);
-    if (stack == NULL) return -1;
-    task->stack.start = SHARED_MEMORY - PGSIZE;
+    if (charge_memory(task, MEMORY_RESIDENT_PAGES, 1) != 0) return -1;
+    void *stack = allocate_for_user(0, MIGRATE_MOVABLE);
+    if (stack == NULL) {
+        uncharge_memory(task, MEMORY_RESIDENT_PAGES, 1);
+        return -1;
+    }
+    uint64 top = SHARED_MEMORY(task->thread_slot);
+    task->stack.start = top - PGSIZE;
     task->stack.size = PGSIZE;
-    task->trap_frame->sp = SHARED_MEMORY;
-    if (map_page(task->pagetable, SHARED_MEMORY - PGSIZE,
-                 (uint64)stack, task->stack_permission) != 0) {
+    task->trap_frame->sp = top;
+    if (map_user_page(task, top - PGSIZE,
+                      (uint64)stack, task->stack_permission) != 0) {
         deallocate(stack, 0);
+        uncharge_memory(task, MEMORY_RESIDENT_PAGES, 1);
+        task->stack.size = 0;
         return -1;
     }
     return 0;
 }
 
+// Free the memory sections of the address space and the stack of the task,
+// keeping the trap frame, the shared memory and the page table. The task must
+// be the only thread using the address space.
 void clear_user_memory_space(struct task_struct *task) {
     pagetable_t pagetable = task->pagetable;
-    stack_to_remove_next = task->kernel_stack;
+    struct single_linked_list *mem_sections =
+        &(task->address_space->mem_sections);
 
-    for (struct single_linked_list_node *node = task->mem_sections.head;
+    for (struct single_linked_list_node *node = mem_sections->head;
          node != NULL;
          node = node->next) {
         struct memory_section *mem_section = node->data;
         free_memory(pagetable, mem_section->start, mem_section->size);
+        uncharge_memory(task, MEMORY_RESIDENT_PAGES,
+                        PGROUNDUP(mem_section->size) / PGSIZE);
+        uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 2);
         kfree(mem_section);
     }
     free_memory(pagetable, task->stack.start, task->stack.size);
-    clear_single_linked_list(&(task->mem_sections));
+    uncharge_memory(task, MEMORY_RESIDENT_PAGES, task->stack.size / PGSIZE);
+    task->stack.start = 0;
+    task->stack.size = 0;
+    clear_single_linked_list(mem_sections);
+}
+
+// Unmap a page of the thread slot, if it has been mapped, and free it. The
+// other threads may still run the page table. The page is unmovable, so
+// compaction never remaps it, and the PTE can be read without a pin.
+static void free_thread_page(pagetable_t pagetable, uint64 va, void *page) {
+    if (page == NULL) return;
+    if (physical_address(pagetable, va) == (uint64)page) {
+        unmap_page(pagetable, va);
+        flush_tlb_page(pagetable, va);
+    }
+    deallocate(page, 0);
 }
 
 void free_user_memory(struct task_struct *task) {
-    pagetable_t pagetable = task->pagetable;
-    deallocate(task->trap_frame, 0);
-    deallocate(task->shared_memory, 0);
-    clear_user_memory_space(task);
-    free_pagetable(pagetable);
+    struct address_space *space = task->address_space;
+    if (space != NULL) {
+        pagetable_t pagetable = space->pagetable;
+        free_memory(pagetable, task->stack.start, task->stack.size);
+        uncharge_memory(task, MEMORY_RESIDENT_PAGES,
+                        task->stack.size / PGSIZE);
+        task->stack.start = 0;
+        task->stack.size = 0;
+        free_thread_page(pagetable, TRAPFRAME(task->thread_slot),
+                         task->trap_frame);
+        free_thread_page(pagetable, SHARED_MEMORY(task->thread_slot),
+                         task->shared_memory);
+        acquire(&(space->lock));
+        space->thread_slots &= ~(1UL << task->thread_slot);
+        int users = --space->users;
+        release(&(space->lock));
+        if (users == 0) {
+            clear_user_memory_space(task);
+            uncharge_memory(task, MEMORY_PAGETABLE_PAGES,
+                            free_pagetable(pagetable));
+            kfree(space);
+            uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 1);
+        }
+        task->address_space = NULL;
+        task->pagetable = NULL;
+    } else {
+        deallocate(task->trap_frame, 0);
+        deallocate(task->shared_memory, 0);
+    }
+    task->trap_frame = NULL;
+    task->shared_memory = NULL;
+    uncharge_memory(task, MEMORY_RESIDENT_PAGES, 2);
+    // A thread gives back its task_struct to the leader now, as the leader
+    // may be gone by the time it is freed.
+    if (task != task->group_leader) {
+        uncharge_memory(task, MEMORY_KERNEL_OBJECTS, 1);
+    }
+}
+
+static void free_task_struct(struct epoch_entry *entry) {
+    kfree(epoch_entry_of(entry, struct task_struct, retire_entry));
+}
+
+void free_task(struct task_struct *task) {
+    acquire(&task_list_lock);
+    list_remove_rcu(&(task->task_link));
+    release(&task_list_lock);
+    retire_pages(task->kernel_stack, 0);
+    retire(&(task->retire_entry), free_task_struct);
 }
 
 uint64 available_from(struct task_struct *task) {
     uint64 max = 0;
-    for (struct single_linked_list_node *node = task->mem_sections.head;
+    for (struct single_linked_list_node *node =
+             task->address_space->mem_sections.head;
          node != NULL;
          node = node->next) {
         struct memory_section *mem_section = node->data;
@@ -196,25 +422,846 @@ uint64 available_from(struct task_struct *task) {
 
 /** Scheduler part */
 
-struct single_linked_list_node *running_task = NULL;
 struct task_struct *init = NULL;
-struct single_linked_list *runnable_tasks = NULL;
-struct single_linked_list *all_tasks = NULL;
-struct context now_context;
+struct spinlock task_list_lock;
+struct list_node all_tasks;
+struct cpu cpus[NCPU];
 
 struct task_struct *current_task() {
-    if (runnable_tasks == NULL) return NULL;
-    return (struct task_struct *)(running_task->data);
+    push_off();
+    struct task_struct *task = my_cpu()->task;
+    pop_off();
+    return task;
+}
+
+#define MLFQ_LEVELS 4
+
+// The run queue of a hart. It holds the RUNNABLE tasks of the hart, but never
+// the running one. Its lock protects them, the scheduling state of every task
+// whose cpu is the hart, and the cpu struct. The lock is held across a
+// context switch, and released by finish_task_switch() on the other side.
+struct run_queue {
+    struct spinlock lock;
+    int cpu;
+    // The number of RUNNABLE tasks. The running task is not counted.
+    int runnable_count;
+    // Timer ticks on this hart
+    uint64 ticks;
+    // The time of the next tick, TIMER_NEVER if none is needed. It is not
+    // moved when the timer is armed again for something else in between.
+    uint64 next_tick;
+    // Tasks that have exited on this hart but still own their memory and
+    // kernel stack. They are torn down by the next task to run here, which is
+    // no longer on their stack.
+    struct list_node exited_tasks;
+    // The task that was running here although its cpu_mask no longer allows
+    // it. It is on no run queue, and finish_task_switch() moves it away.
+    struct task_struct *pushed_task;
+#ifdef TOY_RISCV_KERNEL_SCHED_RR
+    struct list_node rr_queue;
+#endif
+#ifdef TOY_RISCV_KERNEL_SCHED_MLFQ
+    struct list_node mlfq_queues[MLFQ_LEVELS];
+    uint64 last_boost;
+#endif
+#ifdef TOY_RISCV_KERNEL_SCHED_CFS
+    // The runnable tasks ordered by vruntime, linked by run_node
+    struct rb_root cfs_queue;
+    // The total weight of the tasks in cfs_queue
+    uint64 cfs_queue_weight;
+    // Never goes back, so that a task that has slept long does not run for
+    // ages.
+    uint64 min_vruntime;
+#endif
+    // The RUNNABLE deadline tasks ordered by absolute deadline, linked by
+    // run_node
+    struct rb_root deadline_queue;
+    // The tasks waiting for their next period, linked by run_link
+    struct list_node throttled_tasks;
+};
+
+struct run_queue run_queues[NCPU];
+
+static inline struct run_queue *this_run_queue() {
+    return &run_queues[cpuid()];
+}
+
+static inline struct run_queue *task_run_queue(struct task_struct *task) {
+    return &run_queues[task->cpu];
+}
+
+static inline int cpu_allowed(struct task_struct *task, int cpu) {
+    return (task->cpu_mask >> cpu) & 1;
+}
+
+// Flags of enqueue
+#define ENQUEUE_WAKEUP   1 // The task has just stopped sleeping
+#define ENQUEUE_MIGRATED 2 // The task comes from the run queue of another hart
+
+// A scheduling policy. It keeps its part of each run queue, which holds the
+// RUNNABLE tasks but never the running one. The hooks are called with the
+// lock of the run queue held.
+struct sched_class {
+    void (*init)(struct run_queue *rq);
+    int (*has_runnable)(struct run_queue *rq);
+    void (*enqueue)(struct run_queue *rq, struct task_struct *task, int flags);
+    void (*dequeue)(struct run_queue *rq, struct task_struct *task);
+    // Take the next task off the run queue, NULL if it is empty.
+    struct task_struct *(*pick_next)(struct run_queue *rq);
+    // Take a task that may run on the cpu off the run queue, for an idle
+    // hart, NULL if none. The one that would run last goes first, since it
+    // is the least likely to have its data in the cache. Optional.
+    struct task_struct *(*steal)(struct run_queue *rq, int cpu);
+    // Called when the task leaves the run queue (or the hart, if it is not
+    // queued) for another hart, optional.
+    void (*migrate)(struct run_queue *rq, struct task_struct *task);
+    // Called on every timer tick with the running task. Return 1 if the task
+    // should give up the CPU.
+    int (*tick)(struct run_queue *rq, struct task_struct *task);
+    // Called when the running task is switched out, optional
+    void (*put_prev)(struct run_queue *rq, struct task_struct *task);
+};
+
+// Take the last task of the queue that may run on the cpu, for the steal hook
+// of the classes that queue tasks by run_link.
+struct task_struct *steal_from_tail(struct list_node *queue, int cpu) {
+    for (struct list_node *node = queue->prev; node != queue;
+         node = node->prev) {
+        struct task_struct *task =
+            list_entry(node, struct task_struct, run_link);
+        if (cpu_allowed(task, cpu)) {
+            list_remove(node);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+#ifdef TOY_RISCV_KERNEL_SCHED_RR
+
+// Round-robin: a single FIFO queue, and a task runs for one tick at a time.
+void rr_init(struct run_queue *rq) {
+    init_list(&(rq->rr_queue));
+}
+
+int rr_has_runnable(struct run_queue *rq) {
+    return !list_empty(&(rq->rr_queue));
+}
+
+void rr_enqueue(struct run_queue *rq, struct task_struct *task, int flags) {
+    list_insert_tail(&(rq->rr_queue), &(task->run_link));
+}
+
+void rr_dequeue(struct run_queue *rq, struct task_struct *task) {
+    list_remove(&(task->run_link));
+}
+
+struct task_struct *rr_pick_next(struct run_queue *rq) {
+    struct list_node *node = list_first(&(rq->rr_queue));
+    if (node == NULL) return NULL;
+    list_remove(node);
+    return list_entry(node, struct task_struct, run_link);
+}
+
+struct task_struct *rr_steal(struct run_queue *rq, int cpu) {
+    return steal_from_tail(&(rq->rr_queue), cpu);
+}
+
+int rr_tick(struct run_queue *rq, struct task_struct *task) {
+    return 1;
+}
+
+const struct sched_class normal_sched_class = {
+    .init = rr_init,
+    .has_runnable = rr_has_runnable,
+    .enqueue = rr_enqueue,
+    .dequeue = rr_dequeue,
+    .pick_next = rr_pick_next,
+    .steal = rr_steal,
+    .tick = rr_tick,
+};
+
+#endif // TOY_RISCV_KERNEL_SCHED_RR
+
+#ifdef TOY_RISCV_KERNEL_SCHED_MLFQ
+
+// Multi-level feedback queue: level 0 runs first, and the quantum of level i
+// is 2^i ticks. A task that uses up its quantum moves a level down, one that
+// wakes up from sleeping moves a level up, and every MLFQ_BOOST_TICKS all the
+// tasks go back to their base level so that no one starves. The base level is
+// the highest level a task can reach, and is lowered by a positive nice. A
+// negative nice stretches the quantum instead, up to MLFQ_LEVELS + 1 times.
+#define MLFQ_BOOST_TICKS 100
+
+int mlfq_base_level(struct task_struct *task) {
+    return max(task->nice, 0) * MLFQ_LEVELS / (NICE_MAX + 1);
+}
+
+int mlfq_quantum(struct task_struct *task) {
+    int stretch = 1 + max(-task->nice, 0) * MLFQ_LEVELS / (-NICE_MIN);
+    return (1 << task->priority_level) * stretch;
+}
+
+void mlfq_init(struct run_queue *rq) {
+    for (int level = 0; level < MLFQ_LEVELS; level++) {
+        init_list(&(rq->mlfq_queues[level]));
+    }
+    rq->last_boost = 0;
+}
+
+int mlfq_has_runnable(struct run_queue *rq) {
+    for (int level = 0; level < MLFQ_LEVELS; level++) {
+        if (!list_empty(&(rq->mlfq_queues[level]))) return 1;
+    }
+    return 0;
+}
+
+void mlfq_enqueue(struct run_queue *rq, struct task_struct *task, int flags) {
+    int base_level = mlfq_base_level(task);
+    if ((flags & ENQUEUE_WAKEUP) && task->priority_level > 0) {
+        task->priority_level--;
+        task->ticks_used = 0;
+    }
+    if (task->priority_level < base_level) {
+        task->priority_level = base_level;
+        task->ticks_used = 0;
+    }
+    list_insert_tail(&(rq->mlfq_queues[task->priority_level]),
+                     &(task->run_link));
+}
+
+void mlfq_dequeue(struct run_queue *rq, struct task_struct *task) {
+    list_remove(&(task->run_link));
+}
+
+struct task_struct *mlfq_pick_next(struct run_queue *rq) {
+    for (int level = 0; level < MLFQ_LEVELS; level++) {
+        struct list_node *node = list_first(&(rq->mlfq_queues[level]));
+        if (node != NULL) {
+            list_remove(node);
+            return list_entry(node, struct task_struct, run_link);
+        }
+    }
+    return NULL;
+}
+
+// From the lowest level up, so that the task keeps its level and still runs
+// late on the new hart.
+struct task_struct *mlfq_steal(struct run_queue *rq, int cpu) {
+    for (int level = MLFQ_LEVELS - 1; level >= 0; level--) {
+        struct task_struct *task =
+            steal_from_tail(&(rq->mlfq_queues[level]), cpu);
+        if (task != NULL) return task;
+    }
+    return NULL;
+}
+
+void mlfq_reset_level(struct task_struct *task) {
+    task->priority_level = mlfq_base_level(task);
+    task->ticks_used = 0;
+}
+
+// Boost the queued tasks and the running one. The sleeping ones are on no
+// run queue; they move up as they wake up anyway.
+void mlfq_boost(struct run_queue *rq, struct task_struct *running) {
+    struct list_node boosted;
+    init_list(&boosted);
+    for (int level = 0; level < MLFQ_LEVELS; level++) {
+        list_splice_tail(&(rq->mlfq_queues[level]), &boosted);
+    }
+    struct list_node *node;
+    while ((node = list_first(&boosted)) != NULL) {
+        struct task_struct *task =
+            list_entry(node, struct task_struct, run_link);
+        list_remove(node);
+        mlfq_reset_level(task);
+        list_insert_tail(&(rq->mlfq_queues[task->priority_level]), node);
+    }
+    mlfq_reset_level(running);
+    rq->last_boost = rq->ticks;
+}
+
+int mlfq_tick(struct run_queue *rq, struct task_struct *task) {
+    if (rq->ticks - rq->last_boost >= MLFQ_BOOST_TICKS) mlfq_boost(rq, task);
+    task->ticks_used++;
+    if (task->ticks_used >= mlfq_quantum(task)) {
+        if (task->priority_level < MLFQ_LEVELS - 1) task->priority_level++;
+        task->ticks_used = 0;
+        return 1;
+    }
+    // Preempted by a task at a higher level
+    for (int level = 0; level < task->priority_level; level++) {
+        if (!list_empty(&(rq->mlfq_queues[level]))) return 1;
+    }
+    return 0;
+}
+
+const struct sched_class normal_sched_class = {
+    .init = mlfq_init,
+    .has_runnable = mlfq_has_runnable,
+    .enqueue = mlfq_enqueue,
+    .dequeue = mlfq_dequeue,
+    .pick_next = mlfq_pick_next,
+    .steal = mlfq_steal,
+    .tick = mlfq_tick,
+};
+
+#endif // TOY_RISCV_KERNEL_SCHED_MLFQ
+
+#ifdef TOY_RISCV_KERNEL_SCHED_CFS
+
+// Completely fair: every task collects virtual runtime, which is the time it
+// has run scaled down by its weight, and the task with the least runs next.
+// The runnable tasks share CFS_LATENCY in proportion to their weights, so the
+// time slice shrinks as more tasks become runnable, down to
+// CFS_MIN_GRANULARITY. Times are in cycles of the time CSR (10MHz in qemu).
+#define CFS_LATENCY 600000         // 60ms
+#define CFS_MIN_GRANULARITY 100000 // 10ms, one timer tick
+#define NICE_0_WEIGHT 1024
+
+// Each nice level is worth about 10% of CPU time (the table of Linux).
+const uint32 nice_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+uint64 task_weight(struct task_struct *task) {
+    return nice_to_weight[task->nice - NICE_MIN];
+}
+
+int vruntime_less(const struct rb_node *a, const struct rb_node *b) {
+    return rb_entry(a, struct task_struct, run_node)->vruntime <
+           rb_entry(b, struct task_struct, run_node)->vruntime;
+}
+
+void cfs_update_min_vruntime(struct run_queue *rq,
+                             struct task_struct *running) {
+    struct rb_node *first = rb_first(&(rq->cfs_queue));
+    uint64 vruntime;
+    if (first == NULL) {
+        vruntime = running->vruntime;
+    } else {
+        vruntime = rb_entry(first, struct task_struct, run_node)->vruntime;
+        vruntime = min(vruntime, running->vruntime);
+    }
+    rq->min_vruntime = max(rq->min_vruntime, vruntime);
+}
+
+// Charge the time since the last update to the running task.
+void cfs_update_current(struct run_queue *rq, struct task_struct *task) {
+    uint64 now = read_time();
+    uint64 delta = now - task->exec_start;
+    task->exec_start = now;
+    task->vruntime += delta * NICE_0_WEIGHT / task_weight(task);
+    cfs_update_min_vruntime(rq, task);
+}
+
+void cfs_init(struct run_queue *rq) {
+    init_rb_root(&(rq->cfs_queue));
+    rq->cfs_queue_weight = 0;
+    rq->min_vruntime = 0;
+}
+
+int cfs_has_runnable(struct run_queue *rq) {
+    return !rb_empty(&(rq->cfs_queue));
+}
+
+void cfs_enqueue(struct run_queue *rq, struct task_struct *task, int flags) {
+    // The vruntime of a task from another hart is relative to the
+    // min_vruntime there (see cfs_migrate()), so it keeps its lead or lag.
+    if (flags & ENQUEUE_MIGRATED) task->vruntime += rq->min_vruntime;
+    // A new task starts from min_vruntime. A task waking up gets half a
+    // period of credit for the time it slept, but no more.
+    uint64 floor = rq->min_vruntime;
+    if (flags & ENQUEUE_WAKEUP) floor -= min(floor, (uint64)CFS_LATENCY / 2);
+    task->vruntime = max(task->vruntime, floor);
+    rb_insert(&(rq->cfs_queue), &(task->run_node), vruntime_less);
+    rq->cfs_queue_weight += task_weight(task);
+}
+
+void cfs_dequeue(struct run_queue *rq, struct task_struct *task) {
+    rb_erase(&(rq->cfs_queue), &(task->run_node));
+    rq->cfs_queue_weight -= task_weight(task);
+}
+
+struct task_struct *cfs_pick_next(struct run_queue *rq) {
+    struct rb_node *first = rb_first(&(rq->cfs_queue));
+    if (first == NULL) return NULL;
+    struct task_struct *task = rb_entry(first, struct task_struct, run_node);
+    cfs_dequeue(rq, task);
+    task->exec_start = read_time();
+    task->slice_start = task->exec_start;
+    return task;
+}
+
+// The rightmost task has run the most, so it runs last here anyway.
+struct task_struct *cfs_steal(struct run_queue *rq, int cpu) {
+    for (struct rb_node *node = rb_last(&(rq->cfs_queue)); node != NULL;
+         node = rb_prev(node)) {
+        struct task_struct *task = rb_entry(node, struct task_struct, run_node);
+        if (cpu_allowed(task, cpu)) {
+            cfs_dequeue(rq, task);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// The min_vruntime of the harts drift apart, so a task takes its vruntime
+// along relative to the one it leaves.
+void cfs_migrate(struct run_queue *rq, struct task_struct *task) {
+    task->vruntime -= min(task->vruntime, rq->min_vruntime);
+}
+
+int cfs_tick(struct run_queue *rq, struct task_struct *task) {
+    cfs_update_current(rq, task);
+    if (rb_empty(&(rq->cfs_queue))) return 0;
+    uint64 weight = task_weight(task);
+    uint64 slice = CFS_LATENCY * weight / (rq->cfs_queue_weight + weight);
+    slice = max(slice, (uint64)CFS_MIN_GRANULARITY);
+    return task->exec_start - task->slice_start >= slice;
+}
+
+void cfs_put_prev(struct run_queue *rq, struct task_struct *task) {
+    cfs_update_current(rq, task);
+}
+
+const struct sched_class normal_sched_class = {
+    .init = cfs_init,
+    .has_runnable = cfs_has_runnable,
+    .enqueue = cfs_enqueue,
+    .dequeue = cfs_dequeue,
+    .pick_next = cfs_pick_next,
+    .steal = cfs_steal,
+    .migrate = cfs_migrate,
+    .tick = cfs_tick,
+    .put_prev = cfs_put_prev,
+};
+
+#endif // TOY_RISCV_KERNEL_SCHED_CFS
+
+// Earliest deadline first, for periodic tasks with a reservation of runtime
+// every period. The job of each period must get its runtime before its
+// deadline (relative to the start of the period). A task whose runtime is
+// used up is throttled until the next period, and a task that calls yield()
+// is done with this period. The reservations together may not take more than
+// DEADLINE_BANDWIDTH_LIMIT of one CPU, which makes sure every deadline can be
+// met wherever the tasks run. The deadline tasks always run before the others.
+#define DEADLINE_BANDWIDTH_SHIFT 20
+#define DEADLINE_BANDWIDTH_LIMIT ((95ull << DEADLINE_BANDWIDTH_SHIFT) / 100)
+#define DEADLINE_MAX_PERIOD (10ull * TIMER_FREQUENCY) // 10s
+
+// The sum of dl_bandwidth of all the deadline tasks, protected by
+// deadline_lock
+uint64 deadline_bandwidth = 0;
+struct spinlock deadline_lock;
+
+int is_deadline_task(struct task_struct *task) {
+    return task->dl_runtime != 0;
+}
+
+int deadline_less(const struct rb_node *a, const struct rb_node *b) {
+    return rb_entry(a, struct task_struct, run_node)->dl_deadline_at <
+           rb_entry(b, struct task_struct, run_node)->dl_deadline_at;
+}
+
+// Start the job of a new period.
+void start_deadline_job(struct task_struct *task, uint64 release) {
+    task->dl_remaining = task->dl_runtime;
+    task->dl_deadline_at = release + task->dl_deadline;
+    task->dl_next_release = release + task->dl_period;
+}
+
+void throttle_task(struct run_queue *rq, struct task_struct *task) {
+    task->state = SLEEPING;
+    task->channel = NULL;
+    list_insert_tail(&(rq->throttled_tasks), &(task->run_link));
+}
+
+// Charge the time since the last update to the running deadline task. Once
+// its runtime is used up, the job has missed its deadline, since it cannot
+// run again before the next period.
+void deadline_update_current(struct run_queue *rq, struct task_struct *task) {
+    uint64 now = read_time();
+    uint64 delta = now - task->dl_exec_start;
+    task->dl_exec_start = now;
+    task->dl_remaining -= min(delta, task->dl_remaining);
+    if (task->dl_remaining == 0 && task->state == RUNNING) {
+        task->dl_misses++;
+        throttle_task(rq, task);
+    }
+}
+
+void deadline_init(struct run_queue *rq) {
+    init_rb_root(&(rq->deadline_queue));
+    init_list(&(rq->throttled_tasks));
+}
+
+int deadline_has_runnable(struct run_queue *rq) {
+    return !rb_empty(&(rq->deadline_queue));
+}
+
+void deadline_enqueue(struct run_queue *rq,
+                      struct task_struct *task,
+                      int flags) {
+    // It may be woken up while throttled, e.g., by the OOM killer, even
+    // before it has switched out.
+    list_remove(&(task->run_link));
+    if (flags & ENQUEUE_WAKEUP) {
+        // A task that slept through its period starts afresh.
+        uint64 now = read_time();
+        if (now >= task->dl_next_release || now >= task->dl_deadline_at) {
+            start_deadline_job(task, now);
+        }
+    }
+    rb_insert(&(rq->deadline_queue), &(task->run_node), deadline_less);
+}
+
+void deadline_dequeue(struct run_queue *rq, struct task_struct *task) {
+    rb_erase(&(rq->deadline_queue), &(task->run_node));
+}
+
+struct task_struct *deadline_pick_next(struct run_queue *rq) {
+    struct rb_node *first = rb_first(&(rq->deadline_queue));
+    if (first == NULL) return NULL;
+    struct task_struct *task = rb_entry(first, struct task_struct, run_node);
+    deadline_dequeue(rq, task);
+    uint64 now = read_time();
+    if (now > task->dl_deadline_at) {
+        task->dl_misses++;
+        start_deadline_job(task, now);
+    }
+    task->dl_exec_start = now;
+    return task;
+}
+
+int deadline_tick(struct run_queue *rq, struct task_struct *task) {
+    deadline_update_current(rq, task);
+    if (task->state != RUNNING) return 1; // throttled
+    if (read_time() > task->dl_deadline_at) {
+        task->dl_misses++;
+        start_deadline_job(task, read_time());
+    }
+    // Preempted by an earlier deadline
+    struct rb_node *first = rb_first(&(rq->deadline_queue));
+    return first != NULL &&
+           rb_entry(first, struct task_struct, run_node)->dl_deadline_at <
+           task->dl_deadline_at;
+}
+
+const struct sched_class deadline_sched_class = {
+    .init = deadline_init,
+    .has_runnable = deadline_has_runnable,
+    .enqueue = deadline_enqueue,
+    .dequeue = deadline_dequeue,
+    .pick_next = deadline_pick_next,
+    .tick = deadline_tick,
+    .put_prev = deadline_update_current,
+};
+
+// In the order of priority: a runnable task of a class preempts the running
+// task of any later class.
+const struct sched_class *const sched_classes[] = {
+    &deadline_sched_class,
+    &normal_sched_class,
+};
+
+#define SCHED_CLASSES (sizeof(sched_classes) / sizeof(sched_classes[0]))
+
+const struct sched_class *task_sched_class(struct task_struct *task) {
+    return is_deadline_task(task) ? &deadline_sched_class : &normal_sched_class;
+}
+
+// Arm the timer for the next time the scheduler of this hart has something
+// to do. The periodic tick is only needed when the running task may have to
+// make way for a runnable one; a deadline task is stopped when its runtime is
+// used up, and a throttled one is released at its next period. The timer
+// wheel may need it as well. Otherwise, e.g., when only one task runs or none
+// at all, the timer stays off.
+// Another hart that puts a task on this run queue sends an IPI, after which
+// the timer is armed again here. The lock of the run queue is held.
+void update_timer(struct run_queue *rq) {
+    uint64 now = read_time();
+    struct task_struct *task = cpus[rq->cpu].task;
+    if (task != NULL && rq->runnable_count > 0) {
+        if (rq->next_tick == TIMER_NEVER) rq->next_tick = now + TICK_INTERVAL;
+    } else {
+        rq->next_tick = TIMER_NEVER;
+    }
+    uint64 next = min(rq->next_tick, next_timer_event());
+    if (task != NULL && is_deadline_task(task)) {
+        next = min(next, now + task->dl_remaining);
+    }
+    list_for_each(node, &(rq->throttled_tasks)) {
+        struct task_struct *throttled =
+            list_entry(node, struct task_struct, run_link);
+        next = min(next, throttled->dl_next_release);
+    }
+    set_timer(next);
+}
+
+// The task waits behind the running one on the run queue: wake up an idle
+// hart it may run on, which then steals a task.
+static void kick_idle_cpu(struct run_queue *rq, struct task_struct *task) {
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (cpu == rq->cpu || !cpus[cpu].online || !cpu_allowed(task, cpu)) {
+            continue;
+        }
+        if (cpus[cpu].task == NULL && run_queues[cpu].runnable_count == 0) {
+            send_ipi(cpu, IPI_RESCHEDULE);
+            return;
+        }
+    }
+}
+
+// Put a task on the run queue, whose lock is held.
+static void activate_task(struct run_queue *rq,
+                          struct task_struct *task,
+                          int flags) {
+    task->state = RUNNABLE;
+    task->queued = 1;
+    rq->runnable_count++;
+    task_sched_class(task)->enqueue(rq, task, flags);
+    struct task_struct *running = cpus[rq->cpu].task;
+    if (rq->cpu != cpuid()) {
+        // Tell the hart if it is idle, if the running task is no longer
+        // alone, or if it may have to make way for a deadline task.
+        if (running == NULL || rq->runnable_count == 1 ||
+            is_deadline_task(task)) {
+            send_ipi(rq->cpu, IPI_RESCHEDULE);
+        }
+    } else if (rq->runnable_count == 1 && running != NULL) {
+        // The running task is no longer alone, so the tick is needed again.
+        update_timer(rq);
+    }
+    if (running != NULL && !is_deadline_task(task)) kick_idle_cpu(rq, task);
+}
+
+// Take a queued task off the run queue, whose lock is held. It stays
+// RUNNABLE, so wakeups leave it alone until it is queued again.
+static void deactivate_task(struct run_queue *rq, struct task_struct *task) {
+    task_sched_class(task)->dequeue(rq, task);
+    task->queued = 0;
+    rq->runnable_count--;
+}
+
+// Lock the run queue of the task. task->cpu only changes with the locks of
+// both the old and the new run queue held, so it is checked again once the
+// lock is taken.
+static struct run_queue *lock_task_run_queue(struct task_struct *task) {
+    for (;;) {
+        struct run_queue *rq = task_run_queue(task);
+        acquire(&(rq->lock));
+        if (rq->cpu == task->cpu) return rq;
+        release(&(rq->lock));
+    }
+}
+
+// Lock two run queues, which may be the same, in the order of the harts, so
+// that two harts locking the same pair do not deadlock.
+static void double_lock(struct run_queue *a, struct run_queue *b) {
+    if (a->cpu > b->cpu) {
+        struct run_queue *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    acquire(&(a->lock));
+    if (a != b) acquire(&(b->lock));
+}
+
+static void double_unlock(struct run_queue *a, struct run_queue *b) {
+    release(&(a->lock));
+    if (a != b) release(&(b->lock));
+}
+
+// The online hart with the fewest tasks to run among those the task may run
+// on. The loads are read without the locks, so it is only a good guess.
+static int select_task_cpu(struct task_struct *task) {
+    int best = -1;
+    int best_load = 0;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (!cpu_allowed(task, cpu)) continue;
+        if (!cpus[cpu].online && cpu != cpuid()) continue;
+        int load = run_queues[cpu].runnable_count + (cpus[cpu].task != NULL);
+        if (best < 0 || load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best >= 0 ? best : cpuid();
+}
+
+// Put a task that is on no run queue and not running, e.g., a new one, on the
+// run queue of the best hart for it. No one else moves such a task, so its
+// cpu can be read without the lock.
+static void place_task(struct task_struct *task, int flags) {
+    push_off();
+    int cpu = select_task_cpu(task);
+    pop_off();
+    struct run_queue *from = task_run_queue(task);
+    struct run_queue *to = &run_queues[cpu];
+    double_lock(from, to);
+    if (from != to) {
+        const struct sched_class *class = task_sched_class(task);
+        if (class->migrate != NULL) class->migrate(from, task);
+        task->cpu = cpu;
+        flags |= ENQUEUE_MIGRATED;
+    }
+    activate_task(to, task, flags);
+    double_unlock(from, to);
+}
+
+void enqueue_task(struct task_struct *task) {
+    place_task(task, 0);
+}
+
+// Wake up a task of the run queue, whose lock is held.
+static void wake_up_locked(struct run_queue *rq, struct task_struct *task) {
+    if (task->state != SLEEPING) return;
+    // It has not switched out yet, e.g., it is about to yield in a
+    // wait_event() on another hart: it just runs on.
+    if (cpus[rq->cpu].task == task) {
+        task->state = RUNNING;
+        task->channel = NULL;
+        return;
+    }
+    activate_task(rq, task, ENQUEUE_WAKEUP);
+}
+
+// Wake up the task if it sleeps, and only on the channel if one is given. A
+// task that may no longer run on its hart wakes up on another one.
+static void try_to_wake_up(struct task_struct *task, void *channel) {
+    struct run_queue *rq = lock_task_run_queue(task);
+    if (task->state != SLEEPING ||
+        (channel != NULL && task->channel != channel)) {
+        release(&(rq->lock));
+        return;
+    }
+    if (cpus[rq->cpu].task == task || cpu_allowed(task, rq->cpu)) {
+        wake_up_locked(rq, task);
+        release(&(rq->lock));
+        return;
+    }
+    // Off the throttled list, if it is a deadline task
+    list_remove(&(task->run_link));
+    task->state = RUNNABLE;
+    task->channel = NULL;
+    release(&(rq->lock));
+    place_task(task, ENQUEUE_WAKEUP);
+}
+
+void wake_up_task(struct task_struct *task) {
+    try_to_wake_up(task, NULL);
+}
+
+void set_current_state(enum process_state state, void *channel) {
+    struct run_queue *rq = this_run_queue();
+    acquire(&(rq->lock));
+    struct task_struct *task = cpus[rq->cpu].task;
+    task->state = state;
+    task->channel = channel;
+    release(&(rq->lock));
+}
+
+// Steal a task for this idle hart from the busiest other one, whose running
+// task has others waiting behind it. The loads are read without the locks,
+// and the lock of the victim is only tried, since the one of rq is held: an
+// idle hart never waits for a busy one, and two harts stealing from each
+// other do not deadlock. Only the tasks of the normal class move; the
+// deadline ones stay where they are.
+static int steal_task(struct run_queue *rq) {
+    if (normal_sched_class.steal == NULL) return 0;
+    struct run_queue *busiest = NULL;
+    int busiest_load = 1;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct run_queue *victim = &run_queues[cpu];
+        if (victim == rq || !cpus[cpu].online) continue;
+        int load = victim->runnable_count + (cpus[cpu].task != NULL);
+        if (victim->runnable_count > 0 && load > busiest_load) {
+            busiest = victim;
+            busiest_load = load;
+        }
+    }
+    if (busiest == NULL || !try_acquire(&(busiest->lock))) return 0;
+    struct task_struct *task = normal_sched_class.steal(busiest, rq->cpu);
+    if (task != NULL) {
+        task->queued = 0;
+        busiest->runnable_count--;
+        if (normal_sched_class.migrate != NULL) {
+            normal_sched_class.migrate(busiest, task);
+        }
+        task->cpu = rq->cpu;
+    }
+    release(&(busiest->lock));
+    if (task == NULL) return 0;
+    activate_task(rq, task, ENQUEUE_MIGRATED);
+    return 1;
+}
+
+// Take the next task off the run queue, whose lock is held. If there is
+// none, try to steal one from another hart before going idle.
+struct task_struct *pick_next_task(struct run_queue *rq) {
+    do {
+        for (int i = 0; i < SCHED_CLASSES; i++) {
+            struct task_struct *task = sched_classes[i]->pick_next(rq);
+            if (task != NULL) {
+                task->queued = 0;
+                rq->runnable_count--;
+                return task;
+            }
+        }
+    } while (steal_task(rq));
+    return NULL;
+}
+
+// Start the next period of the throttled deadline tasks that are due.
+void release_throttled_tasks(struct run_queue *rq) {
+    uint64 now = read_time();
+    struct list_node *node = rq->throttled_tasks.next;
+    while (node != &(rq->throttled_tasks)) {
+        struct task_struct *task =
+            list_entry(node, struct task_struct, run_link);
+        node = node->next;
+        if (now < task->dl_next_release) continue;
+        list_remove(&(task->run_link));
+        // Keep to the period unless the task has fallen a period behind.
+        if (now - task->dl_next_release < task->dl_period) {
+            start_deadline_job(task, task->dl_next_release);
+        } else {
+            start_deadline_job(task, now);
+        }
+        wake_up_locked(rq, task);
+    }
+}
+
+// Leave the deadline class and give the reservation back. The task is the
+// current one, so it is on no run queue.
+void clear_deadline(struct task_struct *task) {
+    struct run_queue *rq = this_run_queue();
+    acquire(&(rq->lock));
+    acquire(&deadline_lock);
+    deadline_bandwidth -= task->dl_bandwidth;
+    release(&deadline_lock);
+    task->dl_runtime = 0;
+    task->dl_period = 0;
+    task->dl_deadline = 0;
+    task->dl_bandwidth = 0;
+    release(&(rq->lock));
 }
 
 #ifdef TOY_RISCV_KERNEL_PRINT_TASK
 void print_all_task_meta() {
-    for (struct single_linked_list_node *node = all_tasks->head;
-         node != NULL;
-         node = node->next) {
-        struct task_struct *task = node->data;
-        print_task_meta(task);
+    epoch_read_lock();
+    list_for_each_rcu(node, &all_tasks) {
+        print_task_meta(list_entry(node, struct task_struct, task_link));
     }
+    epoch_read_unlock();
 }
 #endif
 
@@ -235,9 +1282,22 @@ void *elf_file(const char *name) {
 }
 
 void init_scheduler() {
-    runnable_tasks = create_single_linked_list();
-    all_tasks = create_single_linked_list();
-    struct task_struct *init_task = new_task("init", NULL);
+    init_timer_wheel();
+    initlock(&task_list_lock, "task_list");
+    initlock(&deadline_lock, "deadline");
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct run_queue *rq = &run_queues[cpu];
+        init_mcs_lock(&(rq->lock), "run_queue");
+        rq->cpu = cpu;
+        rq->runnable_count = 0;
+        rq->ticks = 0;
+        rq->next_tick = TIMER_NEVER;
+        init_list(&(rq->exited_tasks));
+        rq->pushed_task = NULL;
+        for (int i = 0; i < SCHED_CLASSES; i++) sched_classes[i]->init(rq);
+    }
+    init_list(&all_tasks);
+    struct task_struct *init_task = new_task("init", NULL, 0);
     if (init_task == NULL) {
         panic("init_scheduler: cannot create init task");
     }
@@ -245,93 +1305,194 @@ void init_scheduler() {
     if (set_stack(init_task) != 0) {
         panic("init_scheduler: cannot set stack for init task");
     }
-    void *page = allocate_for_user(1);
+    void *page = allocate_for_user(1, MIGRATE_MOVABLE);
     char *env = (char *)page;
     char **vectors = (char **)((uint64)page + PGSIZE);
-    if (page == NULL) {
+    if (page == NULL ||
+        charge_memory(init_task, MEMORY_RESIDENT_PAGES, 2) != 0) {
         panic("init_scheduler: cannot allocate page for init task");
     }
     uint64 va = available_from(init_task);
+    // Fill the pages before mapping them, since compaction may move them
+    // once they are mapped.
+    strcpy(env, "init", 5);
+    vectors[0] = (char *)va;
+    vectors[1] = NULL;
+    vectors[2] = NULL; // envp
     if (register_memory_section(init_task, va, PGSIZE * 2) != 0) {
         panic("init_scheduler: cannot register memory section for init task");
     }
-    if (map_page(init_task->pagetable, va, (uint64)page,
+    if (map_user_page(init_task, va, (uint64)page,
         PTE_R | PTE_W | PTE_U) != 0) {
         panic("init_scheduler: cannot map page for init task");
     }
-    if (map_page(init_task->pagetable, va + PGSIZE, (uint64)page + PGSIZE,
+    if (map_user_page(init_task, va + PGSIZE, (uint64)page + PGSIZE,
         PTE_R | PTE_W | PTE_U) != 0) {
         panic("init_scheduler: cannot map page for init task");
     }
-    strcpy(env, "init", 5);
-    vectors[0] = (char *)va;
-    vectors[1] = NULL;
-    vectors[2] = NULL; // envp
     init_task->trap_frame->a0 = 1; // argc
     init_task->trap_frame->a1 = va + PGSIZE; // argv
     init_task->trap_frame->a2 = va + PGSIZE + 2 * sizeof(char *); // envp
 
-    push_tail(all_tasks, make_single_linked_list_node(init_task));
-    push_tail(runnable_tasks, make_single_linked_list_node(init_task));
+    acquire(&task_list_lock);
+    list_insert_tail_rcu(&all_tasks, &(init_task->task_link));
+    release(&task_list_lock);
+    // The other harts are not online yet, so init runs on this one.
+    enqueue_task(init_task);
     init = init_task;
 }
 
 void scheduler() {
+    struct cpu *cpu = my_cpu();
+    struct run_queue *rq = this_run_queue();
+    cpu->online = 1;
     for (;;) {
         interrupt_off();
-        if (running_task != NULL) {
+        acquire(&(rq->lock));
+        if (cpu->task != NULL) {
             panic("scheduler: trying to run a task while another task is running");
         }
-        if (runnable_tasks->size > 0) {
-            struct single_linked_list_node *task_node = head_node(runnable_tasks);
-            running_task = task_node;
-            struct task_struct *task = task_node->data;
+        struct task_struct *task = pick_next_task(rq);
+        if (task != NULL) {
+            cpu->task = task;
             task->state = RUNNING;
-            pop_head_without_free(runnable_tasks);
-            switch_context(&now_context, &(task->context));
+            update_timer(rq);
+            switch_context(&(cpu->context), &(task->context));
+            finish_task_switch();
+        } else {
+            // Idle until an interrupt comes. wfi returns on a pending
+            // interrupt even though they are off, so none can slip in
+            // between the check above and the wfi, not even the IPI of
+            // another hart that queues a task here.
+            update_timer(rq);
+            release(&(rq->lock));
+            epoch_quiescent();
+            epoch_enter_quiescent();
+            asm volatile("wfi");
+            epoch_exit_quiescent();
         }
         interrupt_on();
     }
 }
 
-struct single_linked_list_node *next_task_to_run() {
-    if (runnable_tasks->size == 0) return NULL;
-    struct single_linked_list_node *candidate_node = head_node(runnable_tasks);
-    struct task_struct *candidate = candidate_node->data;
-    while (candidate != NULL && candidate->state != RUNNABLE) {
-        pop_head(runnable_tasks);
-        candidate_node = head_node(runnable_tasks);
-        candidate = candidate_node->data;
+// Run after every context switch, with the lock of the run queue held since
+// before the switch. The exited tasks are not running any more, so their
+// kernel stacks can go; they have freed their memory already, in
+// exit_thread(), so this stays short. A task that has already been reaped,
+// e.g., a thread, is retired as a whole; the others wait for their parents.
+void finish_task_switch() {
+    struct run_queue *rq = this_run_queue();
+    struct list_node exited;
+    init_list(&exited);
+    list_splice_tail(&(rq->exited_tasks), &exited);
+    struct task_struct *pushed = rq->pushed_task;
+    rq->pushed_task = NULL;
+    release(&(rq->lock));
+    // It has switched out, so it can run elsewhere now.
+    if (pushed != NULL) place_task(pushed, 0);
+    struct list_node *node;
+    while ((node = list_first(&exited)) != NULL) {
+        struct task_struct *task = list_entry(node, struct task_struct, exit_link);
+        // The parent may be reaping it on another hart.
+        acquire(&task_list_lock);
+        list_remove(node);
+        int reaped = task->state == DEAD;
+        void *kernel_stack = task->kernel_stack;
+        if (!reaped) task->kernel_stack = NULL;
+        release(&task_list_lock);
+        if (reaped) {
+            free_task(task);
+        } else {
+            retire_pages(kernel_stack, 0);
+        }
+    }
+    epoch_quiescent();
+}
+
+// A new task starts here on its first context switch.
+void task_entry() {
+    finish_task_switch();
+    user_trap_return();
+}
+
+void scheduler_tick() {
+    run_timers();
+    struct run_queue *rq = this_run_queue();
+    acquire(&(rq->lock));
+    release_throttled_tasks(rq);
+    struct task_struct *task = cpus[rq->cpu].task;
+    int preempt = 0;
+    // The interrupt may have come for a timer rather than the tick. The
+    // deadline class charges the time run, so it is asked every time.
+    int ticked = rq->next_tick != TIMER_NEVER && read_time() >= rq->next_tick;
+    if (ticked) {
+        rq->ticks++;
+        rq->next_tick = TIMER_NEVER;
+    }
+    if (task == NULL) {
+        preempt = 1;
+    } else {
+        const struct sched_class *class = task_sched_class(task);
+        if (ticked || is_deadline_task(task)) preempt = class->tick(rq, task);
+        for (int i = 0; sched_classes[i] != class; i++) {
+            if (sched_classes[i]->has_runnable(rq)) preempt = 1;
+        }
+        // Its cpu_mask no longer allows this hart.
+        if (!cpu_allowed(task, rq->cpu)) preempt = 1;
     }
-    return candidate_node;
+    if (!preempt) update_timer(rq);
+    release(&(rq->lock));
+    if (preempt) yield();
 }
 
 void yield() {
     interrupt_off();
+    struct cpu *cpu = my_cpu();
+    // Only the lock of the run queue may be held across the switch.
+    if (cpu->interrupt_depth != 0) panic("yield: holding locks");
+    struct run_queue *rq = this_run_queue();
+    acquire(&(rq->lock));
 #ifdef TOY_RISCV_KERNEL_PRINT_TASK
     print_string("current task: ");
-    print_task_meta(current_task());
-    print_all_task_meta();
+    print_task_meta(cpu->task);
 #endif
-    deallocate(stack_to_remove, 0);
-    stack_to_remove = stack_to_remove_next;
-    stack_to_remove_next = NULL;
-    struct context *old_context = &now_context;
-    struct task_struct *task = current_task();
-    if (runnable_tasks->size == 0) return;
-    if (task != NULL && task->state == RUNNING) {
-        task->state = RUNNABLE;
-        push_tail(runnable_tasks, running_task);
+    struct context *old_context = &(cpu->context);
+    struct task_struct *task = cpu->task;
+    if (task != NULL) {
+        const struct sched_class *class = task_sched_class(task);
+        if (class->put_prev != NULL) class->put_prev(rq, task);
+        if (task->state == RUNNING && !cpu_allowed(task, rq->cpu)) {
+            // Leave for another hart once switched out.
+            task->state = RUNNABLE;
+            rq->pushed_task = task;
+        } else if (task->state == RUNNING) {
+            if (rq->runnable_count == 0) {
+                update_timer(rq);
+                release(&(rq->lock));
+                return;
+            }
+            activate_task(rq, task, 0);
+        }
         old_context = &(task->context);
     }
 
-    running_task = next_task_to_run();
-    if (running_task == NULL) panic("yield: no task to run");
-    struct task_struct *new_task = current_task();
-    pop_head_without_free(runnable_tasks);
+    cpu->task = pick_next_task(rq);
+    if (cpu->task == NULL) {
+        // Nothing else to run. The scheduler idles until a task wakes up.
+        update_timer(rq);
+        if (task == NULL) {
+            release(&(rq->lock));
+            return;
+        }
+        switch_context(old_context, &(cpu->context));
+        finish_task_switch();
+        return;
+    }
+    struct task_struct *new_task = cpu->task;
     new_task->state = RUNNING;
-    interrupt_on();
+    update_timer(rq);
     switch_context(old_context, &(new_task->context));
+    finish_task_switch();
 }
 
 #ifdef TOY_RISCV_KERNEL_TEST_SCHEDULER
@@ -355,26 +1516,26 @@ struct task_struct *new_task_with_data(
     void *src_memory,
     size_t size
 ) {
-    struct task_struct *task = new_task(name, parent);
+    struct task_struct *task = new_task(name, parent, 0);
     if (task == NULL) return NULL;
     typedef struct memory_section memory_section;
     memory_section *tmp_data = kmalloc(sizeof(memory_section));
     struct single_linked_list_node *tmp = make_single_linked_list_node(tmp_data);
     if (tmp == NULL || tmp_data == NULL) {
         free_user_memory(task);
-        kfree(task);
+        free_task(task);
         kfree(tmp_data);
         return NULL;
     }
     tmp_data->start = 0UL;
     tmp_data->size = size;
-    push_tail(&(task->mem_sections), tmp);
+    push_tail(&(task->address_space->mem_sections), tmp);
     if (map_memory(task->pagetable,
                    src_memory,
                    size,
                    PTE_R | PTE_W | PTE_X | PTE_U) == 0) {
         free_user_memory(task);
-        kfree(task);
+        free_task(task);
         return NULL;
     }
     return task;
@@ -385,119 +1546,287 @@ void test_scheduler() {
     struct task_struct *task2 = new_task_with_data("task2", NULL, program2, sizeof(program2));
     map_page(task1->pagetable, UART0, UART0, PTE_R | PTE_W | PTE_X | PTE_U);
     map_page(task2->pagetable, UART0, UART0, PTE_R | PTE_W | PTE_X | PTE_U);
-    push_tail(runnable_tasks, make_single_linked_list_node(task1));
-    push_tail(all_tasks, make_single_linked_list_node(task1));
-    push_tail(runnable_tasks, make_single_linked_list_node(task2));
-    push_tail(all_tasks, make_single_linked_list_node(task2));
+    enqueue_task(task1);
+    list_insert_tail_rcu(&all_tasks, &(task1->task_link));
+    enqueue_task(task2);
+    list_insert_tail_rcu(&all_tasks, &(task2->task_link));
     scheduler();
 }
 #endif // TOY_RISCV_KERNEL_TEST_SCHEDULER
 
-void reparent(void *data) {
-    struct task_struct *task = (struct task_struct *)data;
-    if (task->parent != NULL && task->parent->state == ZOMBIE) {
-        task->parent = init;
-    }
-}
-
 int is_alive(struct task_struct *task) {
     return task != NULL && (task->state != ZOMBIE || task->state != DEAD);
 }
 
-int has_alive_child(struct task_struct *task) {
-    struct single_linked_list_node *node = all_tasks->head;
-    while (node != NULL) {
-        struct task_struct *child = (struct task_struct *)(node->data);
-        if (child->parent == task && is_alive(child)) return 1;
-        node = node->next;
-    }
-    return 0;
+struct task_struct *get_one_zombie_child(struct task_struct *task) {
+    struct list_node *node = list_first(&(task->zombies));
+    return node == NULL ? NULL : list_entry(node, struct task_struct, sibling);
 }
 
-struct task_struct *get_one_zombie_child(struct task_struct *task) {
-    struct single_linked_list_node *node = all_tasks->head;
-    while (node != NULL) {
-        struct task_struct *child = (struct task_struct *)(node->data);
-        if (child->parent == task && child->state == ZOMBIE) return child;
-        node = node->next;
-    }
-    return NULL;
+// The task is reaped, so its PID can be reused.
+void release_pid(struct task_struct *task) {
+    detach_pid(task);
+    free_pid(task->pid);
 }
 
-struct task_struct *find_task(pid_t pid) {
-    struct single_linked_list_node *node = all_tasks->head;
-    while (node != NULL) {
-        struct task_struct *task = (struct task_struct *)(node->data);
-        if (task->pid == pid) return task;
-        node = node->next;
+// The parent has got the exit status of the zombie child. The task_struct is
+// to be freed by the caller, once task_list_lock is released, if this returns
+// 1; otherwise the child is still waiting to be torn down, and
+// finish_task_switch() frees it.
+int reap(struct task_struct *child) {
+    list_remove(&(child->sibling));
+    child->state = DEAD;
+    release_pid(child);
+    return list_empty(&(child->exit_link));
+}
+
+// Hand the children of an exiting task over to init. Readers without the
+// lock see either parent, both of which stay valid until they are done.
+void reparent_children(struct task_struct *task) {
+    list_for_each(node, &(task->children)) {
+        rcu_assign_pointer(list_entry(node, struct task_struct, sibling)->parent,
+                           init);
     }
-    return NULL;
+    list_for_each(node, &(task->zombies)) {
+        rcu_assign_pointer(list_entry(node, struct task_struct, sibling)->parent,
+                           init);
+    }
+    list_splice_tail(&(task->children), &(init->children));
+    struct task_struct *zombie = get_one_zombie_child(task);
+    list_splice_tail(&(task->zombies), &(init->zombies));
+    // init may be waiting for any of its children
+    if (zombie != NULL) wake_up_key(&(init->child_exit), zombie);
 }
 
+// In an epoch read section, or with task_list_lock held.
 int is_ancestor(struct task_struct *ancestor, struct task_struct *task) {
     if (task == NULL || ancestor == NULL) return 0;
-    struct task_struct *tmp = task->parent;
+    struct task_struct *tmp = rcu_dereference(task->parent);
     while (tmp != NULL) {
         if (tmp == ancestor) return 1;
-        tmp = tmp->parent;
+        tmp = rcu_dereference(tmp->parent);
     }
     return 0;
 }
 
+// Threads are not children: they are reaped as they exit.
 struct task_struct *child_with_pid(struct task_struct *task, pid_t pid) {
     struct task_struct *child = find_task(pid);
-    if (child != NULL && child->parent == task && child->state != ZOMBIE) {
-        return child;
-    }
-    return NULL;
+    return child != NULL && child->parent == task &&
+           child->group_leader == child ? child : NULL;
 }
 
+// A thread forks a child of its process, whose only thread takes the same
+// slot, with a copy of the stack of the thread.
 uint64 fork_process(struct task_struct *task) {
-    struct task_struct *child = new_task(task->name, task);
+    struct task_struct *child =
+        new_task(task->name, task->group_leader, task->thread_slot);
     if (child == NULL) return -1;
     int map_result = 0;
     map_result |= copy_all_memory_with_pagetable(task, child);
+    if (map_result != 0) {
+        // copy_all_memory_with_pagetable() has freed the memory of the child
+        acquire(&task_list_lock);
+        list_remove(&(child->sibling));
+        release_pid(child);
+        release(&task_list_lock);
+        free_task(child);
+        return -1;
+    }
     *(child->trap_frame) = *(task->trap_frame);
     child->trap_frame->a0 = 0; // fork() returns 0 in the child process
     child->trap_frame->epc += 4;
-    if (map_result != 0) {
-        free_user_memory(task);
-        kfree(task);
+    pid_t pid = child->pid;
+    acquire(&task_list_lock);
+    list_insert_tail_rcu(&all_tasks, &(child->task_link));
+    release(&task_list_lock);
+    // It may run on another hart at once.
+    enqueue_task(child);
+    return pid;
+}
+
+// Undo a thread that has not started.
+static uint64 discard_thread(struct task_struct *thread) {
+    free_user_memory(thread);
+    free_task(thread);
+    return -1;
+}
+
+uint64 clone_thread(struct task_struct *task,
+                    uint64 entry,
+                    uint64 arg0,
+                    uint64 arg1,
+                    uint64 tls,
+                    uint64 tid_address) {
+    struct task_struct *leader = task->group_leader;
+    struct address_space *space = task->address_space;
+    // The ID is stored there once the thread exists, so fail early if it
+    // cannot be.
+    if (tid_address != 0 &&
+        put_user_int(task->pagetable, tid_address, 0) != 0) {
         return -1;
     }
-    push_tail(runnable_tasks, make_single_linked_list_node(child));
-    push_tail(all_tasks, make_single_linked_list_node(child));
-    return child->pid;
+    struct task_struct *thread = alloc_task(task->name, leader, leader);
+    if (thread == NULL) return -1;
+    thread->stack_permission = task->stack_permission;
+    int slot = -1;
+    acquire(&(space->lock));
+    for (int i = 0; i < MAX_THREADS; i++) {
+        if ((space->thread_slots & (1UL << i)) == 0) {
+            slot = i;
+            space->thread_slots |= 1UL << i;
+            space->users++;
+            break;
+        }
+    }
+    release(&(space->lock));
+    if (slot < 0 ||
+        map_thread_pages(thread, space, slot) != 0 ||
+        set_stack(thread) != 0) {
+        return discard_thread(thread);
+    }
+    struct trap_frame *trap_frame = thread->trap_frame;
+    trap_frame->epc = entry;
+    trap_frame->a0 = arg0;
+    trap_frame->a1 = arg1;
+    trap_frame->tp = tls;
+    trap_frame->gp = task->trap_frame->gp;
+    acquire(&task_list_lock);
+    // A process that is exiting has killed its threads already.
+    if (leader->group_exiting) {
+        release(&task_list_lock);
+        return discard_thread(thread);
+    }
+    thread->pid = allocate_pid();
+    if (thread->pid < 0) {
+        release(&task_list_lock);
+        return discard_thread(thread);
+    }
+    attach_pid(thread);
+    thread->state = RUNNABLE;
+    thread->parent = leader;
+    list_insert_tail(&(leader->threads), &(thread->thread_link));
+    list_insert_tail_rcu(&all_tasks, &(thread->task_link));
+    release(&task_list_lock);
+    pid_t tid = thread->pid;
+    thread->clear_tid = tid_address;
+    if (tid_address != 0) put_user_int(task->pagetable, tid_address, tid);
+    // It may run on another hart at once.
+    enqueue_task(thread);
+    return tid;
+}
+
+// Make the task exit on its way back to user space. Called with
+// task_list_lock held.
+static void kill_task(struct task_struct *task) {
+    task->killed = 1;
+    wake_up_task(task);
+    // A task running on another hart is made to trap.
+    struct run_queue *rq = lock_task_run_queue(task);
+    if (cpus[rq->cpu].task == task && rq->cpu != cpuid()) {
+        send_ipi(rq->cpu, IPI_RESCHEDULE);
+    }
+    release(&(rq->lock));
+}
+
+// Kill the other threads of the process of the task. Called with
+// task_list_lock held.
+static void kill_other_threads(struct task_struct *task) {
+    struct task_struct *leader = task->group_leader;
+    if (leader != task) kill_task(leader);
+    list_for_each(node, &(leader->threads)) {
+        struct task_struct *thread =
+            list_entry(node, struct task_struct, thread_link);
+        if (thread != task) kill_task(thread);
+    }
 }
 
 void exit_process(struct task_struct *task, int status) {
     if (task == NULL) {
         panic("exit_process: the process is NULL");
     }
-    if (task->parent == NULL) {
+    struct task_struct *leader = task->group_leader;
+    if (leader->parent == NULL) {
         panic("exit_process: exit from init process");
     }
-    free_user_memory(task);
-    task->state = ZOMBIE;
-    task->exit_status = status;
-    for_each_node(all_tasks, reparent);
-    if (task->parent->state == SLEEPING) {
-        if (task->parent->channel == task->parent ||
-            task->parent->channel == task) {
-            task->state = DEAD;
-            task->parent->state = RUNNABLE;
-            task->parent->trap_frame->a0 = task->pid;
-            // save in a1 temporarily
-            task->parent->trap_frame->a1 = task->exit_status;
-            push_tail(runnable_tasks,
-                      make_single_linked_list_node(task->parent));
+    acquire(&task_list_lock);
+    // The first thread to exit the process gives the status.
+    if (!leader->group_exiting) {
+        leader->group_exiting = 1;
+        leader->exit_status = status;
+        kill_other_threads(task);
+    }
+    release(&task_list_lock);
+    exit_thread(task, status);
+}
+
+void exit_thread(struct task_struct *task, int status) {
+    struct task_struct *leader = task->group_leader;
+    if (task == leader && task->parent == NULL) {
+        panic("exit_thread: exit from init process");
+    }
+    clear_deadline(task);
+    // Tell a thread joining this one, which may sleep on the word.
+    if (task->clear_tid != 0 &&
+        put_user_int(task->pagetable, task->clear_tid, 0) == 0) {
+        futex_wake(task, task->clear_tid, MAX_THREADS);
+    }
+    if (task != leader) {
+        // The memory goes here, with the interrupts on, rather than in
+        // finish_task_switch(). The thread leaves the leader only once it is
+        // done, so that the leader, which waits for the threads, is the last
+        // to use the address space.
+        free_user_memory(task);
+        acquire(&task_list_lock);
+        list_remove(&(task->thread_link));
+        if (list_empty(&(leader->threads))) {
+            wake_up_all(&(leader->group_exit));
         }
+        // Nobody waits for a thread, so it is reaped as it exits.
+        release_pid(task);
+        struct run_queue *rq = this_run_queue();
+        acquire(&(rq->lock));
+        task->state = DEAD;
+        list_insert_tail(&(rq->exited_tasks), &(task->exit_link));
+        release(&(rq->lock));
+        release(&task_list_lock);
+        yield();
+        panic("exit_thread: should not reach here\n");
     }
+    // The process ends with its last thread. The leader may have been killed
+    // by another thread, but it waits anyway.
+    acquire(&task_list_lock);
+    wait_event_locked_uninterruptible(&(task->group_exit),
+                                      list_empty(&(task->threads)),
+                                      &task_list_lock);
+    release(&task_list_lock);
+    free_user_memory(task);
+    acquire(&task_list_lock);
+    if (!task->group_exiting) task->exit_status = status;
+    reparent_children(task);
+    // Still running on its kernel stack, so the stack is freed after the
+    // switch. It is queued before the parent can see it as a zombie, so that
+    // reap() leaves the task_struct alone.
+    struct run_queue *rq = this_run_queue();
+    acquire(&(rq->lock));
+    task->state = ZOMBIE;
+    list_insert_tail(&(rq->exited_tasks), &(task->exit_link));
+    release(&(rq->lock));
+    list_remove(&(task->sibling));
+    list_insert_tail(&(task->parent->zombies), &(task->sibling));
+    wake_up_key(&(task->parent->child_exit), task);
+    release(&task_list_lock);
     yield();
-    panic("exit_process: should not reach here\n");
+    panic("exit_thread: should not reach here\n");
 }
 
 uint64 exec_process(struct task_struct *task, int argv_size, int envp_size) {
+    // The other threads would lose their memory.
+    acquire(&task_list_lock);
+    int threaded = task != task->group_leader ||
+                   !list_empty(&(task->threads));
+    release(&task_list_lock);
+    if (threaded) return -1;
     interrupt_off();
     char *ptr = task->shared_memory;
     char *const name = ptr;
@@ -516,7 +1845,10 @@ uint64 exec_process(struct task_struct *task, int argv_size, int envp_size) {
     if (load_elf(elf, task) || set_stack(task) != 0) {
         exit_process(task, -1);
     }
-    void *page = allocate_for_user(1);
+    if (charge_memory(task, MEMORY_RESIDENT_PAGES, 2) != 0) {
+        exit_process(task, -1);
+    }
+    void *page = allocate_for_user(1, MIGRATE_MOVABLE);
     if (page == NULL) {
         exit_process(task, -1);
     }
@@ -547,11 +1879,11 @@ uint64 exec_process(struct task_struct *task, int argv_size, int envp_size) {
     if (register_memory_section(task, va, PGSIZE * 2) != 0) {
         exit_process(task, -1);
     }
-    if (map_page(task->pagetable, va, (uint64)page,
+    if (map_user_page(task, va, (uint64)page,
         PTE_R | PTE_W | PTE_U) != 0) {
         exit_process(task, -1);
     }
-    if (map_page(task->pagetable, va + PGSIZE, (uint64)page + PGSIZE,
+    if (map_user_page(task, va + PGSIZE, (uint64)page + PGSIZE,
         PTE_R | PTE_W | PTE_U) != 0) {
         exit_process(task, -1);
     }
@@ -578,11 +1910,112 @@ uint64 exec_process(struct task_struct *task, int argv_size, int envp_size) {
     panic("exec_process: should not reach here\n");
 }
 
-void sleep(struct task_struct *task, void *channel) {
-    task->state = SLEEPING;
-    task->channel = channel;
-    removeAt(runnable_tasks, task);
-    yield();
+// How late sleep_ns may wake a task up, so that nearby wakeups share an
+// interrupt: 50us, or 0.1% of a longer sleep up to 100ms.
+#define SLEEP_SLACK     (TIMER_FREQUENCY / 20000)
+#define SLEEP_SLACK_MAX (TIMER_FREQUENCY / 10)
+
+void sleep_timer_expired(struct timer *timer) {
+    struct task_struct *task =
+        timer_entry(timer, struct task_struct, sleep_timer);
+    try_to_wake_up(task, timer);
+}
+
+// Sleep until the time, in cycles. The task is marked SLEEPING before it
+// checks the timer, so the wakeup is not lost if the timer fires in between.
+void sleep_until_time(struct task_struct *task, uint64 when) {
+    uint64 now = read_time();
+    if (when <= now) return;
+    struct timer *timer = &(task->sleep_timer);
+    timer->expires = when;
+    timer->slack = min(max((uint64)SLEEP_SLACK, (when - now) / 1000),
+                       (uint64)SLEEP_SLACK_MAX);
+    add_timer(timer);
+    for (;;) {
+        set_current_state(SLEEPING, timer);
+        // Woken up early, e.g., by the OOM killer
+        if (!timer_pending(timer) || task->killed) break;
+        yield();
+    }
+    set_current_state(RUNNING, NULL);
+    cancel_timer(timer);
+}
+
+/** Out of memory */
+
+static struct task_struct *choose_oom_victim() {
+    struct task_struct *victim = NULL;
+    list_for_each(node, &all_tasks) {
+        struct task_struct *task = list_entry(node, struct task_struct, task_link);
+        // The memory of a process is charged to its leader.
+        if (task == init || task != task->group_leader || task->killed ||
+            task->state == ZOMBIE || task->state == DEAD) {
+            continue;
+        }
+        if (victim == NULL ||
+            task->memory_usage[MEMORY_RESIDENT_PAGES] >
+            victim->memory_usage[MEMORY_RESIDENT_PAGES]) {
+            victim = task;
+        }
+    }
+    return victim;
+}
+
+// The process killed last, until it has given its memory back. Protected by
+// task_list_lock.
+static pid_t oom_victim = 0;
+
+// How long an allocation waits for the victim to exit before it fails.
+#define OOM_WAIT_TICKS 100
+
+// The leader frees the address space before it becomes a zombie. A task
+// that has taken the PID meanwhile has not been killed. Called with
+// task_list_lock held.
+static int oom_victim_exited(pid_t pid) {
+    struct task_struct *victim = find_task(pid);
+    return victim == NULL || !victim->killed ||
+           victim->state == ZOMBIE || victim->state == DEAD;
+}
+
+int out_of_memory() {
+    if (init == NULL) return 0;
+    struct task_struct *task = current_task();
+    acquire(&task_list_lock);
+    pid_t pid = oom_victim;
+    // Another allocation has killed a process that is still exiting; wait
+    // for that one rather than killing a second.
+    if (pid == 0 || oom_victim_exited(pid)) {
+        struct task_struct *victim = choose_oom_victim();
+        pid = victim == NULL ? 0 : victim->pid;
+        if (victim != NULL) {
+            print_string("Out of memory: killed process ");
+            print_int(victim->pid, 10);
+            print_string(" (");
+            print_string(victim->name);
+            print_string("), ");
+            print_int(victim->memory_usage[MEMORY_RESIDENT_PAGES], 10);
+            print_string(" pages\n");
+            // It may be in the middle of a system call using its memory, so
+            // it frees the memory itself, in exit_thread().
+            kill_task(victim);
+            kill_other_threads(victim);
+        }
+        oom_victim = pid;
+    }
+    release(&task_list_lock);
+    // Only a task that may sleep waits, and not for itself.
+    if (pid == 0 || task == NULL || task->group_leader->pid == pid ||
+        !interrupt_status()) {
+        return 0;
+    }
+    for (int i = 0; i < OOM_WAIT_TICKS && !task->killed; i++) {
+        acquire(&task_list_lock);
+        int exited = oom_victim_exited(pid);
+        release(&task_list_lock);
+        if (exited) return 1;
+        sleep_until_time(task, read_time() + TICK_INTERVAL);
+    }
+    return 0;
 }
 
 /** Syscall part */
@@ -597,6 +2030,20 @@ uint64 sys_yield(struct task_struct *task);
 uint64 sys_power_off(struct task_struct *task);
 uint64 sys_put_char(struct task_struct *task);
 uint64 sys_get_char(struct task_struct *task);
+uint64 sys_get_memory_usage(struct task_struct *task);
+uint64 sys_set_memory_limit(struct task_struct *task);
+uint64 sys_nice(struct task_struct *task);
+uint64 sys_set_deadline(struct task_struct *task);
+uint64 sys_get_deadline(struct task_struct *task);
+uint64 sys_sleep_ns(struct task_struct *task);
+uint64 sys_sleep_until(struct task_struct *task);
+uint64 sys_get_time_ns(struct task_struct *task);
+uint64 sys_set_affinity(struct task_struct *task);
+uint64 sys_get_affinity(struct task_struct *task);
+uint64 sys_get_lock_stats(struct task_struct *task);
+uint64 sys_clone(struct task_struct *task);
+uint64 sys_exit_thread(struct task_struct *task);
+uint64 sys_futex(struct task_struct *task);
 
 #define SYSCALL_FORK        1
 #define SYSCALL_EXEC        2
@@ -608,6 +2055,20 @@ uint64 sys_get_char(struct task_struct *task);
 #define SYSCALL_POWER_OFF   8
 #define SYSCALL_PUT_CHAR    9
 #define SYSCALL_GET_CHAR    10
+#define SYSCALL_GET_MEMORY_USAGE 11
+#define SYSCALL_SET_MEMORY_LIMIT 12
+#define SYSCALL_NICE        13
+#define SYSCALL_SET_DEADLINE 14
+#define SYSCALL_GET_DEADLINE 15
+#define SYSCALL_SLEEP_NS    16
+#define SYSCALL_SLEEP_UNTIL 17
+#define SYSCALL_GET_TIME_NS 18
+#define SYSCALL_SET_AFFINITY 19
+#define SYSCALL_GET_AFFINITY 20
+#define SYSCALL_GET_LOCK_STATS 21
+#define SYSCALL_CLONE       22
+#define SYSCALL_EXIT_THREAD 23
+#define SYSCALL_FUTEX       24
 
 static uint64 (*syscalls[])(struct task_struct *) = {
     [SYSCALL_FORK]        = sys_fork,
@@ -620,6 +2081,20 @@ static uint64 (*syscalls[])(struct task_struct *) = {
     [SYSCALL_POWER_OFF]   = sys_power_off,
     [SYSCALL_PUT_CHAR]    = sys_put_char,
     [SYSCALL_GET_CHAR]    = sys_get_char,
+    [SYSCALL_GET_MEMORY_USAGE] = sys_get_memory_usage,
+    [SYSCALL_SET_MEMORY_LIMIT] = sys_set_memory_limit,
+    [SYSCALL_NICE]        = sys_nice,
+    [SYSCALL_SET_DEADLINE] = sys_set_deadline,
+    [SYSCALL_GET_DEADLINE] = sys_get_deadline,
+    [SYSCALL_SLEEP_NS]    = sys_sleep_ns,
+    [SYSCALL_SLEEP_UNTIL] = sys_sleep_until,
+    [SYSCALL_GET_TIME_NS] = sys_get_time_ns,
+    [SYSCALL_SET_AFFINITY] = sys_set_affinity,
+    [SYSCALL_GET_AFFINITY] = sys_get_affinity,
+    [SYSCALL_GET_LOCK_STATS] = sys_get_lock_stats,
+    [SYSCALL_CLONE]       = sys_clone,
+    [SYSCALL_EXIT_THREAD] = sys_exit_thread,
+    [SYSCALL_FUTEX]       = sys_futex,
 };
 
 void syscall() {
@@ -653,69 +2128,92 @@ uint64 sys_exit(struct task_struct *task) {
     return 0;
 }
 
-uint64 sys_wait(struct task_struct *task) {
-    struct task_struct *zombie_child = get_one_zombie_child(task);
-    uint64 status_ptr = task->trap_frame->a0;
-    if (zombie_child != NULL) {
-        if (status_ptr != 0) {
-            int *status = task->shared_memory;
-            *status = zombie_child->exit_status;
-        }
-        zombie_child->state = DEAD;
-        return zombie_child->pid;
+// clone(entry, arg0, arg1, tls, tid): start a thread of the process, see
+// clone_thread().
+uint64 sys_clone(struct task_struct *task) {
+    struct trap_frame *trap_frame = task->trap_frame;
+    return clone_thread(task, trap_frame->a0, trap_frame->a1, trap_frame->a2,
+                        trap_frame->a3, trap_frame->a4);
+}
+
+uint64 sys_exit_thread(struct task_struct *task) {
+    exit_thread(task, task->trap_frame->a0);
+    return 0;
+}
+
+uint64 sys_futex(struct task_struct *task) {
+    struct trap_frame *trap_frame = task->trap_frame;
+    uint64 addr = trap_frame->a0;
+    int value = trap_frame->a2;
+    switch (trap_frame->a1) {
+        case FUTEX_WAIT:
+            return futex_wait(task, addr, value);
+        case FUTEX_WAKE:
+            return futex_wake(task, addr, value);
+        default:
+            return -1;
     }
-    if (has_alive_child(task) == NULL) return -1;
-    sleep(task, task);
-    // running again
+}
+
+// Reap a zombie child, and give its exit status to the parent. Called with
+// task_list_lock held, which it releases.
+uint64 reap_zombie(struct task_struct *task,
+                   struct task_struct *zombie_child,
+                   uint64 status_ptr) {
     if (status_ptr != 0) {
         int *status = task->shared_memory;
-        *status = task->trap_frame->a1; // the status is saved in a1
+        *status = zombie_child->exit_status;
     }
-    return task->trap_frame->a0;
+    pid_t zombie_pid = zombie_child->pid;
+    int free = reap(zombie_child);
+    release(&task_list_lock);
+    if (free) free_task(zombie_child);
+    return zombie_pid;
 }
 
-uint64 sys_wait_pid(struct task_struct *task) {
-    pid_t pid = task->trap_frame->a0;
-    void *channel = NULL;
+// Wait for any child. The children wake the parent up when they exit.
+uint64 wait_any_child(struct task_struct *task, uint64 status_ptr) {
     struct task_struct *zombie_child = NULL;
-    if (pid == -1) {
-        zombie_child = get_one_zombie_child(task);
-        if (zombie_child == NULL) {
-            if (has_alive_child(task) == NULL) return -1;
-        }
-        channel = task;
-    } else {
-        struct task_struct *child = child_with_pid(task, pid);
-        if (child == NULL) return -1;
-        if (child->state == ZOMBIE) {
-            zombie_child = child;
-        } else {
-            channel = child;
-        }
+    acquire(&task_list_lock);
+    if (wait_event_locked(&(task->child_exit), NULL, 0,
+                          (zombie_child = get_one_zombie_child(task)) != NULL ||
+                          list_empty(&(task->children)),
+                          &task_list_lock) != 0 ||
+        zombie_child == NULL) {
+        release(&task_list_lock);
+        return -1;
     }
+    return reap_zombie(task, zombie_child, status_ptr);
+}
+
+uint64 sys_wait(struct task_struct *task) {
+    return wait_any_child(task, task->trap_frame->a0);
+}
+
+uint64 sys_wait_pid(struct task_struct *task) {
+    pid_t pid = task->trap_frame->a0;
     uint64 status_ptr = task->trap_frame->a1;
-    if (zombie_child != NULL) {
-        if (status_ptr != 0) {
-            int *status = task->shared_memory;
-            *status = zombie_child->exit_status;
-        }
-        zombie_child->state = DEAD;
-        return zombie_child->pid;
-    }
-    sleep(task, channel);
-    // running again
-    if (status_ptr != 0) {
-        int *status = task->shared_memory;
-        *status = task->trap_frame->a1; // the status is saved in a1
+    if (pid == -1) return wait_any_child(task, status_ptr);
+    acquire(&task_list_lock);
+    struct task_struct *child = child_with_pid(task, pid);
+    // Not woken up by the other children.
+    if (child == NULL ||
+        wait_event_locked(&(task->child_exit), child, 0,
+                          child->state == ZOMBIE, &task_list_lock) != 0) {
+        release(&task_list_lock);
+        return -1;
     }
-    return task->trap_frame->a0;
+    return reap_zombie(task, child, status_ptr);
 }
 
 uint64 sys_send_signal(struct task_struct *task) {
     pid_t pid = task->trap_frame->a0;
     int signal = task->trap_frame->a1;
+    epoch_read_lock();
     struct task_struct *target = find_task(pid);
-    if (is_ancestor(task, target) == 0 || is_alive(target)) return -1;
+    int allowed = is_ancestor(task, target) != 0 && !is_alive(target);
+    epoch_read_unlock();
+    if (!allowed) return -1;
     switch (signal) {
         case NOTHING: // do nothing
             break;
@@ -732,6 +2230,14 @@ uint64 sys_send_signal(struct task_struct *task) {
 }
 
 uint64 sys_yield(struct task_struct *task) {
+    // A deadline task is done with the job of this period.
+    if (is_deadline_task(task)) {
+        struct run_queue *rq = this_run_queue();
+        acquire(&(rq->lock));
+        deadline_update_current(rq, task);
+        if (task->state == RUNNING) throttle_task(rq, task);
+        release(&(rq->lock));
+    }
     yield();
     return 0;
 }
@@ -750,25 +2256,219 @@ uint64 sys_put_char(struct task_struct *task) {
 
 uint64 sys_get_char(struct task_struct *task) {
     int c;
-    while ((c = uart_getc()) == -1 && runnable_tasks->size > 0) yield();
-    while ((c = uart_getc()) == -1) asm volatile("wfi");
-    return c;
+    acquire(&uart_rx_lock);
+    // Each character wakes up one reader.
+    int result = wait_event_locked(&console_input, NULL, 1,
+                                   (c = uart_read()) != -1, &uart_rx_lock);
+    release(&uart_rx_lock);
+    return result != 0 ? -1 : c;
+}
+
+uint64 sys_get_memory_usage(struct task_struct *task) {
+    pid_t pid = task->trap_frame->a0;
+    epoch_read_lock();
+    struct task_struct *target = pid == 0 ? task : find_task(pid);
+    if (target == NULL || target->state == DEAD) {
+        epoch_read_unlock();
+        return -1;
+    }
+    // The leader outlives the threads, and keeps the usage of them all.
+    target = target->group_leader;
+    // The usage of every resource, followed by the limits
+    size_t *info = task->shared_memory;
+    for (int i = 0; i < MEMORY_RESOURCES; i++) {
+        info[i] = target->memory_usage[i];
+        info[MEMORY_RESOURCES + i] = target->memory_limit[i];
+    }
+    epoch_read_unlock();
+    return 0;
+}
+
+uint64 sys_set_memory_limit(struct task_struct *task) {
+    int resource = task->trap_frame->a0;
+    size_t limit = task->trap_frame->a1;
+    if (resource < 0 || resource >= MEMORY_RESOURCES) return -1;
+    task = task->group_leader;
+    // Only init may raise a limit.
+    if (limit > task->memory_limit[resource] && task != init) return -1;
+    task->memory_limit[resource] = limit;
+    return 0;
+}
+
+uint64 sys_nice(struct task_struct *task) {
+    int increment = task->trap_frame->a0;
+    int nice = max(NICE_MIN, min(NICE_MAX, task->nice + increment));
+    // Only init may raise the priority. Under MLFQ a negative nice means a
+    // longer quantum, see mlfq_quantum().
+    if (nice < task->nice && task != init) return -1;
+    task->nice = nice;
+    return 0;
+}
+
+// The times are given in microseconds.
+uint64 sys_set_deadline(struct task_struct *task) {
+    uint64 runtime = task->trap_frame->a0 * (TIMER_FREQUENCY / 1000000);
+    uint64 period = task->trap_frame->a1 * (TIMER_FREQUENCY / 1000000);
+    uint64 deadline = task->trap_frame->a2 * (TIMER_FREQUENCY / 1000000);
+    if (runtime == 0) {
+        clear_deadline(task);
+        return 0;
+    }
+    if (deadline == 0) deadline = period;
+    if (runtime > deadline || deadline > period ||
+        period > DEADLINE_MAX_PERIOD) {
+        return -1;
+    }
+    // Admission control on the density, which is no less than the share of
+    // the CPU and keeps EDF schedulable when the deadline is before the end
+    // of the period.
+    uint64 bandwidth = (runtime << DEADLINE_BANDWIDTH_SHIFT) / deadline;
+    struct run_queue *rq = this_run_queue();
+    acquire(&(rq->lock));
+    acquire(&deadline_lock);
+    if (deadline_bandwidth - task->dl_bandwidth + bandwidth >
+        DEADLINE_BANDWIDTH_LIMIT) {
+        release(&deadline_lock);
+        release(&(rq->lock));
+        return -1;
+    }
+    deadline_bandwidth = deadline_bandwidth - task->dl_bandwidth + bandwidth;
+    release(&deadline_lock);
+    task->dl_runtime = runtime;
+    task->dl_period = period;
+    task->dl_deadline = deadline;
+    task->dl_bandwidth = bandwidth;
+    task->dl_misses = 0;
+    task->dl_exec_start = read_time();
+    start_deadline_job(task, task->dl_exec_start);
+    release(&(rq->lock));
+    return 0;
+}
+
+uint64 sys_get_deadline(struct task_struct *task) {
+    pid_t pid = task->trap_frame->a0;
+    epoch_read_lock();
+    struct task_struct *target = pid == 0 ? task : find_task(pid);
+    if (target == NULL || target->state == DEAD) {
+        epoch_read_unlock();
+        return -1;
+    }
+    // runtime, period and deadline in microseconds, then the misses
+    uint64 *info = task->shared_memory;
+    info[0] = target->dl_runtime / (TIMER_FREQUENCY / 1000000);
+    info[1] = target->dl_period / (TIMER_FREQUENCY / 1000000);
+    info[2] = target->dl_deadline / (TIMER_FREQUENCY / 1000000);
+    info[3] = target->dl_misses;
+    epoch_read_unlock();
+    return 0;
+}
+
+uint64 sys_sleep_ns(struct task_struct *task) {
+    uint64 duration = task->trap_frame->a0 / NS_PER_CYCLE;
+    uint64 now = read_time();
+    // Saturate rather than wrap around.
+    sleep_until_time(task, now + min(duration, TIMER_NEVER - now));
+    return 0;
+}
+
+// The time is in nanoseconds since boot, like get_time_ns.
+uint64 sys_sleep_until(struct task_struct *task) {
+    sleep_until_time(task, task->trap_frame->a0 / NS_PER_CYCLE);
+    return 0;
+}
+
+uint64 sys_get_time_ns(struct task_struct *task) {
+    return read_time() * NS_PER_CYCLE;
+}
+
+// The task itself for pid 0, or one of its descendants. task_list_lock is
+// held, or it is an epoch read section.
+static struct task_struct *affinity_target(struct task_struct *task,
+                                           pid_t pid) {
+    struct task_struct *target = pid == 0 ? task : find_task(pid);
+    if (target == NULL || target->state == ZOMBIE || target->state == DEAD) {
+        return NULL;
+    }
+    if (target != task && !is_ancestor(task, target)) return NULL;
+    return target;
+}
+
+// set_affinity(pid, mask): bit i of the mask allows hart i. A task that is
+// queued on a hart it may no longer run on moves at once; a running one moves
+// at its next tick, or right away if it is the caller.
+uint64 sys_set_affinity(struct task_struct *task) {
+    pid_t pid = task->trap_frame->a0;
+    uint64 mask = task->trap_frame->a1 & CPU_MASK_ALL;
+    uint64 online_mask = 0;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if (cpus[cpu].online) online_mask |= 1UL << cpu;
+    }
+    if ((mask & online_mask) == 0) return -1;
+    acquire(&task_list_lock);
+    struct task_struct *target = affinity_target(task, pid);
+    if (target == NULL) {
+        release(&task_list_lock);
+        return -1;
+    }
+    struct run_queue *rq = lock_task_run_queue(target);
+    target->cpu_mask = mask;
+    int move = target->queued && !cpu_allowed(target, rq->cpu);
+    if (move) deactivate_task(rq, target);
+    // A task running on another hart moves at its next tick, which may be
+    // far away.
+    if (cpus[rq->cpu].task == target && rq->cpu != cpuid() &&
+        !cpu_allowed(target, rq->cpu)) {
+        send_ipi(rq->cpu, IPI_RESCHEDULE);
+    }
+    release(&(rq->lock));
+    release(&task_list_lock);
+    if (move) place_task(target, 0);
+    if (target == task) {
+        push_off();
+        int stay = cpu_allowed(task, cpuid());
+        pop_off();
+        if (!stay) yield();
+    }
+    return 0;
+}
+
+// get_affinity(pid): the mask of the harts the task may run on, or -1.
+uint64 sys_get_affinity(struct task_struct *task) {
+    pid_t pid = task->trap_frame->a0;
+    epoch_read_lock();
+    struct task_struct *target = affinity_target(task, pid);
+    uint64 mask = target != NULL ? target->cpu_mask : -1;
+    epoch_read_unlock();
+    return mask;
+}
+
+// get_lock_stats(): the statistics of as many lock names as fit in the shared
+// memory, and the number of names.
+uint64 sys_get_lock_stats(struct task_struct *task) {
+    return read_lock_stats(task->shared_memory,
+                           PGSIZE / sizeof(struct lock_stats));
 }
 
 /** Trap handlers for specific causes */
 
-inline int within_stack_range(uint64 addr) {
-    return addr >= MIN_STACK_ADDR && addr < SHARED_MEMORY;
+inline int within_stack_range(struct task_struct *task, uint64 addr) {
+    return addr >= MIN_STACK_ADDR(task->thread_slot) &&
+           addr < SHARED_MEMORY(task->thread_slot);
 }
 
 int enlarge_stack_by_a_page(struct task_struct *task) {
-    void *page = allocate_for_user(0);
-    if (page == NULL) return -1;
+    if (charge_memory(task, MEMORY_RESIDENT_PAGES, 1) != 0) return -1;
+    void *page = allocate_for_user(0, MIGRATE_MOVABLE);
+    if (page == NULL) {
+        uncharge_memory(task, MEMORY_RESIDENT_PAGES, 1);
+        return -1;
+    }
     uint64 original_start = task->stack.start;
     uint64 new_start = original_start - PGSIZE;
-    if (map_page(task->pagetable, new_start, (uint64)page,
-                 task->stack_permission) != 0) {
+    if (map_user_page(task, new_start, (uint64)page,
+                      task->stack_permission) != 0) {
         deallocate(page, 0);
+        uncharge_memory(task, MEMORY_RESIDENT_PAGES, 1);
         return -1;
     }
     task->stack.start -= PGSIZE;
@@ -777,7 +2477,7 @@ int enlarge_stack_by_a_page(struct task_struct *task) {
 }
 
 int try_enlarge_stack(struct task_struct *task, uint64 addr) {
-    if (within_stack_range(addr)) {
+    if (within_stack_range(task, addr)) {
         uint64 new_start = PGROUNDDOWN(addr);
         if (new_start < task->stack.start) {
             size_t times_of_enlargement =
@@ -805,6 +2505,11 @@ void handle_load_page_fault(struct task_struct *task) {
 
 void handle_store_page_fault(struct task_struct *task) {
     uint64 addr = read_stval();
+    // Compaction is moving the page on another hart: try again later.
+    if (is_migration_fault(task->pagetable, addr)) {
+        yield();
+        return;
+    }
     if (try_enlarge_stack(task, addr) == 0) return;
     print_string("Store page fault at ");
     print_int(addr, 16);
@@ -1,13 +1,20 @@
 #ifndef TOY_RISCV_KERNEL_KERNEL_PROC_H
 #define TOY_RISCV_KERNEL_KERNEL_PROC_H
 
+#include "device_tree.h"
+#include "epoch.h"
+#include "list.h"
+#include "mem_manage.h"
+#include "rb_tree.h"
 #include "riscv.h"
 #include "single_linked_list.h"
+#include "spinlock.h"
+#include "timer.h"
 #include "types.h"
+#include "wait_queue.h"
 
-// the current process. Since the kernel now only supports single CPU, it will
-// always be the current process.
-static inline int cpuid() { return 0; }
+#define NCPU MAX_HARTS
+#define CPU_MASK_ALL ((1UL << NCPU) - 1)
 
 enum process_state {
     SLEEPING, // blocked
@@ -37,9 +44,10 @@ struct context {
     uint64 s11;
 };
 
-// per-process data for the trap handling code in trampoline.S.
-// sits in a page by itself just under the trampoline page in the
-// user page table. not specially mapped in the kernel page table.
+// per-thread data for the trap handling code in trampoline.S.
+// sits in a page by itself at TRAPFRAME(slot) in the user page
+// table, see memlayout.h. not specially mapped in the kernel page
+// table; the trampoline finds it in sscratch.
 // user_vector in trampoline.S saves user registers in the trap_frame,
 // then initializes registers from the trap_frame's
 // kernel_sp, kernel_hartid, kernel_satp, and jumps to kernel_trap.
@@ -88,23 +96,115 @@ struct trap_frame {
     /* 280 */ uint64 t6;
 };
 
+// Per-hart state.
+struct cpu {
+    struct task_struct *task;   // The task running on this hart, or NULL
+    struct context context;     // switch_context() here to enter scheduler()
+    int interrupt_depth;        // Depth of push_off() nesting
+    int interrupt_enabled;      // Were interrupts enabled before push_off()?
+    int online;                 // Running scheduler()
+};
+
+extern struct cpu cpus[NCPU];
+
+// The hart this code runs on. start() keeps the hart id in tp, and so does
+// the trampoline while in user space. Interrupts must be off, or the task
+// may move to another hart right after.
+static inline int cpuid() { return (int)read_tp(); }
+
+static inline struct cpu *my_cpu() { return &cpus[cpuid()]; }
+
 struct memory_section {
     uint64 start; // Align to 4KB
     size_t size;
 };
 
+// The user memory of a process, shared by its threads. The memory sections
+// only change while the process has a single thread, e.g., in exec(), and the
+// lock serializes the changes to the page table itself, as the threads may
+// map pages at the same time. Every thread owns a slot, for its trap frame,
+// shared memory and stack, see memlayout.h.
+struct address_space {
+    struct spinlock lock;
+    int users;                              // The threads using it
+    uint64 thread_slots;                    // The slots in use, one bit each
+    pagetable_t pagetable;                  // User page table
+    struct single_linked_list mem_sections; // Memory data
+};
+
+// The kinds of memory charged to a task. The numbers are part of the
+// get_memory_usage and set_memory_limit syscalls.
+enum memory_resource {
+    MEMORY_RESIDENT_PAGES,  // pages mapped for user space
+    MEMORY_PAGETABLE_PAGES, // pages of the user page table
+    MEMORY_KERNEL_OBJECTS,  // kmalloc'd objects owned by the task
+    MEMORY_RESOURCES
+};
+
+#define MEMORY_UNLIMITED ((size_t)-1)
+
+// A lower nice value means a higher priority.
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
 // Per-process state
 struct task_struct {
-    // if multiple CPUs are supported, there should be a spinlock here
+    // state, channel and the scheduling fields are protected by the lock
+    // of the run queue of cpu; the process tree by task_list_lock.
     enum process_state state;               // Process state
     void *channel;                          // If non-zero, sleeping on chan
+    int cpu;                                // The hart whose run queue it is on
+    int queued;                             // On the run queue of cpu
+    uint64 cpu_mask;                        // Harts it may run on, inherited
     pid_t pid;                              // Process ID
+    struct list_node task_link;             // In all_tasks
+    struct list_node run_link;              // In a run queue while RUNNABLE
+    struct rb_node run_node;                // In the CFS queue while RUNNABLE
+    struct list_node exit_link;             // In exited_tasks until torn down
+    struct epoch_entry retire_entry;        // Frees the task_struct after
+                                            // free_task()
+    struct task_struct *pid_hash_next;      // Next task in the PID bucket
     struct task_struct *parent;             // Parent process
+    struct list_node children;              // Children that have not exited
+    struct list_node zombies;               // Children to be waited for
+    struct list_node sibling;               // In children or zombies of parent
+    struct wait_queue child_exit;           // Waiting for children to exit
+    int numa_node;                          // Home NUMA node for memory
+    size_t memory_usage[MEMORY_RESOURCES];  // Memory charged to the task,
+                                            // kept by the leader
+    size_t memory_limit[MEMORY_RESOURCES];  // Inherited across fork
+    int killed;                             // Chosen by the OOM killer, or
+                                            // by another thread in exit()
+    struct task_struct *group_leader;       // The first thread of its process
+    struct list_node threads;               // Leader: the other threads
+    struct list_node thread_link;           // In threads of the leader
+    struct wait_queue group_exit;           // Leader: waits for the threads
+    int group_exiting;                      // Leader: exit() has been called
+    int thread_slot;                        // Its slot in the address space
+    uint64 clear_tid;                       // Zeroed and woken as a futex
+                                            // when the thread exits
+    int nice;                               // NICE_MIN to NICE_MAX, inherited
+    int priority_level;                     // MLFQ level, 0 runs first
+    uint64 ticks_used;                      // Ticks used at this level
+    uint64 vruntime;                        // CFS: weighted time run
+    uint64 exec_start;                      // CFS: time of the last update
+    uint64 slice_start;                     // CFS: when it was picked
+    uint64 dl_runtime;                      // Deadline: runtime per period,
+                                            // 0 if not a deadline task
+    uint64 dl_period;                       // Deadline: period
+    uint64 dl_deadline;                     // Deadline: relative deadline
+    uint64 dl_bandwidth;                    // Deadline: reserved density
+    uint64 dl_remaining;                    // Deadline: runtime left
+    uint64 dl_deadline_at;                  // Deadline: of the current job
+    uint64 dl_next_release;                 // Deadline: next period starts
+    uint64 dl_exec_start;                   // Deadline: time of the last update
+    uint64 dl_misses;                       // Deadline: missed deadlines
+    struct timer sleep_timer;               // Wakes the task from sleep_ns
     void *kernel_stack;                     // Virtual address of kernel stack
-    struct single_linked_list mem_sections; // Memory data
+    struct address_space *address_space;    // Shared by the threads
     uint64 stack_permission;                // Stack permission
     struct memory_section stack;           // Stack memory section
-    pagetable_t pagetable;                  // User page table
+    pagetable_t pagetable;                  // Of the address space
     struct trap_frame *trap_frame;          // data page for trampoline.S
     void *shared_memory;                    // Shared memory for syscall
     struct context context;                 // switch_context() here
@@ -112,26 +212,68 @@ struct task_struct {
     char name[32];                          // Process name (debugging)
 };
 
+// Protects all_tasks, the PIDs, the parent, children and zombies of every
+// task, and the threads of every leader. all_tasks, the PID table and the
+// parent pointers are published for readers without the lock, which use an
+// epoch read section instead.
+extern struct spinlock task_list_lock;
+
 struct task_struct *current_task();
 
 /**
  * Allocate a power of pages for the user process. This function will
- * allocate the memory and clean it to 0.
+ * allocate the memory and clean it to 0. The pages come from the home NUMA
+ * node of the current task if possible.
+ * @param power the power of 2
+ * @param type MIGRATE_MOVABLE if the kernel only reaches the pages through the
+ *             user page table once they are mapped
+ */
+void *allocate_for_user(size_t power, enum migrate_type type);
+
+/**
+ * Charge memory to the task before it is allocated. The threads of a process
+ * share the usage and the limits of their leader, and may charge it at the
+ * same time.
+ * @param task the task
+ * @param resource what kind of memory
+ * @param amount the number of pages or objects
+ * @return 0 if success, -1 if the limit of the task would be exceeded
+ */
+int charge_memory(struct task_struct *task,
+                  enum memory_resource resource,
+                  size_t amount);
+
+/**
+ * Give back memory charged by charge_memory() once it is freed.
  */
-void *allocate_for_user(size_t power);
+void uncharge_memory(struct task_struct *task,
+                     enum memory_resource resource,
+                     size_t amount);
 
 /**
- * Create the task_struct for a new user process.
+ * Kill the process with the most resident pages, except init, unless the one
+ * killed last is still exiting. The threads of the victim free its memory as
+ * they exit. The caller then sleeps until the victim is gone, if it may sleep
+ * and is not the victim itself.
+ * @return 1 if the victim has exited (worth retrying the allocation), 0 if
+ * not
+ */
+int out_of_memory();
+
+/**
+ * Create the task_struct for a new user process, with an address space of
+ * its own.
  * Note: the struct only contains the core components of a process, and the
  * other components, for example. the instructions, stack, and data, is not
  * allocated in this function.
  * @param name the name of the process, only 31 characters are kept
  * @param parent the parent process, NULL if it is the init
- * @param src_memory the source address of the memory
- * @param size the size of the memory
+ * @param slot the thread slot of its first thread, see memlayout.h
  * @return the task_struct of the new process, NULL if failed
  */
-struct task_struct *new_task(const char *name, struct task_struct *parent);
+struct task_struct *new_task(const char *name,
+                             struct task_struct *parent,
+                             int slot);
 
 /**
  * Register a memory section for the user process. This should be called every
@@ -140,23 +282,55 @@ struct task_struct *new_task(const char *name, struct task_struct *parent);
 int register_memory_section(struct task_struct *task, uint64 va, size_t size);
 
 /**
- * Free the memory of the user process. This function should be called when the
- * process is terminated. Please note that the task_struct is not freed.
+ * Free the memory of the user thread: its stack, trap frame and shared memory,
+ * and the address space if it is the last thread using it. This function
+ * should be called when the thread is terminated. Please note that the
+ * task_struct and the kernel stack are not freed.
  */
 void free_user_memory(struct task_struct *task);
 
+/**
+ * Unlink the task from the task list, and retire the kernel stack and the
+ * task_struct, which are freed once no lock-free reader can see them. The user
+ * memory must have been freed.
+ */
+void free_task(struct task_struct *task);
+
 /**
  * Initialize the scheduler.
  * Set up the environment for the scheduler, and create the first user process.
  */
 void init_scheduler();
 
-/* Start the scheduling work. */
+/**
+ * Start the scheduling work on this hart. Every hart calls it once it is set
+ * up, and never returns.
+ */
 void scheduler();
 
 /* Try to switch to other user process. */
 void yield();
 
+/**
+ * Handle the timer interrupt: fire the expired timers, account a tick to the
+ * running task if one is due, and preempt the task if it should make way.
+ */
+void scheduler_tick();
+
+/**
+ * Make a sleeping task runnable again.
+ */
+void wake_up_task(struct task_struct *task);
+
+/**
+ * Set the state of the current task, e.g., to SLEEPING before it checks
+ * whether it still has to wait. A wake_up_task() after that sets it back to
+ * RUNNING, so the wakeup is not lost even if it comes from another hart
+ * before the task has yielded.
+ * @param channel what the task sleeps on, for debugging
+ */
+void set_current_state(enum process_state state, void *channel);
+
 /**
  * Handle all system calls.
  */
@@ -164,8 +338,38 @@ void syscall();
 
 uint64 fork_process(struct task_struct *task);
 
+/**
+ * End the process of the task: its other threads are killed, and it becomes
+ * a zombie once the last of them has exited.
+ * @param status the exit status, unless another thread has called it first
+ */
 void exit_process(struct task_struct *task, int status);
 
+/**
+ * End only this thread of the process, freeing its user memory. The leader
+ * stays in here until the other threads have exited, and then ends the
+ * process.
+ */
+void exit_thread(struct task_struct *task, int status);
+
+/**
+ * Start a thread in the process of the task, sharing its address space.
+ * @param entry where the thread starts, with its stack pointer at the top of
+ *              the stack of its slot
+ * @param arg0 the a0 of the thread
+ * @param arg1 the a1 of the thread
+ * @param tls the tp of the thread
+ * @param tid_address where to store the ID of the thread, which is cleared
+ *                    when it exits; 0 if none
+ * @return the ID of the thread, -1 if failed
+ */
+uint64 clone_thread(struct task_struct *task,
+                    uint64 entry,
+                    uint64 arg0,
+                    uint64 arg1,
+                    uint64 tls,
+                    uint64 tid_address);
+
 uint64 exec_process(struct task_struct *task, int argv_size, int envp_size);
 
 void handle_load_page_fault(struct task_struct *task);
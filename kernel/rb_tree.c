@@ -0,0 +1,239 @@
+/**
+ * @file rb_tree.c
+ * @brief Red-black tree balancing
+ * @details
+ * See Introduction to Algorithms, chapter 13. The leaves are NULL rather than
+ * a sentinel node, so the parent of a missing node is passed around
+ * explicitly when erasing.
+ */
+
+#include "rb_tree.h"
+
+#include "types.h"
+
+static inline int is_red(const struct rb_node *node) {
+    return node != NULL && node->color == RB_RED;
+}
+
+static inline int is_black(const struct rb_node *node) {
+    return !is_red(node);
+}
+
+// Put new_child where old_child was under parent.
+static void replace_child(struct rb_root *root,
+                          struct rb_node *parent,
+                          struct rb_node *old_child,
+                          struct rb_node *new_child) {
+    if (parent == NULL) {
+        root->node = new_child;
+    } else if (parent->left == old_child) {
+        parent->left = new_child;
+    } else {
+        parent->right = new_child;
+    }
+}
+
+static void rotate_left(struct rb_root *root, struct rb_node *node) {
+    struct rb_node *right = node->right;
+    node->right = right->left;
+    if (right->left != NULL) right->left->parent = node;
+    right->parent = node->parent;
+    replace_child(root, node->parent, node, right);
+    right->left = node;
+    node->parent = right;
+}
+
+static void rotate_right(struct rb_root *root, struct rb_node *node) {
+    struct rb_node *left = node->left;
+    node->left = left->right;
+    if (left->right != NULL) left->right->parent = node;
+    left->parent = node->parent;
+    replace_child(root, node->parent, node, left);
+    left->right = node;
+    node->parent = left;
+}
+
+static void insert_fixup(struct rb_root *root, struct rb_node *node) {
+    while (is_red(node->parent)) {
+        struct rb_node *parent = node->parent;
+        // The parent is red, so it is not the root.
+        struct rb_node *grandparent = parent->parent;
+        if (parent == grandparent->left) {
+            struct rb_node *uncle = grandparent->right;
+            if (is_red(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                grandparent->color = RB_RED;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_right(root, grandparent);
+        } else {
+            struct rb_node *uncle = grandparent->left;
+            if (is_red(uncle)) {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                grandparent->color = RB_RED;
+                node = grandparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            grandparent->color = RB_RED;
+            rotate_left(root, grandparent);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+void rb_insert(struct rb_root *root,
+               struct rb_node *node,
+               int (*less)(const struct rb_node *, const struct rb_node *)) {
+    struct rb_node *parent = NULL;
+    struct rb_node **link = &(root->node);
+    while (*link != NULL) {
+        parent = *link;
+        link = less(node, parent) ? &(parent->left) : &(parent->right);
+    }
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+    insert_fixup(root, node);
+}
+
+// node has taken the place of a black node and may be NULL, so its parent is
+// given as well.
+static void erase_fixup(struct rb_root *root,
+                        struct rb_node *node,
+                        struct rb_node *parent) {
+    while (node != root->node && is_black(node)) {
+        if (node == parent->left) {
+            struct rb_node *sibling = parent->right;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rotate_left(root, parent);
+        } else {
+            struct rb_node *sibling = parent->left;
+            if (is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (is_black(sibling->left) && is_black(sibling->right)) {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (is_black(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rotate_right(root, parent);
+        }
+        node = root->node;
+        break;
+    }
+    if (node != NULL) node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_root *root, struct rb_node *node) {
+    struct rb_node *child;
+    struct rb_node *parent;
+    int removed_color;
+    if (node->left == NULL || node->right == NULL) {
+        child = node->left != NULL ? node->left : node->right;
+        parent = node->parent;
+        removed_color = node->color;
+        if (child != NULL) child->parent = parent;
+        replace_child(root, parent, node, child);
+    } else {
+        // Move the successor into the place of the node.
+        struct rb_node *successor = node->right;
+        while (successor->left != NULL) successor = successor->left;
+        removed_color = successor->color;
+        child = successor->right;
+        if (successor->parent == node) {
+            parent = successor;
+        } else {
+            parent = successor->parent;
+            if (child != NULL) child->parent = parent;
+            parent->left = child;
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+        successor->left = node->left;
+        node->left->parent = successor;
+        successor->parent = node->parent;
+        replace_child(root, node->parent, node, successor);
+        successor->color = node->color;
+    }
+    if (removed_color == RB_BLACK) erase_fixup(root, child, parent);
+}
+
+struct rb_node *rb_first(const struct rb_root *root) {
+    struct rb_node *node = root->node;
+    if (node == NULL) return NULL;
+    while (node->left != NULL) node = node->left;
+    return node;
+}
+
+struct rb_node *rb_last(const struct rb_root *root) {
+    struct rb_node *node = root->node;
+    if (node == NULL) return NULL;
+    while (node->right != NULL) node = node->right;
+    return node;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node) {
+    if (node->left != NULL) {
+        node = node->left;
+        while (node->right != NULL) node = node->right;
+        return (struct rb_node *)node;
+    }
+    // Go up until we come from a right child.
+    struct rb_node *parent = node->parent;
+    while (parent != NULL && node == parent->left) {
+        node = parent;
+        parent = parent->parent;
+    }
+    return parent;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file rb_tree.h
+ * @brief Intrusive red-black tree.
+ * @details
+ * Like list.h, the node is embedded in the structure in the tree, so
+ * inserting and erasing never allocate. Both take O(log n). The tree does not
+ * know the keys: rb_insert() takes a function that orders two nodes, and
+ * nodes that compare equal keep their insertion order. Use rb_entry() to get
+ * the structure from a node.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_RB_TREE_H
+#define TOY_RISCV_KERNEL_KERNEL_RB_TREE_H
+
+#include "types.h"
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define rb_entry(node, type, member) \
+    ((type *)((char *)(node) - __builtin_offsetof(type, member)))
+
+static inline void init_rb_root(struct rb_root *root) {
+    root->node = NULL;
+}
+
+static inline int rb_empty(const struct rb_root *root) {
+    return root->node == NULL;
+}
+
+/**
+ * Insert a node into the tree.
+ * @param less returns non-zero if the first node goes before the second
+ */
+void rb_insert(struct rb_root *root,
+               struct rb_node *node,
+               int (*less)(const struct rb_node *, const struct rb_node *));
+
+/**
+ * Remove a node from the tree it is in.
+ */
+void rb_erase(struct rb_root *root, struct rb_node *node);
+
+/**
+ * The leftmost (smallest) node of the tree, NULL if the tree is empty.
+ */
+struct rb_node *rb_first(const struct rb_root *root);
+
+/**
+ * The rightmost (largest) node of the tree, NULL if the tree is empty.
+ */
+struct rb_node *rb_last(const struct rb_root *root);
+
+/**
+ * The node before the given one in the tree, NULL if it is the first.
+ */
+struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif // TOY_RISCV_KERNEL_KERNEL_RB_TREE_H
@@ -172,6 +172,22 @@ static inline uint64 read_mcounteren() {
     return x;
 }
 
+// Machine Environment Configuration (csr 0x30a, privileged spec 1.12)
+static inline void write_menvcfg(uint64 x) {
+    asm volatile("csrw 0x30a, %0" : : "r" (x));
+}
+
+static inline uint64 read_menvcfg() {
+    uint64 x;
+    asm volatile("csrr %0, 0x30a" : "=r" (x) );
+    return x;
+}
+
+// Supervisor Timer Compare (csr 0x14d, Sstc extension)
+static inline void write_stimecmp(uint64 x) {
+    asm volatile("csrw 0x14d, %0" : : "r" (x));
+}
+
 // machine-mode cycle counter
 static inline uint64 read_time() {
     uint64 x;
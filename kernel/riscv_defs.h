@@ -27,6 +27,9 @@
 #define MIE_MTIE (1L << 7)  // timer
 #define MIE_MSIE (1L << 3)  // software
 
+// Machine Environment Configuration
+#define MENVCFG_STCE (1UL << 63) // supervisor timer (stimecmp) enable
+
 // use riscv's sv39 page table scheme.
 #define SATP_SV39 (8L << 60)
 
@@ -39,11 +42,19 @@
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 #define PGOFFSET(va) ((va) & (PGSIZE-1))
 
+#define MEGAPGSIZE (PGSIZE * 512) // bytes per megapage (level-1 leaf)
+
+#define MEGAPGROUNDUP(sz)  (((sz)+MEGAPGSIZE-1) & ~(MEGAPGSIZE-1))
+#define MEGAPGROUNDDOWN(a) (((a)) & ~(MEGAPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+// the bits for the kernel (RSW)
+#define PTE_MIGRATING   (1L << 8) // write-protected while compaction moves it
+#define PTE_MIGRATING_W (1L << 9) // writable once it is moved
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
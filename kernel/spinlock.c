@@ -0,0 +1,305 @@
+#include "spinlock.h"
+
+#include "defs.h"
+#include "panic.h"
+#include "process.h"
+#include "riscv.h"
+#include "timer.h"
+#include "types.h"
+#include "utility.h"
+
+// The most MCS locks a hart holds at once. The deepest nesting today is two
+// run queues while stealing, and a buddy pool under them; interrupts are off
+// while a lock is held, so a handler never adds to it. The rest is headroom,
+// and get_mcs_node() panics if it runs out.
+#define MCS_NODES 8
+
+static struct mcs_node mcs_nodes[NCPU][MCS_NODES];
+
+// The statistics are kept per hart and added up when they are read, so
+// taking a lock does not write to memory other harts use.
+struct lock_counters {
+    uint64 acquisitions;
+    uint64 contended;
+    uint64 spin_time;
+    uint64 max_hold;
+};
+
+struct lock_class {
+    char *name;
+    struct lock_counters counters[NCPU];
+};
+
+// The last class takes the names that do not fit.
+#define MAX_LOCK_CLASSES 32
+
+static struct lock_class lock_classes[MAX_LOCK_CLASSES];
+static int lock_class_count;
+// A plain test-and-set lock, as the class table is used by acquire(). It
+// turns the interrupts off as well, so a handler never spins on it.
+static uint lock_classes_locked;
+
+static void lock_class_table() {
+    push_off();
+    while (__sync_lock_test_and_set(&lock_classes_locked, 1) != 0) {}
+    __sync_synchronize();
+}
+
+static void unlock_class_table() {
+    __sync_synchronize();
+    __sync_lock_release(&lock_classes_locked);
+    pop_off();
+}
+
+static struct lock_class *find_lock_class(char *name) {
+    if (name == NULL) name = "unnamed";
+    lock_class_table();
+    struct lock_class *class = NULL;
+    for (int i = 0; i < lock_class_count; i++) {
+        if (strcmp(lock_classes[i].name, name) == 0) {
+            class = &lock_classes[i];
+            break;
+        }
+    }
+    if (class == NULL) {
+        if (lock_class_count < MAX_LOCK_CLASSES - 1) {
+            class = &lock_classes[lock_class_count++];
+            class->name = name;
+        } else {
+            class = &lock_classes[MAX_LOCK_CLASSES - 1];
+            class->name = "other";
+            lock_class_count = MAX_LOCK_CLASSES;
+        }
+    }
+    unlock_class_table();
+    return class;
+}
+
+// The counters of this hart for the lock. Interrupts must be off.
+static struct lock_counters *lock_counters(spinlock *lk) {
+    // Statically initialized locks get their class when first taken. Two
+    // harts racing here find the same class.
+    if (lk->class == NULL) lk->class = find_lock_class(lk->name);
+    return &(lk->class->counters[cpuid()]);
+}
+
+void initlock(spinlock *lk, char *name) {
+    lk->kind = LOCK_TICKET;
+    lk->next = 0;
+    lk->owner = 0;
+    lk->tail = NULL;
+    lk->node = NULL;
+    lk->name = name;
+    lk->cpu = -1;
+    lk->acquired_at = 0;
+    lk->class = NULL;
+}
+
+void init_mcs_lock(spinlock *lk, char *name) {
+    initlock(lk, name);
+    lk->kind = LOCK_MCS;
+}
+
+static struct mcs_node *get_mcs_node() {
+    struct mcs_node *nodes = mcs_nodes[cpuid()];
+    for (int i = 0; i < MCS_NODES; i++) {
+        if (!nodes[i].used) {
+            nodes[i].used = 1;
+            nodes[i].next = NULL;
+            nodes[i].locked = 1;
+            return &nodes[i];
+        }
+    }
+    panic("get_mcs_node: more than MCS_NODES MCS locks held");
+    return NULL;
+}
+
+// Return 1 if the lock had to be waited for, and how long in spin_time. The
+// clock is only read then, so a free lock costs one atomic instruction.
+static int ticket_acquire(spinlock *lk, uint64 *spin_time) {
+    // On RISC-V, this turns into amoadd.w.
+    uint ticket = __sync_fetch_and_add(&lk->next, 1);
+    if (lk->owner == ticket) return 0;
+    uint64 start = read_time();
+    while (lk->owner != ticket) {}
+    *spin_time = read_time() - start;
+    return 1;
+}
+
+static int mcs_acquire(spinlock *lk, uint64 *spin_time) {
+    struct mcs_node *node = get_mcs_node();
+    // The node must be set up before the predecessor can see it.
+    __sync_synchronize();
+    // Queue up with amoswap.d.
+    struct mcs_node *prev = __sync_lock_test_and_set(&(lk->tail), node);
+    int contended = prev != NULL;
+    if (contended) {
+        uint64 start = read_time();
+        prev->next = node;
+        // The predecessor clears it when it releases the lock.
+        while (node->locked) {}
+        *spin_time = read_time() - start;
+    }
+    lk->node = node;
+    return contended;
+}
+
+static void mcs_release(spinlock *lk) {
+    struct mcs_node *node = lk->node;
+    if (node->next == NULL) {
+        // Nobody waits, unless a hart has swapped itself in as the tail but
+        // not linked itself to this node yet.
+        if (__sync_bool_compare_and_swap(&(lk->tail), node, NULL)) {
+            node->used = 0;
+            return;
+        }
+        while (node->next == NULL) {}
+    }
+    node->next->locked = 0;
+    node->used = 0;
+}
+
+void acquire(spinlock *lk) {
+    // disable interrupts to avoid deadlock.
+    push_off();
+    if (holding(lk)) panic("acquire");
+
+    uint64 spin_time = 0;
+    int contended = lk->kind == LOCK_MCS ? mcs_acquire(lk, &spin_time)
+                                         : ticket_acquire(lk, &spin_time);
+
+    // Tell the C compiler and the processor to not move loads or stores
+    // past this point, to ensure that the critical section's memory
+    // references happen strictly after the lock is acquired.
+    // On RISC-V, this emits a fence instruction.
+    __sync_synchronize();
+
+    // Record info about lock acquisition for holding() and debugging.
+    lk->cpu = cpuid();
+
+    if (contended) {
+        struct lock_counters *counters = lock_counters(lk);
+        counters->contended++;
+        counters->spin_time += spin_time;
+    }
+#ifdef TOY_RISCV_KERNEL_LOCK_STATS
+    lk->acquired_at = read_time();
+    lock_counters(lk)->acquisitions++;
+#endif
+}
+
+int try_acquire(spinlock *lk) {
+    push_off();
+    if (holding(lk)) panic("try_acquire");
+    int taken;
+    if (lk->kind == LOCK_MCS) {
+        struct mcs_node *node = get_mcs_node();
+        __sync_synchronize();
+        taken = __sync_bool_compare_and_swap(&(lk->tail), NULL, node);
+        if (taken) {
+            lk->node = node;
+        } else {
+            node->used = 0;
+        }
+    } else {
+        // The lock is free when the ticket being served is the next one.
+        uint owner = lk->owner;
+        taken = __sync_bool_compare_and_swap(&lk->next, owner, owner + 1);
+    }
+    if (!taken) {
+        pop_off();
+        return 0;
+    }
+    __sync_synchronize();
+    lk->cpu = cpuid();
+#ifdef TOY_RISCV_KERNEL_LOCK_STATS
+    lk->acquired_at = read_time();
+    lock_counters(lk)->acquisitions++;
+#endif
+    return 1;
+}
+
+void release(spinlock *lk) {
+    if (!holding(lk)) panic("release");
+
+#ifdef TOY_RISCV_KERNEL_LOCK_STATS
+    struct lock_counters *counters = lock_counters(lk);
+    uint64 hold = read_time() - lk->acquired_at;
+    if (hold > counters->max_hold) counters->max_hold = hold;
+#endif
+
+    lk->cpu = -1;
+
+    // Tell the C compiler and the CPU to not move loads or stores
+    // past this point, to ensure that all the stores in the critical
+    // section are visible to other CPUs before the lock is released,
+    // and that loads in the critical section occur strictly before
+    // the lock is released.
+    // On RISC-V, this emits a fence instruction.
+    __sync_synchronize();
+
+    if (lk->kind == LOCK_MCS) {
+        mcs_release(lk);
+    } else {
+        // Only the holder writes owner, so a plain store serves the next
+        // ticket.
+        lk->owner = lk->owner + 1;
+    }
+
+    pop_off();
+}
+
+int holding(spinlock *lk) {
+    int locked = lk->kind == LOCK_MCS ? lk->tail != NULL
+                                      : lk->next != lk->owner;
+    return locked && lk->cpu == cpuid();
+}
+
+int read_lock_stats(struct lock_stats *stats, int size) {
+    lock_class_table();
+    int count = lock_class_count;
+    for (int i = 0; i < count && i < size; i++) {
+        struct lock_class *class = &lock_classes[i];
+        struct lock_stats *entry = &stats[i];
+        int length = 0;
+        while (length < (int)sizeof(entry->name) - 1 &&
+               class->name[length] != '\0') {
+            entry->name[length] = class->name[length];
+            length++;
+        }
+        entry->name[length] = '\0';
+        entry->acquisitions = 0;
+        entry->contended = 0;
+        entry->spin_time = 0;
+        entry->max_hold = 0;
+        // Read without the locks, so the numbers may be a little behind.
+        for (int cpu = 0; cpu < NCPU; cpu++) {
+            struct lock_counters *counters = &(class->counters[cpu]);
+            entry->acquisitions += counters->acquisitions;
+            entry->contended += counters->contended;
+            entry->spin_time += counters->spin_time;
+            entry->max_hold = max(entry->max_hold, counters->max_hold);
+        }
+        entry->spin_time *= NS_PER_CYCLE;
+        entry->max_hold *= NS_PER_CYCLE;
+    }
+    unlock_class_table();
+    return count;
+}
+
+void push_off() {
+    int old = interrupt_status();
+
+    interrupt_off();
+    struct cpu *cpu = my_cpu();
+    if (cpu->interrupt_depth == 0) cpu->interrupt_enabled = old;
+    cpu->interrupt_depth += 1;
+}
+
+void pop_off() {
+    struct cpu *cpu = my_cpu();
+    if (interrupt_status()) panic("pop_off - interruptible");
+    if (cpu->interrupt_depth < 1) panic("pop_off");
+    cpu->interrupt_depth -= 1;
+    if (cpu->interrupt_depth == 0 && cpu->interrupt_enabled) interrupt_on();
+}
@@ -4,17 +4,101 @@
 #ifndef TOY_RISCV_KERNEL_KERNEL_SPINLOCK_H
 #define TOY_RISCV_KERNEL_KERNEL_SPINLOCK_H
 
+// A ticket lock hands out tickets and serves them in order, which is fair
+// and cheap while the lock is held for a short time. Under contention every
+// waiter spins on the same word, though, so each release costs a cache miss
+// on every waiting hart. An MCS lock queues the waiters instead, and each
+// one spins on its own node until its predecessor hands the lock over.
+enum lock_kind {
+    LOCK_TICKET,
+    LOCK_MCS
+};
+
+// A waiter of an MCS lock. Every hart has a few, one for each MCS lock it
+// may hold at the same time.
+struct mcs_node {
+    struct mcs_node *volatile next; // The waiter after this one
+    volatile uint locked;           // Still waiting for the lock
+    int used;                       // Taken by a lock of this hart
+};
+
+struct lock_class;
+
 typedef struct spinlock {
-    uint locked;       // Is the lock held?
+    enum lock_kind kind;
+
+    // Ticket lock
+    volatile uint next;               // The next ticket to hand out
+    volatile uint owner;              // The ticket being served
 
-    // For debugging:
-    char *name;        // Name of lock
+    // MCS lock
+    struct mcs_node *volatile tail;   // The last waiter, NULL if free
+    struct mcs_node *node;            // The node of the holder
+
+    // For debugging and statistics:
+    char *name;                       // Name of lock
+    int cpu;                          // The hart holding the lock, -1 if none
+    uint64 acquired_at;               // When the holder got it, with
+                                      // TOY_RISCV_KERNEL_LOCK_STATS
+    struct lock_class *class;         // The statistics of locks of this name
 } spinlock;
 
-inline void initlock(spinlock *lk, char *name) {}
-inline void acquire(spinlock *lk) {}
-inline void release(spinlock *lk) {}
-inline void push_off() {}
-inline void pop_off() {}
+// The statistics of the locks sharing a name, e.g., all the run queues.
+// Times are in nanoseconds. Only contention is counted by default, on the
+// slow path; acquisitions and hold times cost a clock read on every
+// acquire and release, and are only counted with TOY_RISCV_KERNEL_LOCK_STATS.
+struct lock_stats {
+    char name[16];
+    uint64 acquisitions;  // Times the locks are taken
+    uint64 contended;     // Times they were taken by another hart first
+    uint64 spin_time;     // Time spent waiting for them
+    uint64 max_hold;      // Longest time one was held
+};
+
+/**
+ * Initialize a ticket lock, for locks held briefly.
+ */
+void initlock(spinlock *lk, char *name);
+
+/**
+ * Initialize an MCS lock, for locks many harts contend for.
+ */
+void init_mcs_lock(spinlock *lk, char *name);
+
+/**
+ * Spin until the lock is taken. Interrupts stay off on this hart until the
+ * lock is released, so an interrupt handler never spins on a lock that the
+ * code it interrupted holds. Acquiring a lock the hart already holds panics.
+ */
+void acquire(spinlock *lk);
+
+/**
+ * Take the lock only if it is free, without spinning.
+ * @return 1 if the lock is taken (release it as usual), 0 if not
+ */
+int try_acquire(spinlock *lk);
+
+void release(spinlock *lk);
+
+/**
+ * Whether this hart holds the lock. Interrupts must be off.
+ */
+int holding(spinlock *lk);
+
+/**
+ * Copy out the statistics of the locks, one entry per name.
+ * @param stats where to copy them
+ * @param size the number of entries stats can hold
+ * @return the number of names, which may be more than size
+ */
+int read_lock_stats(struct lock_stats *stats, int size);
+
+/**
+ * push_off() and pop_off() are like interrupt_off() and interrupt_on(), but
+ * they nest: the interrupts are turned back on by the last pop_off(), and
+ * only if they were on before the first push_off().
+ */
+void push_off();
+void pop_off();
 
 #endif //TOY_RISCV_KERNEL_KERNEL_SPINLOCK_H
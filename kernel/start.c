@@ -1,60 +1,96 @@
+#include "device_tree.h"
 #include "kernel_vectors.h"
 #include "memlayout.h"
 #include "print.h"
 #include "riscv.h"
+#include "timer.h"
 #include "types.h"
 #include "uart.h"
 
 pte_t pagetable[512] __attribute__((aligned(4096)));
-// a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[5];
+// a scratch area per CPU for machine-mode timer and software interrupts.
+uint64 timer_scratch[MAX_HARTS][5];
+
+// set by hart 0 once the device tree is parsed and the page table is built.
+volatile int machine_ready = 0;
 
 int main();
 void establish_page_table();
-void init_timer();
+void init_timer(uint64 hart_id);
+void setup_hart(uint64 hart_id);
+
+// entry.S jumps here in machine mode on every hart, with the hart id and the
+// address of the device tree blob that qemu passes in a0 and a1.
+void start(uint64 hart_id, void *dtb) {
+    // keep each CPU's hartid in its tp register, for cpuid().
+    write_tp(hart_id);
+
+    if (hart_id != 0) {
+        // the other harts wait for hart 0 to set up what they share.
+        while (machine_ready == 0) {}
+        __sync_synchronize();
+        setup_hart(hart_id);
+        return;
+    }
 
-// entry.S jumps here in machine mode.
-void start() {
     uart_init();
     print_string("Entering kernel...\n");
 
+    // Find out the RAM and the harts before anything is allocated.
+    print_string("Parsing device tree... ");
+    if (parse_device_tree(dtb) != 0) {
+        print_string("not found, assume 128MiB of RAM. ");
+    }
+    print_string("Done.\n");
+
     // Set up an identically-mapping page table. (using huge pages)
     print_string("Establishing page table... ");
     establish_page_table();
     print_string("Done.\n");
 
-    print_string("Setting mstatus... ");
+    __sync_synchronize();
+    machine_ready = 1;
+
+    setup_hart(hart_id);
+}
+
+// set up the machine mode of a hart, and enter main() in supervisor mode.
+// only hart 0 reports the progress.
+void setup_hart(uint64 hart_id) {
+    int verbose = hart_id == 0;
+
+    if (verbose) print_string("Setting mstatus... ");
     unsigned long x = read_mstatus();
     x &= ~MSTATUS_MPP_MASK;
     x |= MSTATUS_MPP_S;
     write_mstatus(x);
-    print_string("Done.\n");
+    if (verbose) print_string("Done.\n");
 
-    print_string("Setting things for interruption... ");
+    if (verbose) print_string("Setting things for interruption... ");
     write_medeleg(0xffff);
     write_mideleg(0xffff);
     write_sie(read_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
-    print_string("Done.\n");
+    if (verbose) print_string("Done.\n");
 
     // configure Physical Memory Protection to give supervisor mode
     // access to all of physical memory.
-    print_string("Setting PMP... ");
+    if (verbose) print_string("Setting PMP... ");
     write_pmpaddr0(0x3fffffffffffffull);
     write_pmpcfg0(0xf);
-    print_string("Done.\n");
+    if (verbose) print_string("Done.\n");
 
-    print_string("Enabling paging... ");
+    if (verbose) print_string("Enabling paging... ");
     // Set the page table.
     write_satp(((uint64)pagetable >> 12) | SATP_SV39);
     // Enable paging.
     write_sstatus((read_sstatus() | SSTATUS_SPP) & ~SSTATUS_SIE);
-    print_string("Done.\n");
+    if (verbose) print_string("Done.\n");
 
     write_mepc((uint64)main);
 
-    print_string("Setting timer... ");
-    init_timer();
-    print_string("Done.\n");
+    if (verbose) print_string("Setting timer... ");
+    init_timer(hart_id);
+    if (verbose) print_string("Done.\n");
 
     // enter supervisor mode, and jump to main().
     asm volatile("mret");
@@ -80,28 +116,41 @@ void establish_page_table() {
     }
 }
 
-// arrange to receive timer interrupts. They will arrive in machine mode at
-// timer_vector in kernel_vectors.S, which turns them into software interrupts
-// in supervisor mode.
-void init_timer() {
-    // ask the CLINT for a timer interrupt.
-    int interval = 1000000; // cycles; about 1/10th second in qemu.
-    *(uint64*)CLINT_MTIMECMP(0) = *(uint64*)CLINT_MTIME + interval;
+// arrange to receive timer interrupts. With the Sstc extension, supervisor
+// mode sets stimecmp itself and gets supervisor timer interrupts directly.
+// Otherwise they will arrive in machine mode at timer_vector in
+// kernel_vectors.S, which turns them into software interrupts in supervisor
+// mode. It does the same for the machine software interrupts that other
+// harts raise through the CLINT, which are the IPIs (see ipi.c).
+void init_timer(uint64 hart_id) {
+    // let supervisor mode read the time CSR (and write stimecmp).
+    write_mcounteren(read_mcounteren() | 2);
 
     // prepare information in scratch[] for timervec.
     // scratch[0..2] : space for timervec to save registers.
     // scratch[3] : address of CLINT MTIMECMP register.
-    // scratch[4] : desired interval (in cycles) between timer interrupts.
-    uint64 *scratch = &timer_scratch[0];
-    scratch[3] = CLINT_MTIMECMP(0);
-    scratch[4] = interval;
+    // scratch[4] : address of CLINT MSIP register.
+    uint64 *scratch = &timer_scratch[hart_id][0];
+    scratch[3] = CLINT_MTIMECMP(hart_id);
+    scratch[4] = CLINT_MSIP(hart_id);
     write_mscratch((uint64)scratch);
 
     // set the machine-mode trap handler.
     write_mtvec((uint64)timer_vector);
 
-    // enable machine-mode interrupts.
+    // enable machine-mode interrupts, and the software ones for IPIs.
     write_mstatus(read_mstatus() | MSTATUS_MIE);
+    write_mie(read_mie() | MIE_MSIE);
+
+    if (machine_info.sstc) {
+        write_menvcfg(read_menvcfg() | MENVCFG_STCE);
+        write_stimecmp(read_time() + TICK_INTERVAL);
+        return;
+    }
+
+    // ask the CLINT for the first timer interrupt. the later ones are
+    // arranged by the supervisor with set_timer().
+    *(uint64*)CLINT_MTIMECMP(hart_id) = *(uint64*)CLINT_MTIME + TICK_INTERVAL;
 
     // enable machine-mode timer interrupts.
     write_mie(read_mie() | MIE_MTIE);
@@ -0,0 +1,223 @@
+#include "timer.h"
+
+#include "device_tree.h"
+#include "list.h"
+#include "memlayout.h"
+#include "process.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+#include "utility.h"
+
+void set_timer(uint64 when) {
+    if (machine_info.sstc) {
+        // Writing stimecmp also clears a pending timer interrupt.
+        write_stimecmp(when);
+        return;
+    }
+    // PMP gives supervisor mode access to the CLINT. Writing mtimecmp also
+    // clears a pending timer interrupt.
+    *(volatile uint64 *)CLINT_MTIMECMP(cpuid()) = when;
+}
+
+/** Timer wheel */
+
+// The slots of level i hold the timers that are due in TIMER_WHEEL_SLOTS^i to
+// TIMER_WHEEL_SLOTS^(i+1) units; a timer is placed in the slot of its expiry
+// at that level. When the wheel reaches a slot of a higher level, its timers
+// move down to the levels below (cascade), so only level 0 ever fires.
+#define LEVEL_SHIFT(level) ((level) * TIMER_WHEEL_SLOT_BITS)
+#define SLOT_MASK          (TIMER_WHEEL_SLOTS - 1)
+
+// Each hart has a wheel of its own, for the timers added on it, so that the
+// harts do not contend for one lock on every tick.
+struct timer_base {
+    struct spinlock lock;
+    struct list_node wheel[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+    // A bit for each slot that holds timers, one word per level
+    uint64 pending_slots[TIMER_WHEEL_LEVELS];
+    // The next unit to process. The timers due before it have fired.
+    uint64 wheel_time;
+    // The timer whose function is running, NULL if none
+    struct timer *running;
+};
+
+struct timer_base timer_bases[NCPU];
+
+void init_timer_wheel() {
+    uint64 now = read_time() >> TIMER_WHEEL_SHIFT;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        struct timer_base *base = &timer_bases[cpu];
+        initlock(&(base->lock), "timer");
+        for (int i = 0; i < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS; i++) {
+            init_list(&(base->wheel[i]));
+        }
+        for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            base->pending_slots[level] = 0;
+        }
+        base->wheel_time = now;
+        base->running = NULL;
+    }
+}
+
+void setup_timer(struct timer *timer, void (*function)(struct timer *)) {
+    init_list(&(timer->link));
+    timer->base = NULL;
+    timer->slot = 0;
+    timer->expires = 0;
+    timer->slack = 0;
+    timer->function = function;
+}
+
+// Pick the time in [expires, expires + slack] with the most trailing zeros.
+// Timers whose ranges overlap tend to pick the same time, and share a slot.
+static uint64 apply_slack(uint64 expires, uint64 slack) {
+    if (slack == 0) return expires;
+    uint64 limit = expires + slack;
+    int bit = 63 - __builtin_clzl(expires ^ limit);
+    return limit & ~((1UL << bit) - 1);
+}
+
+// The lock of the base is held.
+static void enqueue_timer(struct timer_base *base, struct timer *timer) {
+    // Round up, so that the timer never fires early.
+    uint64 expires = (timer->expires >> TIMER_WHEEL_SHIFT) +
+        ((timer->expires & ((1UL << TIMER_WHEEL_SHIFT) - 1)) != 0);
+    expires = max(expires, base->wheel_time);
+    uint64 delta = expires - base->wheel_time;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           (delta >> LEVEL_SHIFT(level + 1)) != 0) {
+        level++;
+    }
+    // Too far for the wheel: park it in the farthest slot, and place it
+    // again when that comes.
+    if ((delta >> LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) != 0) {
+        expires = base->wheel_time +
+            (1UL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1;
+    }
+    int index = (expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    timer->base = base;
+    timer->slot = level * TIMER_WHEEL_SLOTS + index;
+    list_insert_tail(&(base->wheel[timer->slot]), &(timer->link));
+    base->pending_slots[level] |= 1UL << index;
+}
+
+void add_timer(struct timer *timer) {
+    timer->expires = apply_slack(timer->expires, timer->slack);
+    push_off();
+    struct timer_base *base = &timer_bases[cpuid()];
+    acquire(&(base->lock));
+    enqueue_timer(base, timer);
+    release(&(base->lock));
+    pop_off();
+}
+
+void cancel_timer(struct timer *timer) {
+    struct timer_base *base = timer->base;
+    if (base == NULL) return;
+    acquire(&(base->lock));
+    if (timer_pending(timer)) {
+        list_remove(&(timer->link));
+        if (list_empty(&(base->wheel[timer->slot]))) {
+            base->pending_slots[timer->slot / TIMER_WHEEL_SLOTS] &=
+                ~(1UL << (timer->slot % TIMER_WHEEL_SLOTS));
+        }
+    }
+    // Its function may be running on another hart, e.g., waking up a task
+    // that has moved there. Wait for it, so that the timer may be freed.
+    while (base->running == timer) {
+        release(&(base->lock));
+        acquire(&(base->lock));
+    }
+    release(&(base->lock));
+}
+
+// Take all the timers out of a slot into a list.
+static void take_slot(struct timer_base *base,
+                      int level,
+                      int index,
+                      struct list_node *timers) {
+    init_list(timers);
+    list_splice_tail(&(base->wheel[level * TIMER_WHEEL_SLOTS + index]), timers);
+    base->pending_slots[level] &= ~(1UL << index);
+}
+
+static void cascade(struct timer_base *base, int level) {
+    struct list_node timers;
+    take_slot(base, level,
+              (base->wheel_time >> LEVEL_SHIFT(level)) & SLOT_MASK, &timers);
+    struct list_node *node;
+    while ((node = list_first(&timers)) != NULL) {
+        list_remove(node);
+        enqueue_timer(base, list_entry(node, struct timer, link));
+    }
+}
+
+void run_timers() {
+    struct timer_base *base = &timer_bases[cpuid()];
+    uint64 now = read_time() >> TIMER_WHEEL_SHIFT;
+    acquire(&(base->lock));
+    while (base->wheel_time <= now) {
+        // Move the timers of the higher levels down when their slot comes,
+        // from the top, so that they may end up in this very slot.
+        for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((base->wheel_time & ((1UL << LEVEL_SHIFT(level)) - 1)) == 0) {
+                cascade(base, level);
+            }
+        }
+        struct list_node expired;
+        take_slot(base, 0, base->wheel_time & SLOT_MASK, &expired);
+        // Timers added by the functions go to the slots ahead.
+        base->wheel_time++;
+        // The functions run without the lock, since they may wake tasks up
+        // or add timers. A timer is off the list before its function runs,
+        // so cancel_timer() leaves it alone from then on.
+        struct list_node *node;
+        while ((node = list_first(&expired)) != NULL) {
+            struct timer *timer = list_entry(node, struct timer, link);
+            list_remove(node);
+            base->running = timer;
+            release(&(base->lock));
+            timer->function(timer);
+            acquire(&(base->lock));
+            base->running = NULL;
+        }
+        // Skip the units where nothing happens, e.g., after a long idle:
+        // go on to the next slot of the lowest level that has timers.
+        int level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 &&
+               base->pending_slots[level] == 0) {
+            level++;
+        }
+        uint64 step = 1UL << LEVEL_SHIFT(level);
+        base->wheel_time =
+            min(now + 1, (base->wheel_time + step - 1) & ~(step - 1));
+    }
+    release(&(base->lock));
+}
+
+uint64 next_timer_event() {
+    struct timer_base *base = &timer_bases[cpuid()];
+    uint64 next = TIMER_NEVER;
+    acquire(&(base->lock));
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64 pending = base->pending_slots[level];
+        if (pending == 0) continue;
+        uint64 position = base->wheel_time >> LEVEL_SHIFT(level);
+        int index = position & SLOT_MASK;
+        // The slots in the order the wheel reaches them, this one first.
+        uint64 slots = (pending >> index) | (pending << ((64 - index) & 63));
+        // Past the start of a slot of a higher level, it has been cascaded
+        // already, and its timers are a whole round away.
+        if (level > 0 &&
+            (base->wheel_time & ((1UL << LEVEL_SHIFT(level)) - 1)) != 0) {
+            slots &= ~1UL;
+        }
+        uint64 ahead = slots != 0 ? __builtin_ctzl(slots) : TIMER_WHEEL_SLOTS;
+        uint64 unit = (position + ahead) << LEVEL_SHIFT(level);
+        next = min(next, unit << TIMER_WHEEL_SHIFT);
+    }
+    release(&(base->lock));
+    return next;
+}
@@ -0,0 +1,102 @@
+/**
+ * @file timer.h
+ * @brief The timer interrupt, and the software timers on top of it.
+ * @details
+ * The timer is one-shot: the interrupt fires once at the time set by
+ * set_timer(), and the scheduler sets the next one after it has been handled.
+ * If the harts have the Sstc extension, it is stimecmp, and the interrupt is a
+ * supervisor timer interrupt. If not, it is mtimecmp in the CLINT, and the
+ * machine-mode timer_vector passes the interrupt on as a supervisor software
+ * interrupt.
+ * The time is counted in cycles of mtime (TIMER_FREQUENCY per second), which
+ * supervisor mode reads through the time CSR.
+ *
+ * Software timers (struct timer) are kept in a hierarchical timer wheel, so
+ * adding and cancelling one takes O(1). Each hart has its own wheel, where the
+ * timers added on it go, driven from its timer interrupt by run_timers();
+ * next_timer_event() tells the scheduler when to arm the interrupt for it.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_TIMER_H
+#define TOY_RISCV_KERNEL_KERNEL_TIMER_H
+
+#include "list.h"
+#include "memlayout.h"
+#include "types.h"
+
+// The interval of the scheduler tick: 10ms
+#define TICK_INTERVAL (TIMER_FREQUENCY / 100)
+
+#define TIMER_NEVER ((uint64)-1)
+
+#define NS_PER_CYCLE (1000000000 / TIMER_FREQUENCY)
+
+// The wheel counts time in units of 2^TIMER_WHEEL_SHIFT cycles (25.6us).
+// Each level has TIMER_WHEEL_SLOTS slots, and a slot at level i spans
+// TIMER_WHEEL_SLOTS^i units, so the five levels cover about 7.6 hours.
+#define TIMER_WHEEL_SHIFT      8
+#define TIMER_WHEEL_SLOT_BITS  6
+#define TIMER_WHEEL_SLOTS      (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS     5
+
+struct timer_base;
+
+struct timer {
+    struct list_node link;   // In a slot of the wheel while pending
+    struct timer_base *base; // The wheel it was last added to
+    int slot;                // Index of that slot in the wheel
+    uint64 expires;          // The earliest time to fire, in cycles
+    uint64 slack;            // How much later it may fire, in cycles
+    void (*function)(struct timer *timer);
+};
+
+#define timer_entry(timer, type, member) \
+    ((type *)((char *)(timer) - __builtin_offsetof(type, member)))
+
+/**
+ * Arm the timer interrupt of this hart.
+ * @param when the time of the interrupt, TIMER_NEVER to turn the timer off
+ */
+void set_timer(uint64 when);
+
+/**
+ * Initialize a software timer before it is used.
+ * @param function called with interrupts off when the timer fires
+ */
+void setup_timer(struct timer *timer, void (*function)(struct timer *));
+
+/**
+ * Start a timer on the wheel of this hart. The timer must not be pending. It
+ * fires between expires and expires + slack: timers with overlapping ranges
+ * are moved to the same time, so that one interrupt serves them all. expires
+ * is updated to that time.
+ */
+void add_timer(struct timer *timer);
+
+/**
+ * Stop a timer if it is pending. If its function is running on another hart,
+ * wait until it returns. Do not call it from the function of the timer.
+ */
+void cancel_timer(struct timer *timer);
+
+// Without the lock of the wheel, this is only a hint, unless the timer is
+// already off it: then it stays off until it is added again.
+static inline int timer_pending(const struct timer *timer) {
+    return !list_empty(&(timer->link));
+}
+
+/**
+ * Fire the timers of this hart that have expired.
+ */
+void run_timers();
+
+/**
+ * The time the timer interrupt is needed for the wheel, TIMER_NEVER if no
+ * timer is pending. It is never later than the earliest timer, but may be
+ * earlier, when timers have to move to a lower level of the wheel.
+ */
+uint64 next_timer_event();
+
+void init_timer_wheel();
+
+#endif // TOY_RISCV_KERNEL_KERNEL_TIMER_H
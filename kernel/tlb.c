@@ -0,0 +1,83 @@
+#include "tlb.h"
+
+#include "ipi.h"
+#include "process.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+
+struct tlb_state {
+    // The user page table the hart runs, NULL while it is in the kernel
+    pagetable_t volatile pagetable;
+    // Bumped every time the user translations of the hart are flushed
+    volatile uint64 flushes;
+};
+
+static struct tlb_state tlb_states[NCPU];
+
+void init_tlb() {
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        tlb_states[cpu].pagetable = NULL;
+        tlb_states[cpu].flushes = 0;
+    }
+}
+
+void tlb_batch_add(struct tlb_batch *batch, pagetable_t pagetable, uint64 va) {
+    // Either this hart sees the page table in tlb_enter_user() of another
+    // one, or that one sees the new PTE after its sfence.vma in the
+    // trampoline.
+    __sync_synchronize();
+    push_off();
+    int self = cpuid();
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        // This hart is in the kernel, so it caches no user translations.
+        if (cpu == self || tlb_states[cpu].pagetable != pagetable) continue;
+        batch->cpus |= 1UL << cpu;
+    }
+    pop_off();
+}
+
+void tlb_batch_flush(struct tlb_batch *batch) {
+    if (batch->cpus == 0) return;
+    uint64 flushes[NCPU];
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if ((batch->cpus & (1UL << cpu)) == 0) continue;
+        flushes[cpu] = tlb_states[cpu].flushes;
+        send_ipi(cpu, IPI_TLB_FLUSH);
+    }
+    // The harts are in user space with interrupts on, or about to be, so
+    // they take the IPI at once, and the first thing they do is to flush.
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+        if ((batch->cpus & (1UL << cpu)) == 0) continue;
+        struct tlb_state *state = &tlb_states[cpu];
+        while (state->flushes == flushes[cpu] && state->pagetable != NULL) {}
+    }
+    __sync_synchronize();
+    batch->cpus = 0;
+}
+
+void flush_tlb_page(pagetable_t pagetable, uint64 va) {
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
+    tlb_batch_add(&batch, pagetable, va);
+    tlb_batch_flush(&batch);
+}
+
+void tlb_enter_user(pagetable_t pagetable) {
+    tlb_states[cpuid()].pagetable = pagetable;
+    __sync_synchronize();
+}
+
+void tlb_leave_user() {
+    struct tlb_state *state = &tlb_states[cpuid()];
+    state->flushes++;
+    state->pagetable = NULL;
+    __sync_synchronize();
+}
+
+void tlb_flush_pending() {
+    // The IPI came in through the trampoline, which has flushed everything
+    // already, so there is nothing left to flush.
+    tlb_states[cpuid()].flushes++;
+    __sync_synchronize();
+}
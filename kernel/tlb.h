@@ -0,0 +1,75 @@
+/**
+ * @file tlb.h
+ * @brief TLB shootdowns.
+ * @details
+ * A hart in user space caches the translations of the page table it runs.
+ * When a PTE of that page table changes on another hart, e.g., when
+ * compaction moves a page or memory is freed, the cached translation must go
+ * before the old page is reused. Each hart records the user page table it
+ * runs (tlb_enter_user()), so only the harts running the changed page table
+ * are asked.
+ *
+ * The changes are collected in a tlb_batch: tlb_batch_add() records the
+ * harts running the page table, and tlb_batch_flush() sends one IPI to each
+ * of them and waits until they have taken it. The trampoline flushes the
+ * whole TLB whenever a hart enters the kernel, since the page tables have no
+ * ASIDs, so a hart that has trapped into the kernel since the request has
+ * flushed already, and the IPI only has to make it trap. Batching saves the
+ * IPIs and the waits, up to TLB_BATCH_SIZE pages per shootdown.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_TLB_H
+#define TOY_RISCV_KERNEL_KERNEL_TLB_H
+
+#include "riscv.h"
+#include "types.h"
+
+#define TLB_BATCH_SIZE 16
+
+struct tlb_batch {
+    uint64 cpus; // The harts that have to flush for this batch
+};
+
+void init_tlb();
+
+static inline void tlb_batch_init(struct tlb_batch *batch) {
+    batch->cpus = 0;
+}
+
+/**
+ * Add the harts running the page table in user space to the batch, for a
+ * changed PTE. Call it after the PTE is written.
+ */
+void tlb_batch_add(struct tlb_batch *batch, pagetable_t pagetable, uint64 va);
+
+/**
+ * Make the harts of the batch flush their TLBs, and wait for them. The
+ * old pages may be reused after this. It may be called with locks held and
+ * interrupts off, since the harts it waits for are in user space.
+ */
+void tlb_batch_flush(struct tlb_batch *batch);
+
+/**
+ * Flush one changed PTE on the other harts, and wait for them.
+ */
+void flush_tlb_page(pagetable_t pagetable, uint64 va);
+
+/**
+ * Record that this hart enters user space with the page table. Interrupts
+ * are off.
+ */
+void tlb_enter_user(pagetable_t pagetable);
+
+/**
+ * Record that this hart has left user space, with its TLB flushed by the
+ * trampoline. Interrupts are off.
+ */
+void tlb_leave_user();
+
+/**
+ * Acknowledge a flush: the trampoline has flushed the TLB on the way in.
+ * Called for an IPI_TLB_FLUSH.
+ */
+void tlb_flush_pending();
+
+#endif // TOY_RISCV_KERNEL_KERNEL_TLB_H
@@ -1,5 +1,7 @@
 #include "trap.h"
 
+#include "epoch.h"
+#include "ipi.h"
 #include "kernel_vectors.h"
 #include "memlayout.h"
 #include "panic.h"
@@ -7,6 +9,8 @@
 #include "print.h"
 #include "process.h"
 #include "riscv.h"
+#include "signal_defs.h"
+#include "tlb.h"
 #include "trampoline.h"
 #include "types.h"
 #include "uart.h"
@@ -52,11 +56,17 @@ enum cause supervisor_trap_cause() {
     }
 
     switch (scause) {
+        case 0x8000000000000005L: { // Supervisor timer interrupt (Sstc)
+            // stimecmp is set again by the scheduler, which clears it.
+            return TIMER;
+        }
         case 0x8000000000000001L: { // Supervisor software interrupt
-            // ACTUALLY caused by TIMER interrupt
+            // ACTUALLY caused by TIMER interrupt, or an IPI from another
+            // hart; scheduler_tick() looks at the run queue either way.
             // acknowledge the software interrupt by clearing
             // the SSIP bit in sip.
             write_sip(read_sip() & ~2);
+            handle_ipi();
             return TIMER;
         }
         case 8: { // Environment call from U-mode (ACTUALLY syscall)
@@ -81,6 +91,9 @@ enum cause supervisor_trap_cause() {
 }
 
 void user_trap() {
+    // The trampoline has flushed the user translations.
+    tlb_leave_user();
+
     uint64 sepc = read_sepc();
     uint64 sstatus = read_sstatus();
     enum cause trap_cause = supervisor_trap_cause();
@@ -92,6 +105,7 @@ void user_trap() {
     // Send interrupts and exceptions to kernel_trap(), since we're now in
     // the kernel.
     write_stvec((uint64)kernel_vector);
+    epoch_exit_quiescent();
 
     struct task_struct *task = current_task();
     
@@ -100,7 +114,7 @@ void user_trap() {
     
     switch (trap_cause) {
         case TIMER: {
-            yield();
+            scheduler_tick();
             break;
         }
         case SYSCALL: {
@@ -151,7 +165,7 @@ void kernel_trap() {
 
     switch (trap_cause) {
         case TIMER: {
-            yield();
+            scheduler_tick();
             break;
         }
         default:
@@ -164,9 +178,19 @@ void kernel_trap() {
     write_sstatus(sstatus);
 }
 
+void init_trap_hart() {
+    write_stvec((uint64)kernel_vector);
+}
+
 void user_trap_return() {
     struct task_struct *task = current_task();
 
+    // A task killed by the OOM killer must not touch its memory again.
+    if (task->killed) exit_process(task, SIGKILL);
+
+    // Nothing read without a lock is held across the return to user space.
+    epoch_quiescent();
+
     // we're about to switch the destination of traps from
     // kernel_trap() to user_trap(), so turn off interrupts until
     // we're back in user space, where user_trap() is correct.
@@ -182,6 +206,7 @@ void user_trap_return() {
     task->trap_frame->kernel_satp = read_satp();
     task->trap_frame->kernel_sp = (uint64)task->kernel_stack + PGSIZE;
     task->trap_frame->kernel_trap = (uint64)user_trap;
+    task->trap_frame->kernel_hartid = read_tp(); // hartid for cpuid()
 
     // set up the registers that trampoline.S's sret will use
     // to get to user space.
@@ -197,11 +222,14 @@ void user_trap_return() {
 
     // tell trampoline.S the user page table to switch to.
     uint64 satp = MAKE_SATP(task->pagetable);
+    tlb_enter_user(task->pagetable);
+    epoch_enter_quiescent();
 
     // jump to userret in trampoline.S at the top of memory, which 
     // switches to the user page table, restores user registers,
     // and switches to user mode with sret.
     uint64 trampoline_user_return = TRAMPOLINE +
         ((uint64)user_return - (uint64)trampoline);
-    ((void (*)(uint64))trampoline_user_return)(satp);
+    ((void (*)(uint64, uint64))trampoline_user_return)(
+        satp, TRAPFRAME(task->thread_slot));
 }
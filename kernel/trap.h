@@ -18,4 +18,10 @@ void kernel_trap();
 
 void user_trap_return();
 
+/**
+ * Send the traps of this hart to kernel_trap(), until it returns to user
+ * space.
+ */
+void init_trap_hart();
+
 #endif //TOY_RISCV_KERNEL_KERNEL_TRAP_H
@@ -11,6 +11,7 @@
 #include "panic.h"
 #include "spinlock.h"
 #include "types.h"
+#include "wait_queue.h"
 
 //#include "param.h"
 //#include "riscv.h"
@@ -52,6 +53,16 @@ char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
 uint64 uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
 
+// the receive input buffer, filled by uart_intr().
+struct spinlock uart_rx_lock;
+#define UART_RX_BUF_SIZE 128
+char uart_rx_buf[UART_RX_BUF_SIZE];
+uint64 uart_rx_w; // write next to uart_rx_buf[uart_rx_w % UART_RX_BUF_SIZE]
+uint64 uart_rx_r; // read next from uart_rx_buf[uart_rx_r % UART_RX_BUF_SIZE]
+
+// readers waiting for input.
+struct wait_queue console_input;
+
 void uart_start();
 
 void uart_init() {
@@ -78,6 +89,8 @@ void uart_init() {
     WriteReg(IER, IER_TX_ENABLE | IER_RX_ENABLE);
 
     initlock(&uart_tx_lock, "uart");
+    initlock(&uart_rx_lock, "uart_rx");
+    init_wait_queue(&console_input);
 }
 
 // add a character to the output buffer and tell the
@@ -162,16 +175,33 @@ int uart_getc() {
     }
 }
 
+// take one character from the input buffer.
+// return -1 if it is empty.
+// caller must hold uart_rx_lock.
+int uart_read() {
+    if(uart_rx_r == uart_rx_w) return -1;
+    int c = (unsigned char)uart_rx_buf[uart_rx_r % UART_RX_BUF_SIZE];
+    uart_rx_r += 1;
+    return c;
+}
+
 // handle a uart interrupt, raised because input has
 // arrived, or the uart is ready for more output, or
 // both. called from devintr().
 void uart_intr() {
-    // read and process incoming characters.
+    // read incoming characters into the input buffer,
+    // and wake up a reader for each of them.
+    // characters are dropped if the buffer is full.
+    acquire(&uart_rx_lock);
     while(1) {
         int c = uart_getc();
         if(c == -1) break;
-        //consoleintr(c);
+        if(uart_rx_w == uart_rx_r + UART_RX_BUF_SIZE) continue;
+        uart_rx_buf[uart_rx_w % UART_RX_BUF_SIZE] = c;
+        uart_rx_w += 1;
+        wake_up_one(&console_input);
     }
+    release(&uart_rx_lock);
 
     // send buffered characters.
     acquire(&uart_tx_lock);
@@ -1,11 +1,23 @@
 #ifndef TOY_RISCV_KERNEL_KERNEL_UART_H
 #define TOY_RISCV_KERNEL_KERNEL_UART_H
 
+#include "spinlock.h"
+#include "wait_queue.h"
+
+// readers of the console input sleep here until uart_intr() wakes them up.
+extern struct wait_queue console_input;
+// protects the input buffer.
+extern struct spinlock uart_rx_lock;
+
 void uart_init();
 void uart_putc(int c);
 void uart_putc_sync(int c);
 int uart_getc();
 
+// take a character received by uart_intr(), -1 if there is none.
+// caller must hold uart_rx_lock.
+int uart_read();
+
 // handle a uart interrupt, raised because input has arrived, or the uart is
 // ready for more output, or both.
 void uart_intr();
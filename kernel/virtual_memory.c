@@ -1,5 +1,7 @@
 #include "virtual_memory.h"
 
+#include "device_tree.h"
+#include "epoch.h"
 #include "mem_manage.h"
 #include "memlayout.h"
 #include "panic.h"
@@ -7,6 +9,7 @@
 #include "riscv_defs.h"
 #include "riscv.h"
 #include "single_linked_list.h"
+#include "tlb.h"
 #include "types.h"
 #include "utility.h"
 
@@ -25,7 +28,7 @@ pte_t *pagetable_entry(pagetable_t pagetable, uint64 va, int alloc) {
             pagetable = (pte_t *)PTE2PA(*pte);
         } else {
             // That entry doesn't exist yet.
-            if (!alloc || (pagetable = (pte_t *)allocate(1)) == 0) {
+            if (!alloc || (pagetable = (pte_t *)allocate(0)) == 0) {
                 return NULL;
             }
             memset(pagetable, 0, PGSIZE);
@@ -54,6 +57,46 @@ void kernel_map_pages(pagetable_t pagetable,
     }
 }
 
+// Map [va, va + size) with megapages. All of them must be megapage aligned.
+// The kernel page table never goes through pagetable_entry() for these
+// addresses, so the huge pages are safe here.
+void kernel_map_megapages(pagetable_t pagetable,
+                          uint64 va,
+                          uint64 pa,
+                          uint64 size,
+                          uint64 permission) {
+    for (uint64 i = 0; i < size; i += MEGAPGSIZE) {
+        pte_t *pte = &pagetable[PX(2, va + i)];
+        if ((*pte & PTE_V) == 0) {
+            pagetable_t next_level = allocate(0);
+            if (next_level == NULL) {
+                panic("kernel_map_megapages: page table allocate failed");
+            }
+            memset(next_level, 0, PGSIZE);
+            *pte = PA2PTE(next_level) | PTE_V;
+        }
+        pte_t *leaf = &((pagetable_t)PTE2PA(*pte))[PX(1, va + i)];
+        if (*leaf & PTE_V) panic("kernel_map_megapages: page already mapped");
+        *leaf = PA2PTE(pa + i) | permission | PTE_V;
+    }
+}
+
+// Map the RAM in [start, end) read-write, with megapages where possible.
+void kernel_map_memory(pagetable_t pagetable, uint64 start, uint64 end) {
+    uint64 rw = PTE_R | PTE_W;
+    uint64 megapage_start = MEGAPGROUNDUP(start);
+    uint64 megapage_end = MEGAPGROUNDDOWN(end);
+    if (megapage_start >= megapage_end) {
+        kernel_map_pages(pagetable, start, start, end - start, rw);
+        return;
+    }
+    kernel_map_pages(pagetable, start, start, megapage_start - start, rw);
+    kernel_map_megapages(pagetable, megapage_start, megapage_start,
+                         megapage_end - megapage_start, rw);
+    kernel_map_pages(pagetable, megapage_end, megapage_end,
+                     end - megapage_end, rw);
+}
+
 void make_kernel_pagetable() {
     kernel_pagetable = allocate(0); // Get a page for the root level
     if (kernel_pagetable == NULL) {
@@ -68,6 +111,8 @@ void make_kernel_pagetable() {
     kernel_map_pages(kernel_pagetable, VIRT_TEST, VIRT_TEST, PGSIZE, rw);
     // UART
     kernel_map_pages(kernel_pagetable, UART0, UART0, PGSIZE, rw);
+    // CLINT, for the supervisor to set the timer
+    kernel_map_pages(kernel_pagetable, CLINT, CLINT, 0x10000, rw);
     // virtio mmio disk interface
     kernel_map_pages(kernel_pagetable, VIRTIO0, VIRTIO0, PGSIZE, rw);
     // PLIC
@@ -75,7 +120,12 @@ void make_kernel_pagetable() {
     // map kernel text executable and read-only.
     kernel_map_pages(kernel_pagetable, KERNBASE, KERNBASE, (uint64)etext - KERNBASE, rx);
     // map kernel data and the physical RAM we'll make use of.
-    kernel_map_pages(kernel_pagetable, (uint64)etext, (uint64)etext, PHYSTOP - (uint64)etext, rw);
+    for (int i = 0; i < machine_info.memory_region_count; i++) {
+        struct memory_region *region = &machine_info.memory_regions[i];
+        uint64 start = max(region->start, (uint64)etext);
+        uint64 end = region->start + region->size;
+        if (start < end) kernel_map_memory(kernel_pagetable, start, end);
+    }
     // map the trampoline for trap entry/exit to the highest virtual
     // address in the kernel.
     kernel_map_pages(kernel_pagetable, TRAMPOLINE, (uint64)trampoline, PGSIZE, rx);
@@ -84,7 +134,10 @@ void make_kernel_pagetable() {
 void init_kernel_pagetable() {
     // make the kernel pagetable
     make_kernel_pagetable();
+    init_kernel_pagetable_hart();
+}
 
+void init_kernel_pagetable_hart() {
     // wait for any previous writes to the page table memory to finish.
     sfence_vma();
 
@@ -95,7 +148,7 @@ void init_kernel_pagetable() {
 }
 
 pagetable_t create_void_pagetable() {
-    pagetable_t pagetable = (pagetable_t)allocate(1);
+    pagetable_t pagetable = (pagetable_t)allocate(0);
     if (pagetable == NULL) return NULL;
     memset(pagetable, 0, PGSIZE);
     return pagetable;
@@ -138,10 +191,12 @@ size_t map_memory(pagetable_t pagetable,
     return PGSIZE << power;
 }
 
-int copy_memory_with_pagetable(pagetable_t source_pagetable,
-                               pagetable_t target_pagetable,
+int copy_memory_with_pagetable(struct task_struct *source,
+                               struct task_struct *target,
                                uint64 va_start,
                                uint64 size) {
+    pagetable_t source_pagetable = source->pagetable;
+    pagetable_t target_pagetable = target->pagetable;
     if (va_start & (PGSIZE - 1) || size & (PGSIZE - 1)) {
         panic("copy_memory_with_pagetable: va_start or size is not page aligned");
     }
@@ -150,32 +205,27 @@ int copy_memory_with_pagetable(pagetable_t source_pagetable,
     }
     for (uint64 offset = 0; offset < size; offset += PGSIZE) {
         uint64 va = va_start + offset;
-        void *src = (void *)physical_address(source_pagetable, va);
-        void *dest = allocate(0);
-        if (src == NULL) {
-            panic("copy_memory_with_pagetable: memory not mapped");
-        }
+        void *dest = allocate_on_node(0, local_numa_node(), MIGRATE_MOVABLE);
         if (dest == NULL) {
-            for (uint64 offset2 = 0; offset2 < offset; offset2 += PGSIZE) {
-                void *src2 = (void *)physical_address(source_pagetable, va_start + offset2);
-                unmap_page(target_pagetable, va_start + offset2);
-                deallocate(src2, 0);
-            }
+            free_memory(target_pagetable, va_start, offset);
             return -1;
         }
-        memcpy(dest, src, PGSIZE);
-        int result = map_page(
-            target_pagetable,
-            va,
-            (uint64)dest,
-            PTE_FLAGS(*pagetable_entry(source_pagetable, va, 0))
-        );
-        if (result == -1) {
-            for (uint64 offset2 = 0; offset2 < offset; offset2 += PGSIZE) {
-                void *src2 = (void *)physical_address(source_pagetable, va_start + offset2);
-                unmap_page(target_pagetable, va_start + offset2);
-                deallocate(src2, 0);
-            }
+        // Compaction may move the page on another hart meanwhile, so it is
+        // pinned for the copy.
+        uint64 src = pin_user_page(source_pagetable, va);
+        if (src == 0) {
+            panic("copy_memory_with_pagetable: memory not mapped");
+        }
+        memcpy(dest, (void *)src, PGSIZE);
+        pte_t flags = PTE_FLAGS(*pagetable_entry(source_pagetable, va, 0));
+        unpin_user_page(src);
+        // The page may still be write-protected for a compaction that gave
+        // up on it, which the copy must not inherit.
+        if (flags & PTE_MIGRATING_W) flags |= PTE_W;
+        flags &= ~(PTE_MIGRATING | PTE_MIGRATING_W);
+        int result = map_user_page(target, va, (uint64)dest, flags);
+        if (result != 0) {
+            free_memory(target_pagetable, va_start, offset);
             deallocate(dest, 0);
             return -1;
         }
@@ -185,40 +235,39 @@ int copy_memory_with_pagetable(pagetable_t source_pagetable,
 
 int copy_all_memory_with_pagetable(struct task_struct *source,
                                    struct task_struct *target) {
-    for (struct single_linked_list_node *node = head_node(&(source->mem_sections));
+    struct address_space *space = source->address_space;
+    for (struct single_linked_list_node *node = head_node(&(space->mem_sections));
         node != NULL;
         node = node->next) {
         struct memory_section *mem_section = node->data;
         uint64 start = mem_section->start;
         uint64 size = mem_section->size;
-        if (copy_memory_with_pagetable(source->pagetable,
-                                       target->pagetable,
-                                       start, size) != 0) {
+        if (charge_memory(target, MEMORY_RESIDENT_PAGES, size / PGSIZE) != 0) {
+            free_user_memory(target);
+            return -1;
+        }
+        if (copy_memory_with_pagetable(source, target, start, size) != 0) {
+            uncharge_memory(target, MEMORY_RESIDENT_PAGES, size / PGSIZE);
             free_user_memory(target);
             return -1;
         }
         if (register_memory_section(target, start, size)) {
             free_memory(target->pagetable, start, size);
+            uncharge_memory(target, MEMORY_RESIDENT_PAGES, size / PGSIZE);
             free_user_memory(target);
             return -1;
         }
     }
-    if (copy_memory_with_pagetable(source->pagetable, target->pagetable,
+    size_t stack_pages = source->stack.size / PGSIZE;
+    if (charge_memory(target, MEMORY_RESIDENT_PAGES, stack_pages) != 0) {
+        free_user_memory(target);
+        return -1;
+    }
+    if (copy_memory_with_pagetable(source, target,
                                    source->stack.start, source->stack.size) != 0) {
-        for (struct single_linked_list_node *node2 = head_node(&(target->mem_sections));
-            node2 != NULL;
-            node2 = node2->next) {
-            struct memory_section *mem_section2 = node2->data;
-            for (uint64 offset = 0; offset < mem_section2->size; offset += PGSIZE) {
-                deallocate(
-                    (void *)physical_address(
-                        target->pagetable,
-                        (uint64)mem_section2->start + offset
-                    ),
-                    0);
-                unmap_page(target->pagetable, (uint64)mem_section2->start + offset);
-            }
-        }
+        uncharge_memory(target, MEMORY_RESIDENT_PAGES, stack_pages);
+        free_user_memory(target);
+        return -1;
     }
     target->stack.start = source->stack.start;
     target->stack.size = source->stack.size;
@@ -227,26 +276,49 @@ int copy_all_memory_with_pagetable(struct task_struct *source,
 
 void free_memory(pagetable_t pagetable, uint64 start, size_t size) {
     start = PGROUNDDOWN(start);
+    // A page is only freed once no hart can reach it through its TLB, so
+    // they are unmapped and flushed a batch at a time. Each page is pinned
+    // before it is unmapped, so that compaction does not move it meanwhile;
+    // the last unpin_page() frees it.
+    uint64 pages[TLB_BATCH_SIZE];
+    int count = 0;
+    struct tlb_batch batch;
+    tlb_batch_init(&batch);
     for (uint64 i = 0; i < size; i += PGSIZE) {
-        deallocate((void *)physical_address(pagetable, start + i), 0);
+        uint64 page = pin_user_page(pagetable, start + i);
+        if (page == 0) panic("free_memory: page not mapped");
+        pages[count++] = page;
         unmap_page(pagetable, start + i);
+        tlb_batch_add(&batch, pagetable, start + i);
+        if (count == TLB_BATCH_SIZE || i + PGSIZE >= size) {
+            tlb_batch_flush(&batch);
+            for (int j = 0; j < count; j++) {
+                deallocate((void *)pages[j], 0);
+                unpin_page(pages[j]);
+            }
+            count = 0;
+        }
     }
 }
 
-void free_pagetable_internal(pagetable_t pagetable, int level) {
+size_t free_pagetable_internal(pagetable_t pagetable, int level) {
+    size_t freed = 1;
     if (level > 0) {
         for (uint64 i = 0; i < 512; i++) {
             pte_t *pte = &pagetable[i];
             if ((*pte & PTE_V) && level > 1) {
-                free_pagetable_internal((pagetable_t)PTE2PA(*pte), level - 1);
+                freed += free_pagetable_internal((pagetable_t)PTE2PA(*pte),
+                                                 level - 1);
             }
         }
     }
-    deallocate(pagetable, 0);
+    // Lock-free readers may still walk it.
+    retire_pages(pagetable, 0);
+    return freed;
 }
 
-void free_pagetable(pagetable_t pagetable) {
-    free_pagetable_internal(pagetable, 2);
+size_t free_pagetable(pagetable_t pagetable) {
+    return free_pagetable_internal(pagetable, 2);
 }
 
 int map_page(pagetable_t pagetable,
@@ -261,6 +333,129 @@ int map_page(pagetable_t pagetable,
     if (*pte & PTE_V) panic("map_page: page already mapped");
 
     *pte = PA2PTE(pa) | permission | PTE_V;
+    set_page_mapping(pa, pagetable, va);
+    return 0;
+}
+
+// The number of page-table pages map_page() would allocate for va.
+static size_t missing_pagetables(pagetable_t pagetable, uint64 va) {
+    for (int level = 2; level > 0; level--) {
+        pte_t *pte = &pagetable[PX(level, va)];
+        if ((*pte & PTE_V) == 0) return level;
+        pagetable = (pagetable_t)PTE2PA(*pte);
+    }
+    return 0;
+}
+
+int map_user_page(struct task_struct *task,
+                  uint64 va,
+                  uint64 pa,
+                  uint64 permission) {
+    // The threads of the process may add page-table pages at the same time,
+    // e.g., as their stacks grow.
+    struct spinlock *lock = &(task->address_space->lock);
+    acquire(lock);
+    size_t tables = missing_pagetables(task->pagetable, va);
+    int result = charge_memory(task, MEMORY_PAGETABLE_PAGES, tables);
+    if (result == 0 && map_page(task->pagetable, va, pa, permission) != 0) {
+        // Some of the tables may have been allocated before the failure.
+        uncharge_memory(task, MEMORY_PAGETABLE_PAGES,
+                        missing_pagetables(task->pagetable, va));
+        result = -1;
+    }
+    release(lock);
+    return result;
+}
+
+int put_user_int(pagetable_t pagetable, uint64 va, int value) {
+    if (va >= MAXVA || va % sizeof(int) != 0) return -1;
+    for (;;) {
+        // Look like a hart running the page table, so that compaction waits
+        // for the store before it copies the page, as it would for a store
+        // from user space.
+        push_off();
+        tlb_enter_user(pagetable);
+        pte_t *pte = pagetable_entry(pagetable, va, 0);
+        int result = -1;
+        int moving = 0;
+        if (pte != NULL && (*pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U)) {
+            if (*pte & PTE_W) {
+                *(volatile int *)(PTE2PA(*pte) + PGOFFSET(va)) = value;
+                result = 0;
+            } else {
+                moving = (*pte & PTE_MIGRATING) != 0;
+            }
+        }
+        tlb_leave_user();
+        pop_off();
+        // Compaction is moving the page: try again once it is done.
+        if (!moving) return result;
+    }
+}
+
+uint64 pin_user_page(pagetable_t pagetable, uint64 va) {
+    if (va >= MAXVA || va % sizeof(int) != 0) return 0;
+    for (;;) {
+        // As in put_user_int(), compaction either sees the pin, or has
+        // write-protected the page before it is looked up here.
+        push_off();
+        tlb_enter_user(pagetable);
+        pte_t *pte = pagetable_entry(pagetable, va, 0);
+        uint64 pa = 0;
+        int moving = 0;
+        if (pte != NULL && (*pte & (PTE_V | PTE_U)) == (PTE_V | PTE_U)) {
+            pte_t entry = *pte;
+            moving = (entry & PTE_MIGRATING) != 0;
+            if (!moving && pin_page(PTE2PA(entry)) == 0) {
+                // Compaction may have write-protected the page before it
+                // was pinned. It gives up on the page then, and remaps it
+                // later, so the page is looked up again once that is done.
+                if (*pte == entry) {
+                    pa = PTE2PA(entry) + PGOFFSET(va);
+                } else {
+                    unpin_page(PTE2PA(entry));
+                    moving = 1;
+                }
+            }
+        }
+        tlb_leave_user();
+        pop_off();
+        if (!moving) return pa;
+    }
+}
+
+void unpin_user_page(uint64 pa) {
+    unpin_page(pa);
+}
+
+int protect_page_for_migration(pagetable_t pagetable, uint64 va) {
+    pte_t *pte = pagetable_entry(pagetable, PGROUNDDOWN(va), 0);
+
+    if (pte == NULL || (*pte & PTE_V) == 0) return -1;
+
+    if (*pte & PTE_W) *pte = (*pte & ~PTE_W) | PTE_MIGRATING_W;
+    *pte |= PTE_MIGRATING;
+    return 0;
+}
+
+int is_migration_fault(pagetable_t pagetable, uint64 va) {
+    if (va >= MAXVA) return 0;
+    pte_t *pte = pagetable_entry(pagetable, PGROUNDDOWN(va), 0);
+    if (pte == NULL || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U)) return 0;
+    return (*pte & (PTE_MIGRATING | PTE_W)) != 0;
+}
+
+int remap_page(pagetable_t pagetable, uint64 va, uint64 pa) {
+    va = PGROUNDDOWN(va);
+    pa = PGROUNDDOWN(pa);
+    pte_t *pte = pagetable_entry(pagetable, va, 0);
+
+    if (pte == NULL || (*pte & PTE_V) == 0) return -1;
+
+    pte_t flags = PTE_FLAGS(*pte);
+    if (flags & PTE_MIGRATING_W) flags |= PTE_W;
+    flags &= ~(PTE_MIGRATING | PTE_MIGRATING_W);
+    *pte = PA2PTE(pa) | flags;
     return 0;
 }
 
@@ -272,26 +467,27 @@ int unmap_page(pagetable_t pagetable, uint64 va) {
     if ((*pte & PTE_V) == 0) panic("unmap_page: page not mapped");
     if(PTE_FLAGS(*pte) == PTE_V) panic("unmap_page: cannot unmap leaf page");
 
+    set_page_mapping(PTE2PA(*pte), NULL, 0);
     *pte = 0;
     return 0;
 }
 
-int map_page_for_user(pagetable_t pagetable,
+int map_page_for_user(struct task_struct *task,
                       uint64 va,
                       void *src,
                       size_t size,
                       uint64 permission) {
-    void *page = allocate_for_user(0);
+    void *page = allocate_for_user(0, MIGRATE_MOVABLE);
     if (page == NULL) return -1;
     memcpy(page, src, size);
-    if (map_page(pagetable, va, (uint64)page, permission) != 0) {
+    if (map_user_page(task, va, (uint64)page, permission) != 0) {
         deallocate(page, 0);
         return -1;
     }
     return 0;
 }
 
-int map_section_for_user(pagetable_t pagetable,
+int map_section_for_user(struct task_struct *task,
                          uint64 va_start,
                          void *src,
                          size_t src_size,
@@ -307,12 +503,12 @@ int map_section_for_user(pagetable_t pagetable,
         uint64 dest_start = max(va_start, page_addr);
         uint64 dest_end = min(src_end, page_addr + PGSIZE);
         size_t copy_size = dest_end > dest_start ? dest_end - dest_start : 0;
-        if (map_page_for_user(pagetable,
+        if (map_page_for_user(task,
                               dest_start,
                               src_addr,
                               copy_size,
                               permission) != 0) {
-            free_memory(pagetable, page_start, page_addr - page_start);
+            free_memory(task->pagetable, page_start, page_addr - page_start);
             return -1;
         }
         src_addr += dest_end - dest_start;
@@ -37,6 +37,12 @@ uint64 physical_address(pagetable_t pagetable, uint64 va);
  */
 void init_kernel_pagetable();
 
+/**
+ * Switch this hart to the kernel page table built by init_kernel_pagetable()
+ * on hart 0.
+ */
+void init_kernel_pagetable_hart();
+
 /**
  * Create a void page table. If there is no memory, a NULL pointer is returned.
  */
@@ -55,15 +61,15 @@ size_t map_memory(pagetable_t pagetable,
                   uint64 permission);
 
 /**
- * Copy the memory from [start, start + size) to the target_pagetable.
- * @param source_pagetable the source page table
- * @param target_pagetable the target page table
+ * Copy the memory from [start, start + size) to the page table of the target.
+ * @param source the source task
+ * @param target the target task, charged for the new page-table pages
  * @param va_start the start virtual address
  * @param size the size of the data
  * @return 0 if succeeded, -1 if failed
  */
-int copy_memory_with_pagetable(pagetable_t source_pagetable,
-                               pagetable_t target_pagetable,
+int copy_memory_with_pagetable(struct task_struct *source,
+                               struct task_struct *target,
                                uint64 va_start,
                                uint64 size);
 
@@ -85,10 +91,12 @@ void free_memory(pagetable_t pagetable, uint64 start, size_t size);
 
 /**
  * Free the page table. Please note that is function will not free the pages
- * since freeing some static pages (like trampoline) is problematic.
+ * since freeing some static pages (like trampoline) is problematic. The
+ * page-table pages are retired (see epoch.h) rather than freed at once.
  * @param pagetable the page table
+ * @return the number of page-table pages freed, to be uncharged
  */
-void free_pagetable(pagetable_t pagetable);
+size_t free_pagetable(pagetable_t pagetable);
 
 /**
  * Map the page on va to pa in page table.
@@ -103,6 +111,74 @@ int map_page(pagetable_t pagetable,
              uint64 pa,
              uint64 permission);
 
+/**
+ * Map the page on va to pa in the page table of the task, charging the task
+ * for the page-table pages it needs.
+ * @param task the task
+ * @param va the virtual address
+ * @param pa the physical address
+ * @param permission the permission of the page, see riscv_defs.h for details
+ * @return 0 if success, -1 if failed or over the page-table limit
+ */
+int map_user_page(struct task_struct *task,
+                  uint64 va,
+                  uint64 pa,
+                  uint64 permission);
+
+/**
+ * Store an int to user memory, e.g., to a thread that waits for it to change,
+ * through the physical address of the page.
+ * @param pagetable the user page table
+ * @param va the address of the int, aligned
+ * @param value what to store
+ * @return 0 if success, -1 if va is not a writable user address
+ */
+int put_user_int(pagetable_t pagetable, uint64 va, int value);
+
+/**
+ * Find the physical page of an int in user memory, and keep compaction from
+ * moving it until unpin_user_page(), e.g., while a task sleeps on a futex
+ * keyed by the physical address, or while fork copies the page.
+ * @param pagetable the user page table
+ * @param va the address of the int, aligned
+ * @return the physical address of the int, 0 if va is not a user address
+ */
+uint64 pin_user_page(pagetable_t pagetable, uint64 va);
+
+/**
+ * Let compaction move the page again, or free it if it has been freed while
+ * pinned, e.g., when the OOM killer has freed the memory of a process with a
+ * task sleeping on a futex.
+ * @param pa the physical address from pin_user_page()
+ */
+void unpin_user_page(uint64 pa);
+
+/**
+ * Write-protect the mapped page on va while compaction copies it, so that a
+ * task running on another hart cannot change it meanwhile. remap_page()
+ * gives the permission back. The caller has to flush the TLB.
+ * @return 0 if success, -1 if the page is not mapped
+ */
+int protect_page_for_migration(pagetable_t pagetable, uint64 va);
+
+/**
+ * Whether a store page fault on va is only due to compaction: the page is
+ * write-protected while it moves, or the TLB still held that translation.
+ * The task should try again.
+ */
+int is_migration_fault(pagetable_t pagetable, uint64 va);
+
+/**
+ * Point the mapped page on va to another physical page, keeping its
+ * permission, and give back the permission taken by
+ * protect_page_for_migration(). The caller has to flush the TLB.
+ * @param pagetable the page table
+ * @param va the virtual address
+ * @param pa the new physical address
+ * @return 0 if success, -1 if the page is not mapped
+ */
+int remap_page(pagetable_t pagetable, uint64 va, uint64 pa);
+
 /**
  * Unmap the page on va in page table. The va must be mapped before calling
  * this function.
@@ -116,13 +192,13 @@ int unmap_page(pagetable_t pagetable, uint64 va);
 /**
  * Map the page from src to a page at pa in page table for user.
  * The va and size do not need to be page aligned.
- * @param pagetable the page table
+ * @param task the task
  * @param va the virtual address
  * @param src the source address
  * @param size the size of the memory
  * @param permission the permission of the page, see riscv_defs.h for details
  */
-int map_page_for_user(pagetable_t pagetable,
+int map_page_for_user(struct task_struct *task,
                       uint64 va,
                       void *src,
                       size_t size,
@@ -131,13 +207,13 @@ int map_page_for_user(pagetable_t pagetable,
 /**
  * Map the section from src to a section at va_start in page table for user.
  * The va_start and size do not need to be page aligned.
- * @param pagetable the page table
+ * @param task the task
  * @param va_start the start virtual address
  * @param src the source address
  * @param size the size of the memory
  * @param permission the permission of the page, see riscv_defs.h for details
  */
-int map_section_for_user(pagetable_t pagetable,
+int map_section_for_user(struct task_struct *task,
                          uint64 va_start,
                          void *src,
                          size_t src_size,
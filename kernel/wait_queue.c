@@ -0,0 +1,87 @@
+#include "wait_queue.h"
+
+#include "list.h"
+#include "process.h"
+#include "spinlock.h"
+#include "types.h"
+
+void init_wait_entry(struct wait_entry *entry,
+                     const void *key,
+                     int exclusive) {
+    init_list(&(entry->link));
+    entry->task = current_task();
+    entry->key = key;
+    entry->exclusive = exclusive;
+}
+
+void prepare_to_wait(struct wait_queue *queue, struct wait_entry *entry) {
+    acquire(&(queue->lock));
+    // A wakeup dequeues the waiter, so it is queued again if it goes on
+    // waiting. The exclusive waiters come last, so that waking up stops at
+    // the first of them after all the others.
+    if (list_empty(&(entry->link))) {
+        if (entry->exclusive) {
+            list_insert_tail(&(queue->waiters), &(entry->link));
+        } else {
+            list_insert_head(&(queue->waiters), &(entry->link));
+        }
+    }
+    set_current_state(SLEEPING, queue);
+    release(&(queue->lock));
+}
+
+void finish_wait(struct wait_queue *queue, struct wait_entry *entry) {
+    set_current_state(RUNNING, NULL);
+    acquire(&(queue->lock));
+    // Still queued if the condition was true, or something else, e.g., the
+    // OOM killer, woke it up.
+    list_remove(&(entry->link));
+    release(&(queue->lock));
+}
+
+int wait_interrupted() {
+    return current_task()->killed;
+}
+
+void wait_yield() {
+    yield();
+}
+
+// Wake up the waiters for the key, at most exclusive_count exclusive ones;
+// 0 means all of them. Return how many are woken.
+static int wake_up_waiters(struct wait_queue *queue,
+                           const void *key,
+                           int exclusive_count) {
+    int woken = 0;
+    acquire(&(queue->lock));
+    struct list_node *node = queue->waiters.next;
+    while (node != &(queue->waiters)) {
+        struct wait_entry *entry = list_entry(node, struct wait_entry, link);
+        node = node->next;
+        if (key != NULL && entry->key != NULL && entry->key != key) continue;
+        // Dequeued now, so that it is not woken twice.
+        list_remove(&(entry->link));
+        wake_up_task(entry->task);
+        woken++;
+        if (entry->exclusive && --exclusive_count == 0) break;
+    }
+    release(&(queue->lock));
+    return woken;
+}
+
+void wake_up_one(struct wait_queue *queue) {
+    wake_up_waiters(queue, NULL, 1);
+}
+
+void wake_up_all(struct wait_queue *queue) {
+    wake_up_waiters(queue, NULL, 0);
+}
+
+void wake_up_key(struct wait_queue *queue, const void *key) {
+    wake_up_waiters(queue, key, 1);
+}
+
+int wake_up_key_many(struct wait_queue *queue, const void *key, int count) {
+    if (count <= 0) return 0;
+    return wake_up_waiters(queue, key, count);
+}
@@ -0,0 +1,153 @@
+/**
+ * @file wait_queue.h
+ * @brief Wait queues for tasks blocked on an event.
+ * @details
+ * A task waits for a condition with wait_event() on the queue of the object
+ * the condition is about, and whoever may make the condition true wakes the
+ * queue up. The woken tasks check the condition again, so a spurious wakeup
+ * does no harm. A waiter is queued and marked SLEEPING before it checks the
+ * condition, so a wakeup from another hart in between only makes it run on.
+ * If the condition is protected by a lock, wait_event_locked() drops the lock
+ * while the task sleeps. The lock of the queue is taken before the lock of a
+ * run queue, and after any lock given to wait_event_locked().
+ *
+ * A waiter may be exclusive: wake_up_one() wakes all the other waiters but
+ * only the first exclusive one, so that, e.g., one character of input does not
+ * wake every reader up. A waiter may also give a key, and wake_up_key() then
+ * only wakes it for that key, so that waiters for different events can share
+ * a queue without waking each other.
+ */
+
+#ifndef TOY_RISCV_KERNEL_KERNEL_WAIT_QUEUE_H
+#define TOY_RISCV_KERNEL_KERNEL_WAIT_QUEUE_H
+
+#include "list.h"
+#include "spinlock.h"
+#include "types.h"
+
+struct task_struct;
+
+struct wait_queue {
+    struct spinlock lock;
+    struct list_node waiters;
+};
+
+// A waiter, on the kernel stack of the waiting task
+struct wait_entry {
+    struct list_node link;     // In the waiters of the queue
+    struct task_struct *task;
+    const void *key;           // NULL to be woken for any key
+    int exclusive;
+};
+
+static inline void init_wait_queue(struct wait_queue *queue) {
+    initlock(&(queue->lock), "wait_queue");
+    init_list(&(queue->waiters));
+}
+
+/**
+ * Set up a waiter for the current task.
+ * @param key the event to wait for, NULL for any
+ * @param exclusive 1 if only one exclusive waiter should be woken at a time
+ */
+void init_wait_entry(struct wait_entry *entry, const void *key, int exclusive);
+
+/**
+ * Queue the waiter if it is not queued, and mark the current task SLEEPING.
+ * The caller then checks its condition, and yields if it still has to wait.
+ */
+void prepare_to_wait(struct wait_queue *queue, struct wait_entry *entry);
+
+/**
+ * Mark the current task RUNNING again, and dequeue the waiter.
+ */
+void finish_wait(struct wait_queue *queue, struct wait_entry *entry);
+
+/**
+ * Whether the current task has to stop waiting because it has been killed.
+ */
+int wait_interrupted();
+
+/**
+ * Switch away from the current task while it waits.
+ */
+void wait_yield();
+
+/**
+ * Wake up the waiters that are not exclusive, and the first exclusive one.
+ */
+void wake_up_one(struct wait_queue *queue);
+
+/**
+ * Wake up all the waiters.
+ */
+void wake_up_all(struct wait_queue *queue);
+
+/**
+ * Like wake_up_one(), but only for the waiters for the key or for any key.
+ */
+void wake_up_key(struct wait_queue *queue, const void *key);
+
+/**
+ * Like wake_up_key(), but up to count exclusive waiters.
+ * @return the number of waiters woken up
+ */
+int wake_up_key_many(struct wait_queue *queue, const void *key, int count);
+
+#define __wait_event(queue, key, exclusive, interruptible, condition,      \
+                     unlock, relock) ({                                      \
+    int __wait_result__ = 0;                                                 \
+    struct wait_entry __wait_entry__;                                        \
+    init_wait_entry(&__wait_entry__, (key), (exclusive));                    \
+    for (;;) {                                                               \
+        prepare_to_wait((queue), &__wait_entry__);                           \
+        if (condition) break;                                                \
+        if ((interruptible) && wait_interrupted()) {                         \
+            __wait_result__ = -1;                                            \
+            break;                                                           \
+        }                                                                    \
+        unlock;                                                              \
+        wait_yield();                                                        \
+        relock;                                                              \
+    }                                                                        \
+    finish_wait((queue), &__wait_entry__);                                   \
+    __wait_result__;})
+
+/**
+ * Sleep on the queue until the condition is true.
+ * @return 0 once the condition is true, -1 if the task has been killed
+ */
+#define wait_event(queue, condition) \
+    __wait_event(queue, NULL, 0, 1, condition, , )
+
+/**
+ * Like wait_event(), but as an exclusive waiter.
+ */
+#define wait_event_exclusive(queue, condition) \
+    __wait_event(queue, NULL, 1, 1, condition, , )
+
+/**
+ * Like wait_event(), but only woken for the key.
+ */
+#define wait_event_key(queue, key, condition) \
+    __wait_event(queue, key, 0, 1, condition, , )
+
+/**
+ * Like wait_event(), for a condition protected by the lock, which the caller
+ * holds. The lock is released while the task sleeps, and held again when
+ * the condition is checked and on return.
+ * @param key the event to wait for, NULL for any
+ * @param exclusive 1 to wait as an exclusive waiter
+ */
+#define wait_event_locked(queue, key, exclusive, condition, lock) \
+    __wait_event(queue, key, exclusive, 1, condition,             \
+                 release(lock), acquire(lock))
+
+/**
+ * Like wait_event_locked(), but the task waits on even if it has been killed,
+ * e.g., because it is exiting already.
+ */
+#define wait_event_locked_uninterruptible(queue, condition, lock) \
+    __wait_event(queue, NULL, 0, 0, condition, release(lock), acquire(lock))
+
+#endif // TOY_RISCV_KERNEL_KERNEL_WAIT_QUEUE_H
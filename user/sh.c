@@ -7,6 +7,7 @@ enum builtin {
     HELP,
     EXIT,
     POWEROFF,
+    LOCKSTAT,
     NON_BUILTIN
 };
 
@@ -17,6 +18,7 @@ char path[4096];
 char *program_envp[4096];
 char argv_buffer[4096];
 char *tmp_argv[4096];
+struct lock_stats lock_stats[64];
 
 enum builtin program_type(char *program) {
     if (strcmp(program, "help") == 0) {
@@ -25,6 +27,8 @@ enum builtin program_type(char *program) {
         return EXIT;
     } else if (strcmp(program, "poweroff") == 0) {
         return POWEROFF;
+    } else if (strcmp(program, "lockstat") == 0) {
+        return LOCKSTAT;
     }
     return NON_BUILTIN;
 }
@@ -60,6 +64,7 @@ int execute_line(char *line) {
             print_string("help:     print this message\n");
             print_string("exit:     exit shell\n");
             print_string("poweroff: power off\n");
+            print_string("lockstat: print the statistics of the kernel locks\n");
             break;
         }
         case EXIT: {
@@ -70,6 +75,16 @@ int execute_line(char *line) {
             power_off();
             break;
         }
+        case LOCKSTAT: {
+            int count = min(get_lock_stats(lock_stats, 64), 64);
+            printf("name acquisitions contended spin_ns max_hold_ns\n");
+            for (int i = 0; i < count; i++) {
+                printf("%s %u %u %u %u\n", lock_stats[i].name,
+                       lock_stats[i].acquisitions, lock_stats[i].contended,
+                       lock_stats[i].spin_time, lock_stats[i].max_hold);
+            }
+            break;
+        }
         case NON_BUILTIN: {
             if (path[0] != '\0') {
                 int pid = fork();
@@ -10,6 +10,20 @@
 #define SYSCALL_POWER_OFF   8
 #define SYSCALL_PUT_CHAR    9
 #define SYSCALL_GET_CHAR    10
+#define SYSCALL_GET_MEMORY_USAGE 11
+#define SYSCALL_SET_MEMORY_LIMIT 12
+#define SYSCALL_NICE        13
+#define SYSCALL_SET_DEADLINE 14
+#define SYSCALL_GET_DEADLINE 15
+#define SYSCALL_SLEEP_NS    16
+#define SYSCALL_SLEEP_UNTIL 17
+#define SYSCALL_GET_TIME_NS 18
+#define SYSCALL_SET_AFFINITY 19
+#define SYSCALL_GET_AFFINITY 20
+#define SYSCALL_GET_LOCK_STATS 21
+#define SYSCALL_CLONE       22
+#define SYSCALL_EXIT_THREAD 23
+#define SYSCALL_FUTEX       24
 
 #define PGSIZE 4096
 
@@ -19,7 +33,19 @@
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
-#define SHARED_MEMORY (TRAMPOLINE - PGSIZE * 2)
+
+// Every thread has an area of its own under the trampoline, with its shared
+// memory page at the top and its stack below, so the frame of any function
+// tells which area the thread runs in.
+#define THREAD_AREA_SIZE (PGSIZE * 1024)
+
+static uint64 shared_memory_page() {
+    uint64 frame = (uint64)__builtin_frame_address(0);
+    uint64 slot = (TRAMPOLINE - 1 - frame) / THREAD_AREA_SIZE;
+    return TRAMPOLINE - slot * THREAD_AREA_SIZE - PGSIZE * 2;
+}
+
+#define SHARED_MEMORY shared_memory_page()
 
 uint64 syscall(uint64 arg1, uint64 arg2, uint64 arg3, uint64 arg4,
                uint64 arg5, uint64 arg6, uint64 arg7, uint64 id);
@@ -128,6 +154,85 @@ char get_char() {
     return (char)syscall(0, 0, 0, 0, 0, 0, 0, SYSCALL_GET_CHAR);
 }
 
+int get_memory_usage(pid_t pid, struct memory_usage *usage) {
+    int return_val = syscall((uint64)pid, 0, 0, 0, 0, 0, 0,
+                             SYSCALL_GET_MEMORY_USAGE);
+    if (return_val == 0) {
+        *usage = *(struct memory_usage *)SHARED_MEMORY;
+    }
+    return return_val;
+}
+
+int set_memory_limit(int resource, uint64 limit) {
+    return syscall((uint64)resource, limit, 0, 0, 0, 0, 0,
+                   SYSCALL_SET_MEMORY_LIMIT);
+}
+
+int nice(int increment) {
+    return syscall((uint64)increment, 0, 0, 0, 0, 0, 0, SYSCALL_NICE);
+}
+
+int set_deadline(uint64 runtime, uint64 period, uint64 deadline) {
+    return syscall(runtime, period, deadline, 0, 0, 0, 0, SYSCALL_SET_DEADLINE);
+}
+
+int get_deadline(pid_t pid, struct deadline_info *info) {
+    int return_val = syscall((uint64)pid, 0, 0, 0, 0, 0, 0,
+                             SYSCALL_GET_DEADLINE);
+    if (return_val == 0) {
+        *info = *(struct deadline_info *)SHARED_MEMORY;
+    }
+    return return_val;
+}
+
+void sleep_ns(uint64 duration) {
+    syscall(duration, 0, 0, 0, 0, 0, 0, SYSCALL_SLEEP_NS);
+}
+
+void sleep_until(uint64 time) {
+    syscall(time, 0, 0, 0, 0, 0, 0, SYSCALL_SLEEP_UNTIL);
+}
+
+uint64 get_time_ns() {
+    return syscall(0, 0, 0, 0, 0, 0, 0, SYSCALL_GET_TIME_NS);
+}
+
+int set_affinity(pid_t pid, uint64 mask) {
+    return syscall((uint64)pid, mask, 0, 0, 0, 0, 0, SYSCALL_SET_AFFINITY);
+}
+
+uint64 get_affinity(pid_t pid) {
+    return syscall((uint64)pid, 0, 0, 0, 0, 0, 0, SYSCALL_GET_AFFINITY);
+}
+
+int get_lock_stats(struct lock_stats *stats, int size) {
+    int count = syscall(0, 0, 0, 0, 0, 0, 0, SYSCALL_GET_LOCK_STATS);
+    struct lock_stats *shared_stats = (struct lock_stats *)SHARED_MEMORY;
+    for (int i = 0; i < count && i < size; i++) {
+        stats[i] = shared_stats[i];
+    }
+    return count;
+}
+
+// A new thread starts here, on the stack of its area.
+static void thread_start(int (*fn)(void *), void *arg) {
+    exit_thread(fn(arg));
+}
+
+int thread_create(int (*fn)(void *), void *arg, void *tls, volatile int *tid) {
+    return syscall((uint64)thread_start, (uint64)fn, (uint64)arg, (uint64)tls,
+                   (uint64)tid, 0, 0, SYSCALL_CLONE);
+}
+
+void exit_thread(int status) {
+    syscall(status, 0, 0, 0, 0, 0, 0, SYSCALL_EXIT_THREAD);
+    for (;;) {} // actually not reachable, but to avoid compiler warning
+}
+
+int futex(volatile int *addr, int op, int value) {
+    return syscall((uint64)addr, op, value, 0, 0, 0, 0, SYSCALL_FUTEX);
+}
+
 int main(int argc, char *const argv[], char *const envp[]);
 
 __attribute__((noreturn)) void _start(int argc, char *const argv[], char *const envp[]) {
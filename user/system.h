@@ -24,6 +24,44 @@ typedef uint64 pid_t;
 
 #define NULL (0)
 
+// The kinds of memory charged to a process
+#define MEMORY_RESIDENT_PAGES  0 // pages mapped for user space
+#define MEMORY_PAGETABLE_PAGES 1 // pages of the page table
+#define MEMORY_KERNEL_OBJECTS  2 // kernel objects owned by the process
+#define MEMORY_RESOURCES       3
+
+#define MEMORY_UNLIMITED ((uint64)-1)
+
+// The operations of futex()
+#define FUTEX_WAIT 0 // sleep if the int still holds the value
+#define FUTEX_WAKE 1 // wake up at most value threads sleeping on the int
+
+// A lower nice value means a higher priority.
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
+// The reservation of a deadline process, in microseconds
+struct deadline_info {
+    uint64 runtime;
+    uint64 period;
+    uint64 deadline;
+    uint64 misses;   // the number of deadlines missed
+};
+
+struct memory_usage {
+    uint64 usage[MEMORY_RESOURCES];
+    uint64 limit[MEMORY_RESOURCES];
+};
+
+// The statistics of the kernel locks of one name, in nanoseconds
+struct lock_stats {
+    char name[16];
+    uint64 acquisitions;
+    uint64 contended;     // taken by another hart first
+    uint64 spin_time;     // spent waiting
+    uint64 max_hold;      // the longest time one was held
+};
+
 pid_t fork();
 
 int exec(const char *name, char *const argv[], char *const envp[]);
@@ -44,4 +82,38 @@ void put_char(int character);
 
 char get_char();
 
+int get_memory_usage(pid_t pid, struct memory_usage *usage);
+
+int set_memory_limit(int resource, uint64 limit);
+
+int nice(int increment);
+
+int set_deadline(uint64 runtime, uint64 period, uint64 deadline);
+
+int get_deadline(pid_t pid, struct deadline_info *info);
+
+void sleep_ns(uint64 duration);
+
+void sleep_until(uint64 time);
+
+uint64 get_time_ns();
+
+int set_affinity(pid_t pid, uint64 mask);
+
+uint64 get_affinity(pid_t pid);
+
+int get_lock_stats(struct lock_stats *stats, int size);
+
+// Start a thread of this process, which runs fn(arg) on a stack of its own
+// and exits with what fn returns. tls is put in its tp register. Its ID is
+// stored at tid, unless tid is NULL, and cleared when it exits.
+int thread_create(int (*fn)(void *), void *arg, void *tls, volatile int *tid);
+
+void exit_thread(int status) __attribute__((noreturn));
+
+// Sleep on or wake up the threads sleeping on an int, see FUTEX_WAIT and
+// FUTEX_WAKE. The int is known by its physical address, so any mapping of
+// its page reaches the same futex.
+int futex(volatile int *addr, int op, int value);
+
 #endif // TOY_RISCV_KERNEL_USER_SYSTEM_H
\ No newline at end of file
@@ -0,0 +1,42 @@
+/*
+ * Test the set_affinity() and get_affinity() system calls, on 2 harts or
+ * more. Every line should end with "ok".
+ * The process pins itself to hart 0, and its child inherits the mask. The
+ * parent then moves the sleeping child to hart 1, which the child sees when
+ * it wakes up. A mask without an online hart and a PID that is not a
+ * descendant are refused.
+ */
+
+#include "system.h"
+#include "ulib.h"
+
+#define MS 1000000
+
+static void check(const char *what, uint64 value, uint64 expected) {
+    printf("%s: %d, expected %d, %s\n", what, (int)value, (int)expected,
+           value == expected ? "ok" : "FAILED");
+}
+
+int main() {
+    printf("initial mask: %d\n", (int)get_affinity(0));
+    check("pin to hart 0", set_affinity(0, 1), 0);
+    check("mask", get_affinity(0), 1);
+    check("empty mask", set_affinity(0, 0), -1);
+    check("offline harts only", set_affinity(0, 1UL << 63), -1);
+    check("mask kept", get_affinity(0), 1);
+    check("no such process", set_affinity(1000, 1), -1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        uint64 inherited = get_affinity(0);
+        sleep_ns(100 * MS);
+        // The parent has moved it meanwhile.
+        exit(inherited == 1 ? (int)get_affinity(0) : -1);
+    }
+    check("move the child", set_affinity(pid, 2), 0);
+    check("child mask", get_affinity(pid), 2);
+    int status = 0;
+    wait_pid(pid, &status);
+    check("child saw", status, 2);
+    for (;;) {}
+}
@@ -0,0 +1,81 @@
+/*
+ * Test futexes: the threads add to a counter under a mutex, and hand items
+ * over through a one-slot buffer guarded by condition variables. It prints
+ * the counter, which should be 400000, and the sum of the items, which should
+ * be 19900.
+ */
+
+#include "system.h"
+#include "ulib.h"
+
+#define THREADS 4
+#define COUNT 100000
+#define ITEMS 200
+
+static struct mutex mutex = MUTEX_INITIALIZER;
+static int counter;
+
+static struct condvar not_empty = CONDVAR_INITIALIZER;
+static struct condvar not_full = CONDVAR_INITIALIZER;
+static int full;
+static int slot;
+static int sum;
+
+static volatile int tids[THREADS];
+
+static int add(void *arg) {
+    for (int i = 0; i < COUNT; i++) {
+        mutex_lock(&mutex);
+        counter++;
+        mutex_unlock(&mutex);
+    }
+    return 0;
+}
+
+static int produce(void *arg) {
+    for (int i = 0; i < ITEMS; i++) {
+        mutex_lock(&mutex);
+        while (full) condvar_wait(&not_full, &mutex);
+        slot = i;
+        full = 1;
+        condvar_signal(&not_empty);
+        mutex_unlock(&mutex);
+    }
+    return 0;
+}
+
+static int consume(void *arg) {
+    for (int i = 0; i < ITEMS; i++) {
+        mutex_lock(&mutex);
+        while (!full) condvar_wait(&not_empty, &mutex);
+        sum += slot;
+        full = 0;
+        condvar_signal(&not_full);
+        mutex_unlock(&mutex);
+    }
+    return 0;
+}
+
+static int start(int (*fn)(void *), volatile int *tid) {
+    if (thread_create(fn, NULL, NULL, tid) < 0) {
+        printf("thread_create failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main() {
+    for (int i = 0; i < THREADS; i++) {
+        if (start(add, &tids[i]) != 0) return 1;
+    }
+    for (int i = 0; i < THREADS; i++) thread_join(&tids[i]);
+    printf("%d\n", counter);
+
+    if (start(produce, &tids[0]) != 0 || start(consume, &tids[1]) != 0) {
+        return 1;
+    }
+    thread_join(&tids[0]);
+    thread_join(&tids[1]);
+    printf("%d\n", sum);
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*
+ * Test the memory limits and the accounting.
+ * The child caps its resident pages at 16 more than it has, and then grows its
+ * stack by 2MiB. It should be killed when the stack cannot grow any more, so
+ * the parent prints its own usage and the exit status of the child (-1, not 0).
+ * Then it checks that the charges are given back: a thread that has exited
+ * leaves the usage of the process as it was, and a child that has exited, but
+ * has not been waited for, has no pages left, only its task_struct.
+ */
+
+#include "system.h"
+#include "ulib.h"
+
+#define MS 1000000
+
+int grow(int depth) {
+    char buffer[1024];
+    if (depth >= 2048) return 0;
+    buffer[0] = (char)depth;
+    return grow(depth + 1) + buffer[0];
+}
+
+static int run(void *arg) {
+    return grow(1024);
+}
+
+static void check(const char *what, uint64 usage, uint64 expected) {
+    printf("%s: %d, expected %d, %s\n", what, (int)usage, (int)expected,
+           usage == expected ? "ok" : "FAILED");
+}
+
+int main() {
+    struct memory_usage usage;
+    if (get_memory_usage(0, &usage) == 0) {
+        printf("resident %d, page table %d, kernel objects %d\n",
+               (int)usage.usage[MEMORY_RESIDENT_PAGES],
+               (int)usage.usage[MEMORY_PAGETABLE_PAGES],
+               (int)usage.usage[MEMORY_KERNEL_OBJECTS]);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        get_memory_usage(0, &usage);
+        set_memory_limit(MEMORY_RESIDENT_PAGES,
+                         usage.usage[MEMORY_RESIDENT_PAGES] + 16);
+        grow(0);
+        exit(0);
+    }
+    int status = 0;
+    wait_pid(pid, &status);
+    printf("child exited with %d\n", status);
+
+    // The pages of the thread slot are unmapped as the thread exits. The
+    // page-table pages stay until the address space goes.
+    struct memory_usage before;
+    get_memory_usage(0, &before);
+    volatile int tid = 0;
+    if (thread_create(run, NULL, NULL, &tid) < 0) {
+        printf("thread_create failed\n");
+    }
+    thread_join(&tid);
+    get_memory_usage(0, &usage);
+    check("resident after a thread", usage.usage[MEMORY_RESIDENT_PAGES],
+          before.usage[MEMORY_RESIDENT_PAGES]);
+    check("kernel objects after a thread", usage.usage[MEMORY_KERNEL_OBJECTS],
+          before.usage[MEMORY_KERNEL_OBJECTS]);
+
+    // The child frees its memory before it becomes a zombie, which it stays
+    // until it is waited for, so its usage can still be read meanwhile.
+    pid = fork();
+    if (pid == 0) {
+        grow(1024);
+        exit(0);
+    }
+    for (int i = 0; i < 100; i++) {
+        if (get_memory_usage(pid, &usage) != 0 ||
+            usage.usage[MEMORY_RESIDENT_PAGES] == 0) {
+            break;
+        }
+        sleep_ns(10 * MS);
+    }
+    check("resident after exit", usage.usage[MEMORY_RESIDENT_PAGES], 0);
+    check("page table after exit", usage.usage[MEMORY_PAGETABLE_PAGES], 0);
+    check("kernel objects after exit", usage.usage[MEMORY_KERNEL_OBJECTS], 1);
+    wait_pid(pid, &status);
+    for (;;) {}
+}
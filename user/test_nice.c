@@ -0,0 +1,51 @@
+/*
+ * Test the nice() system call. Every line should end with "ok", except with
+ * the round-robin scheduler, which ignores the nice value.
+ * Two children share hart 0 and count for a second, one of them at nice 10,
+ * which should count less. Only init, which this test runs as, may lower its
+ * nice value; a child is refused.
+ */
+
+#include "system.h"
+#include "ulib.h"
+
+#define MS 1000000
+
+static void check(const char *what, int value, int expected) {
+    printf("%s: %d, expected %d, %s\n", what, value, expected,
+           value == expected ? "ok" : "FAILED");
+}
+
+// Count until the time is up, in thousands so that it fits the exit status.
+static void count(uint64 end) {
+    uint64 counted = 0;
+    while (get_time_ns() < end) counted++;
+    exit((int)(counted / 1000));
+}
+
+int main() {
+    set_affinity(0, 1);
+    uint64 end = get_time_ns() + 1000 * MS;
+    pid_t normal = fork();
+    if (normal == 0) count(end);
+    pid_t niced = fork();
+    if (niced == 0) {
+        nice(10);
+        count(end);
+    }
+    int normal_count = 0, niced_count = 0;
+    wait_pid(normal, &normal_count);
+    wait_pid(niced, &niced_count);
+    printf("nice 0 counted %d, nice 10 counted %d\n", normal_count,
+           niced_count);
+    check("nice 0 counted more", normal_count > niced_count, 1);
+
+    pid_t pid = fork();
+    if (pid == 0) exit(nice(-1));
+    int status = 0;
+    wait_pid(pid, &status);
+    check("a child lowering its nice", status, -1);
+    check("init lowering its nice", nice(-5), 0);
+    check("init raising it back", nice(5), 0);
+    for (;;) {}
+}
@@ -0,0 +1,94 @@
+/*
+ * Stress the OOM killer and compaction.
+ * Each child grows the stacks of THREADS threads by 3MiB and holds them for a
+ * while, and together they want more than the 128MiB of the machine. Some
+ * should be killed by the OOM killer (status 9) while the others exit with 0;
+ * none should crash the kernel. Meanwhile, while memory is full and
+ * fragmented, the parent runs echo a few times: exec needs a block of 2 pages,
+ * which compaction has to rebuild, or the OOM killer to free. Once all are
+ * done, one more child should run to the end (status 0), as the killed ones
+ * have given their memory back.
+ */
+
+#include "system.h"
+#include "ulib.h"
+
+#define CHILDREN 8
+#define THREADS 8
+#define DEPTH 3000
+#define MS 1000000
+#define HOLD_MS 500
+#define EXECS 4
+
+static int hold(int depth) {
+    char buffer[1024];
+    buffer[0] = (char)depth;
+    if (depth == 0) {
+        sleep_ns(HOLD_MS * MS);
+        return buffer[0];
+    }
+    return hold(depth - 1) + buffer[0];
+}
+
+static int run(void *arg) {
+    return hold(DEPTH);
+}
+
+static volatile int tids[THREADS];
+
+// Run the threads, fewer if memory is too short to start them all.
+static void child() {
+    int started = 0;
+    while (started < THREADS - 1 &&
+           thread_create(run, NULL, NULL, &tids[started]) >= 0) {
+        started++;
+    }
+    run(NULL);
+    for (int i = 0; i < started; i++) thread_join(&tids[i]);
+    exit(0);
+}
+
+int main() {
+    pid_t pids[CHILDREN];
+    for (int i = 0; i < CHILDREN; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) child();
+    }
+    sleep_ns(HOLD_MS / 2 * MS);
+    int echoed = 0;
+    for (int i = 0; i < EXECS; i++) {
+        char *argv[] = {"/echo", "compaction", NULL};
+        char *envp[] = {NULL};
+        pid_t pid = fork();
+        if (pid == 0) {
+            exec("/echo", argv, envp);
+            exit(-1);
+        }
+        int status = -1;
+        if (pid > 0 && wait_pid(pid, &status) == pid && status == 0) echoed++;
+    }
+    printf("echo ran %d of %d times\n", echoed, EXECS);
+    int exited = 0, killed = 0, failed = 0;
+    for (int i = 0; i < CHILDREN; i++) {
+        int status = 0;
+        if (pids[i] < 0) {
+            failed++;
+        } else if (wait_pid(pids[i], &status) < 0) {
+            failed++;
+        } else if (status == 0) {
+            exited++;
+        } else if (status == 9) {
+            killed++;
+        } else {
+            failed++;
+        }
+    }
+    printf("exited %d, killed %d, failed %d\n", exited, killed, failed);
+
+    pid_t pid = fork();
+    if (pid == 0) child();
+    int status = -1;
+    wait_pid(pid, &status);
+    printf("after the OOM kills: %d\n", status);
+    for (;;) {}
+}
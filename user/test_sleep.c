@@ -0,0 +1,28 @@
+/*
+ * Test the sleep_ns() and sleep_until() system calls.
+ * The child that sleeps less wakes up first, so it should print "12", and
+ * "!" if a sleep returns too early.
+ */
+
+#include "system.h"
+
+#define MS 1000000
+
+int main() {
+    uint64 start = get_time_ns();
+    if (fork() == 0) {
+        sleep_ns(20 * MS);
+        if (get_time_ns() - start < 20 * MS) put_char('!');
+        put_char('2');
+        exit(0);
+    }
+    if (fork() == 0) {
+        sleep_until(start + 10 * MS);
+        if (get_time_ns() < start + 10 * MS) put_char('!');
+        put_char('1');
+        exit(0);
+    }
+    wait(NULL);
+    wait(NULL);
+    for (;;) {}
+}
@@ -0,0 +1,39 @@
+/*
+ * Test threads: each thread counts in its own entry of a shared array, which
+ * it finds through its tp, and the main thread joins them and prints the
+ * total, which should be 400000. Run it with more than one hart to see the
+ * threads spread over them.
+ */
+
+#include "system.h"
+#include "ulib.h"
+
+#define THREADS 4
+#define COUNT 100000
+
+static int counts[THREADS];
+static volatile int tids[THREADS];
+
+static int count(void *arg) {
+    int *counter;
+    asm volatile("mv %0, tp" : "=r"(counter));
+    if (counter != &counts[(uint64)arg]) return -1;
+    for (int i = 0; i < COUNT; i++) (*(volatile int *)counter)++;
+    return 0;
+}
+
+int main() {
+    for (int i = 0; i < THREADS; i++) {
+        if (thread_create(count, (void *)(uint64)i, &counts[i], &tids[i]) < 0) {
+            printf("thread_create failed\n");
+            return 1;
+        }
+    }
+    int total = 0;
+    for (int i = 0; i < THREADS; i++) {
+        thread_join(&tids[i]);
+        total += counts[i];
+    }
+    printf("%d\n", total);
+    return 0;
+}
@@ -159,3 +159,43 @@ int printf(const char *format, ...) {
     va_end(args);
     return length;
 }
+
+void mutex_lock(struct mutex *mutex) {
+    int state = __sync_val_compare_and_swap(&mutex->state, 0, 1);
+    if (state == 0) return;
+    // Contended: mark it so that the holder wakes a sleeper up on unlock.
+    if (state != 2) state = __sync_lock_test_and_set(&mutex->state, 2);
+    while (state != 0) {
+        futex(&mutex->state, FUTEX_WAIT, 2);
+        state = __sync_lock_test_and_set(&mutex->state, 2);
+    }
+}
+
+int mutex_try_lock(struct mutex *mutex) {
+    return __sync_bool_compare_and_swap(&mutex->state, 0, 1);
+}
+
+void mutex_unlock(struct mutex *mutex) {
+    if (__sync_fetch_and_sub(&mutex->state, 1) != 1) {
+        mutex->state = 0;
+        futex(&mutex->state, FUTEX_WAKE, 1);
+    }
+}
+
+void condvar_wait(struct condvar *condvar, struct mutex *mutex) {
+    int sequence = condvar->sequence;
+    mutex_unlock(mutex);
+    // Returns at once if a signal has come since the mutex was released.
+    futex(&condvar->sequence, FUTEX_WAIT, sequence);
+    mutex_lock(mutex);
+}
+
+void condvar_signal(struct condvar *condvar) {
+    __sync_fetch_and_add(&condvar->sequence, 1);
+    futex(&condvar->sequence, FUTEX_WAKE, 1);
+}
+
+void condvar_broadcast(struct condvar *condvar) {
+    __sync_fetch_and_add(&condvar->sequence, 1);
+    futex(&condvar->sequence, FUTEX_WAKE, 0x7fffffff);
+}
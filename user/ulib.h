@@ -120,6 +120,58 @@ static inline int read_until(char *buffer, int max_length, char end) {
     return -1;
 }
 
+/**
+ * Wait until a thread from thread_create() has exited.
+ * @param tid where its ID was stored.
+ */
+static inline void thread_join(volatile int *tid) {
+    int id;
+    while ((id = *tid) != 0) futex(tid, FUTEX_WAIT, id);
+}
+
+// A mutex is 0 when unlocked, 1 when locked, and 2 when locked and other
+// threads may sleep on it, so that the kernel is only entered under
+// contention.
+struct mutex {
+    volatile int state;
+};
+
+#define MUTEX_INITIALIZER {0}
+
+// A condition variable counts its signals, so that a waiter does not sleep
+// through one sent after it has released the mutex.
+struct condvar {
+    volatile int sequence;
+};
+
+#define CONDVAR_INITIALIZER {0}
+
+void mutex_lock(struct mutex *mutex);
+
+/**
+ * Lock the mutex only if it is unlocked.
+ * @return 1 if it is locked now by this thread, 0 if not
+ */
+int mutex_try_lock(struct mutex *mutex);
+
+void mutex_unlock(struct mutex *mutex);
+
+/**
+ * Release the mutex and sleep until signaled, then lock the mutex again. The
+ * waiter may wake up without a signal, so it checks its condition in a loop.
+ */
+void condvar_wait(struct condvar *condvar, struct mutex *mutex);
+
+/**
+ * Wake up one waiter.
+ */
+void condvar_signal(struct condvar *condvar);
+
+/**
+ * Wake up all the waiters.
+ */
+void condvar_broadcast(struct condvar *condvar);
+
 int print_char(char c);
 int print_string(const char *s);
 int print_int(int64 n, bool sign, int base);